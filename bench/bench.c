@@ -0,0 +1,763 @@
+/*
+csgray - simple CSG raytracer
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/* csgbench - micro-benchmarks for the individual intersection and interval
+ * kernels in geom.c, run in isolation over large pre-generated ray sets.
+ * With -C it runs the convergence benchmark in converge.c instead.
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "csgray.h"
+#include "csgimpl.h"
+#include "geom.h"
+#include "timer.h"
+#include "bench.h"
+
+#define DFL_NUM_RAYS	(1 << 18)
+#define DFL_NUM_REPEAT	5
+#define DFL_REF_FNAME	"reference.pfm"
+#define DFL_REF_SAMPLES	1024
+#define DFL_REF_DEPTH	5
+
+enum { RAYS_HIT, RAYS_MISS, RAYS_GRAZE, NUM_RAY_SETS };
+static const char *rayset_name[] = {"hit", "miss", "graze"};
+
+enum { IV_OVERLAP, IV_DISJOINT, IV_NESTED, NUM_IV_SETS };
+static const char *ivset_name[] = {"overlap", "disjoint", "nested"};
+
+struct prim_kernel {
+	const char *name;
+	struct hinterv *(*func)(csg_ray*, const struct cscene*, const struct cnode*);
+	csg_object *obj;
+	struct cscene *scn;		/* obj compiled by itself */
+	float rad;		/* bounding radius, used to aim the ray sets */
+	float edge;		/* typical silhouette distance, for grazing rays */
+	csg_ray *rays[NUM_RAY_SETS];
+};
+
+struct iv_kernel {
+	const char *name;
+	struct hinterv *(*func)(struct hinterv*, struct hinterv*);
+};
+
+struct result {
+	double nsec;	/* best time per call, per thread */
+	double hit_ratio;
+};
+
+static int init_kernels(void);
+static void gen_rays(csg_ray *rays, int count, int type, csg_object *o, float rad, float edge);
+static void gen_plane_rays(csg_ray *rays, int count, int type, csg_object *o);
+static void gen_intervals(struct hinterv **ivs, int count, int type);
+static struct result run_prim(struct prim_kernel *k, int set);
+static struct result run_xform(csg_ray *rays, csg_object *o);
+static struct result run_interval(struct iv_kernel *k, struct hinterv **ivs);
+static void print_result(const char *kname, const char *set, struct result *res);
+static unsigned int xrand(void);
+static float xfrand(void);
+static int parse_list(const char *str, float *res, int max_items);
+static int parse_opt(int argc, char **argv);
+
+static struct prim_kernel prim_kernels[] = {
+	{"ray_sphere", ray_sphere},
+	{"ray_cylinder", ray_cylinder},
+	{"ray_box", ray_box},
+	{"ray_plane", ray_plane},
+	{"ray_box_moved", ray_box}
+};
+#define NUM_PRIM_KERNELS	(sizeof prim_kernels / sizeof *prim_kernels)
+
+static struct iv_kernel iv_kernels[] = {
+	{"interval_union", interval_union},
+	{"interval_isect", interval_isect},
+	{"interval_sub", interval_sub}
+};
+#define NUM_IV_KERNELS	(sizeof iv_kernels / sizeof *iv_kernels)
+
+static int num_rays = DFL_NUM_RAYS;
+static int num_repeat = DFL_NUM_REPEAT;
+static int num_threads = 1;
+static int first_cpu = 0;
+static int pin = 1;
+static const char *filter;
+static unsigned int rng_state = 0x2545f491;
+
+static int conv_mode;
+static struct conv_options conv_opt = {
+	DFL_REF_FNAME, DFL_REF_SAMPLES, DFL_REF_DEPTH,
+	320, 240,
+	{0.5, 1, 2, 4, 8}, 5,
+	{1, 3, 5}, 3,
+	CONV_DIRECT | CONV_GI
+};
+
+static struct hinterv **ivsets[NUM_IV_SETS];
+
+/* keeps the optimizer from throwing away the kernel results */
+static volatile float sink;
+
+
+int main(int argc, char **argv)
+{
+	int i, j;
+	struct result res;
+
+	if(parse_opt(argc, argv) == -1) {
+		return 1;
+	}
+
+	if(conv_mode) {
+		return converge_bench(filter, &conv_opt) == -1 ? 1 : 0;
+	}
+
+	if(csg_init() == -1 || init_kernels() == -1) {
+		return 1;
+	}
+
+	printf("%d rays per set, best of %d runs, %d thread(s)%s\n", num_rays, num_repeat,
+			num_threads, pin ? " pinned" : "");
+	printf("%-16s %-9s %10s %12s %8s\n", "kernel", "set", "ns/call", "Mcalls/s", "hits");
+
+	for(i=0; i<NUM_PRIM_KERNELS; i++) {
+		struct prim_kernel *k = prim_kernels + i;
+		if(filter && !strstr(k->name, filter)) continue;
+
+		for(j=0; j<NUM_RAY_SETS; j++) {
+			res = run_prim(k, j);
+			print_result(k->name, rayset_name[j], &res);
+		}
+	}
+
+	if(!filter || strstr("xform_ray", filter)) {
+		for(i=0; i<NUM_PRIM_KERNELS; i++) {
+			struct prim_kernel *k = prim_kernels + i;
+			res = run_xform(k->rays[RAYS_HIT], k->obj);
+			print_result("xform_ray", k->name + 4, &res);
+		}
+	}
+
+	for(i=0; i<NUM_IV_KERNELS; i++) {
+		struct iv_kernel *k = iv_kernels + i;
+		if(filter && !strstr(k->name, filter)) continue;
+
+		for(j=0; j<NUM_IV_SETS; j++) {
+			res = run_interval(k, ivsets[j]);
+			print_result(k->name, ivset_name[j], &res);
+		}
+	}
+
+	csg_destroy();
+	return 0;
+}
+
+static int init_kernels(void)
+{
+	int i, j;
+	csg_object *o;
+
+	/* the sphere and plane are only translated, which the intersection
+	 * functions special-case. The cylinder and the first box are rotated, to
+	 * measure the general matrix path, and the second box is only moved.
+	 */
+	o = csg_sphere(0.5, 0.2, -0.3, 1.0);
+	prim_kernels[0].obj = o;
+	prim_kernels[0].rad = prim_kernels[0].edge = 1.0f;
+
+	o = csg_cylinder(-0.3, -1, 0.2, 0.3, 1, -0.2, 0.8);
+	prim_kernels[1].obj = o;
+	prim_kernels[1].rad = sqrt(0.8 * 0.8 + o->cyl.height * o->cyl.height / 4.0);
+	prim_kernels[1].edge = 0.8f;
+
+	o = csg_box(0, 0, 0, 2.0, 1.0, 1.5);
+	csg_rotate(o, 30, 1, 1, 0);
+	csg_translate(o, 0.4, -0.2, 0.1);
+	prim_kernels[2].obj = o;
+	prim_kernels[2].rad = 0.5 * sqrt(2.0 * 2.0 + 1.0 + 1.5 * 1.5);
+	prim_kernels[2].edge = 0.75f;
+
+	o = csg_plane(0, -0.5, 0, 0, 1, 0);
+	prim_kernels[3].obj = o;
+	prim_kernels[3].rad = prim_kernels[3].edge = 1.0f;
+
+	o = csg_box(0.4, -0.2, 0.1, 2.0, 1.0, 1.5);
+	prim_kernels[4].obj = o;
+	prim_kernels[4].rad = prim_kernels[2].rad;
+	prim_kernels[4].edge = prim_kernels[2].edge;
+
+	for(i=0; i<NUM_PRIM_KERNELS; i++) {
+		struct prim_kernel *k = prim_kernels + i;
+		if(!k->obj) {
+			fprintf(stderr, "failed to create %s object\n", k->name);
+			return -1;
+		}
+		calc_bounds(k->obj);
+		if(!(k->scn = build_cscene(k->obj))) {
+			return -1;
+		}
+
+		for(j=0; j<NUM_RAY_SETS; j++) {
+			if(!(k->rays[j] = malloc(num_rays * sizeof *k->rays[j]))) {
+				perror("failed to allocate ray set");
+				return -1;
+			}
+			if(k->func == ray_plane) {
+				gen_plane_rays(k->rays[j], num_rays, j, k->obj);
+			} else {
+				gen_rays(k->rays[j], num_rays, j, k->obj, k->rad, k->edge);
+			}
+		}
+	}
+
+	for(i=0; i<NUM_IV_SETS; i++) {
+		if(!(ivsets[i] = malloc(num_rays * 2 * sizeof *ivsets[i]))) {
+			perror("failed to allocate interval set");
+			return -1;
+		}
+		gen_intervals(ivsets[i], num_rays, i);
+	}
+	return 0;
+}
+
+static void rand_dir(float *v)
+{
+	float len;
+	do {
+		v[0] = xfrand() * 2.0f - 1.0f;
+		v[1] = xfrand() * 2.0f - 1.0f;
+		v[2] = xfrand() * 2.0f - 1.0f;
+		len = v[0] * v[0] + v[1] * v[1] + v[2] * v[2];
+	} while(len > 1.0f || len < 1e-4f);
+
+	len = 1.0f / sqrt(len);
+	v[0] *= len;
+	v[1] *= len;
+	v[2] *= len;
+}
+
+/* Rays start on a sphere around the object and are aimed at:
+ * - hit:   a point well inside the bounding radius
+ * - miss:  a point 2-3 bounding radii off to the side
+ * - graze: so that they pass within +/-10% of the silhouette distance, where
+ *          most of the early-out branches in the kernels are exercised
+ */
+static void gen_rays(csg_ray *rays, int count, int type, csg_object *o, float rad, float edge)
+{
+	int i;
+	float c[3], dir[3], perp[3], targ[3], dist, dot;
+
+	c[0] = o->ob.xform[12];
+	c[1] = o->ob.xform[13];
+	c[2] = o->ob.xform[14];
+
+	for(i=0; i<count; i++) {
+		rand_dir(dir);
+		rays[i].x = c[0] + dir[0] * rad * 4.0f;
+		rays[i].y = c[1] + dir[1] * rad * 4.0f;
+		rays[i].z = c[2] + dir[2] * rad * 4.0f;
+
+		/* random direction perpendicular to the vector towards the center */
+		rand_dir(perp);
+		dot = perp[0] * dir[0] + perp[1] * dir[1] + perp[2] * dir[2];
+		perp[0] -= dir[0] * dot;
+		perp[1] -= dir[1] * dot;
+		perp[2] -= dir[2] * dot;
+		dot = sqrt(perp[0] * perp[0] + perp[1] * perp[1] + perp[2] * perp[2]);
+		if(dot > 1e-4f) {
+			perp[0] /= dot;
+			perp[1] /= dot;
+			perp[2] /= dot;
+		}
+
+		switch(type) {
+		case RAYS_HIT:
+			dist = xfrand() * rad * 0.5f;
+			break;
+		case RAYS_MISS:
+			dist = (2.0f + xfrand()) * rad;
+			break;
+		case RAYS_GRAZE:
+		default:
+			/* closest approach g to the center, for an origin 4 radii away */
+			dot = (0.9f + xfrand() * 0.2f) * edge;
+			dist = dot * 4.0f * rad / sqrt(16.0f * rad * rad - dot * dot);
+			break;
+		}
+
+		targ[0] = c[0] + perp[0] * dist;
+		targ[1] = c[1] + perp[1] * dist;
+		targ[2] = c[2] + perp[2] * dist;
+
+		rays[i].dx = targ[0] - rays[i].x;
+		rays[i].dy = targ[1] - rays[i].y;
+		rays[i].dz = targ[2] - rays[i].z;
+		rays[i].iter = 0;
+		rays[i].energy = 1.0f;
+	}
+}
+
+static void gen_plane_rays(csg_ray *rays, int count, int type, csg_object *o)
+{
+	int i;
+	float ypos = o->ob.xform[13];
+
+	for(i=0; i<count; i++) {
+		rays[i].x = xfrand() * 20.0f - 10.0f;
+		rays[i].z = xfrand() * 20.0f - 10.0f;
+		rays[i].dx = xfrand() * 2.0f - 1.0f;
+		rays[i].dz = xfrand() * 2.0f - 1.0f;
+
+		switch(type) {
+		case RAYS_HIT:
+			rays[i].y = ypos + 1.0f + xfrand() * 10.0f;
+			rays[i].dy = -0.2f - xfrand();
+			break;
+		case RAYS_MISS:
+			rays[i].y = ypos + 1.0f + xfrand() * 10.0f;
+			rays[i].dy = 0.2f + xfrand();
+			break;
+		case RAYS_GRAZE:
+		default:
+			rays[i].y = ypos + 0.01f + xfrand() * 0.1f;
+			rays[i].dy = (xfrand() - 0.5f) * 2e-5f;
+			break;
+		}
+		rays[i].iter = 0;
+		rays[i].energy = 1.0f;
+	}
+}
+
+static struct hinterv *rand_interval(float t0, float t1)
+{
+	struct hinterv *iv = alloc_hits(1);
+	iv->end[0].t = t0;
+	iv->end[1].t = t1;
+	iv->end[0].nx = iv->end[1].nx = 1.0f;
+	return iv;
+}
+
+/* pairs of single-interval lists, laid out as ivs[i * 2] and ivs[i * 2 + 1] */
+static void gen_intervals(struct hinterv **ivs, int count, int type)
+{
+	int i;
+	float t0, len;
+
+	for(i=0; i<count; i++) {
+		t0 = 1.0f + xfrand() * 10.0f;
+		len = 0.5f + xfrand() * 4.0f;
+		ivs[i * 2] = rand_interval(t0, t0 + len);
+
+		switch(type) {
+		case IV_OVERLAP:
+			t0 += (xfrand() - 0.5f) * len;
+			break;
+		case IV_DISJOINT:
+			t0 += len * (xfrand() < 0.5f ? -1.5f : 1.5f);
+			break;
+		case IV_NESTED:
+		default:
+			t0 += len * 0.25f;
+			len *= 0.5f;
+			break;
+		}
+		if(xrand() & 1) {
+			ivs[i * 2 + 1] = ivs[i * 2];
+			ivs[i * 2] = rand_interval(t0, t0 + len);
+		} else {
+			ivs[i * 2 + 1] = rand_interval(t0, t0 + len);
+		}
+	}
+}
+
+static struct result run_prim(struct prim_kernel *k, int set)
+{
+	int i, rep, nhits = 0;
+	double best = -1.0;
+	struct result res;
+
+#pragma omp parallel num_threads(num_threads) private(i, rep)
+	{
+		int tnum = 0;
+		double t0, dt;
+		float acc = 0.0f;
+		int count;
+		struct hinterv *hit;
+		csg_ray *rays = k->rays[set];
+
+#ifdef _OPENMP
+		tnum = omp_get_thread_num();
+#endif
+		if(pin) pin_thread(first_cpu + tnum);
+
+		for(rep=0; rep<=num_repeat; rep++) {
+#pragma omp barrier
+			count = 0;
+			t0 = get_time_nsec();
+			for(i=0; i<num_rays; i++) {
+				if((hit = k->func(rays + i, k->scn, k->scn->nodes))) {
+					acc += hit->end[0].t;
+					free_hit_list(hit);
+					count++;
+				}
+			}
+			dt = get_time_nsec() - t0;
+
+			/* the first run just warms up the caches and the allocator */
+			if(rep > 0) {
+#pragma omp critical
+				{
+					if(best < 0.0 || dt < best) best = dt;
+					if(tnum == 0) nhits = count;
+				}
+			}
+		}
+#pragma omp atomic
+		sink += acc;
+	}
+
+	res.nsec = best / num_rays;
+	res.hit_ratio = (double)nhits / (double)num_rays;
+	return res;
+}
+
+static struct result run_xform(csg_ray *rays, csg_object *o)
+{
+	int i, rep;
+	double best = -1.0;
+	struct result res;
+
+#pragma omp parallel num_threads(num_threads) private(i, rep)
+	{
+		int tnum = 0;
+		double t0, dt;
+		float acc = 0.0f;
+		csg_ray ray;
+
+#ifdef _OPENMP
+		tnum = omp_get_thread_num();
+#endif
+		if(pin) pin_thread(first_cpu + tnum);
+
+		for(rep=0; rep<=num_repeat; rep++) {
+#pragma omp barrier
+			t0 = get_time_nsec();
+			for(i=0; i<num_rays; i++) {
+				ray = rays[i];
+				xform_ray(&ray, o->ob.inv_xform);
+				acc += ray.x + ray.dx;
+			}
+			dt = get_time_nsec() - t0;
+
+			if(rep > 0) {
+#pragma omp critical
+				if(best < 0.0 || dt < best) best = dt;
+			}
+		}
+#pragma omp atomic
+		sink += acc;
+	}
+
+	res.nsec = best / num_rays;
+	res.hit_ratio = -1.0;
+	return res;
+}
+
+static struct result run_interval(struct iv_kernel *k, struct hinterv **ivs)
+{
+	int i, rep, nres = 0;
+	double best = -1.0;
+	struct result res;
+
+#pragma omp parallel num_threads(num_threads) private(i, rep)
+	{
+		int tnum = 0;
+		double t0, dt;
+		float acc = 0.0f;
+		int count;
+		struct hinterv *iv;
+
+#ifdef _OPENMP
+		tnum = omp_get_thread_num();
+#endif
+		if(pin) pin_thread(first_cpu + tnum);
+
+		for(rep=0; rep<=num_repeat; rep++) {
+#pragma omp barrier
+			count = 0;
+			t0 = get_time_nsec();
+			for(i=0; i<num_rays; i++) {
+				if((iv = k->func(ivs[i * 2], ivs[i * 2 + 1]))) {
+					acc += iv->end[0].t;
+					free_hit_list(iv);
+					count++;
+				}
+			}
+			dt = get_time_nsec() - t0;
+
+			if(rep > 0) {
+#pragma omp critical
+				{
+					if(best < 0.0 || dt < best) best = dt;
+					if(tnum == 0) nres = count;
+				}
+			}
+		}
+#pragma omp atomic
+		sink += acc;
+	}
+
+	res.nsec = best / num_rays;
+	res.hit_ratio = (double)nres / (double)num_rays;
+	return res;
+}
+
+static void print_result(const char *kname, const char *set, struct result *res)
+{
+	/* aggregate throughput of all threads running concurrently */
+	double mcalls = res->nsec > 0.0 ? 1e3 * num_threads / res->nsec : 0.0;
+
+	printf("%-16s %-9s %10.2f %12.2f ", kname, set, res->nsec, mcalls);
+	if(res->hit_ratio >= 0.0) {
+		printf("%7.1f%%\n", res->hit_ratio * 100.0);
+	} else {
+		printf("%8s\n", "-");
+	}
+}
+
+void pin_thread(int cpu)
+{
+#if defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if(sched_setaffinity(0, sizeof set, &set) == -1) {
+		perror("failed to set thread affinity");
+	}
+#elif defined(_WIN32)
+	if(!SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu)) {
+		fprintf(stderr, "failed to set thread affinity\n");
+	}
+#endif
+}
+
+/* xorshift, so that the ray sets are reproducible and independent of rand() */
+static unsigned int xrand(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static float xfrand(void)
+{
+	return (float)(xrand() & 0xffffff) / (float)0xffffff;
+}
+
+static void print_usage(const char *argv0)
+{
+	printf("Usage: %s [options] [kernel filter]\n", argv0);
+	printf("       %s -C [convergence options] <csg file>\n", argv0);
+	printf("Options:\n");
+	printf(" -n <count> number of rays in each ray set (default: %d)\n", DFL_NUM_RAYS);
+	printf(" -r <count> number of timed runs, best is reported (default: %d)\n", DFL_NUM_REPEAT);
+	printf(" -t <count> number of concurrent benchmark threads (default: 1)\n");
+	printf(" -c <cpu>   first cpu to pin threads to (default: 0)\n");
+	printf(" -p         don't pin threads to cpus\n");
+	printf(" -S <seed>  random seed for generating the ray sets\n");
+	printf(" -h         print usage information and exit\n");
+	printf("Convergence options:\n");
+	printf(" -f <file>  reference PFM image, rendered if missing (default: %s)\n", DFL_REF_FNAME);
+	printf(" -R <count> samples per pixel for the reference image (default: %d)\n", DFL_REF_SAMPLES);
+	printf(" -D <depth> max ray depth for the reference image (default: %d)\n", DFL_REF_DEPTH);
+	printf(" -s <WxH>   image resolution (default: 320x240)\n");
+	printf(" -T <list>  comma-separated time checkpoints in seconds (default: 0.5,1,2,4,8)\n");
+	printf(" -d <list>  comma-separated max ray depths for the GI integrators (default: 1,3,5)\n");
+	printf(" -i <list>  integrators to run: direct, gi, wavefront (default: direct,gi)\n");
+}
+
+static int parse_list(const char *str, float *res, int max_items)
+{
+	int count = 0;
+	char *endp;
+
+	while(*str && count < max_items) {
+		res[count++] = strtod(str, &endp);
+		if(endp == str || (*endp && *endp != ',')) {
+			return -1;
+		}
+		str = *endp ? endp + 1 : endp;
+	}
+	return *str ? -1 : count;
+}
+
+static int parse_opt(int argc, char **argv)
+{
+	int i;
+
+	for(i=1; i<argc; i++) {
+		if(argv[i][0] == '-') {
+			if(argv[i][2] == 0) {
+				switch(argv[i][1]) {
+				case 'n':
+					if(!argv[++i] || (num_rays = atoi(argv[i])) <= 0) {
+						fprintf(stderr, "-n must be followed by the number of rays\n");
+						return -1;
+					}
+					break;
+
+				case 'r':
+					if(!argv[++i] || (num_repeat = atoi(argv[i])) <= 0) {
+						fprintf(stderr, "-r must be followed by the number of runs\n");
+						return -1;
+					}
+					break;
+
+				case 't':
+					if(!argv[++i] || (num_threads = atoi(argv[i])) <= 0) {
+						fprintf(stderr, "-t must be followed by the number of threads\n");
+						return -1;
+					}
+					break;
+
+				case 'c':
+					if(!argv[++i] || (first_cpu = atoi(argv[i])) < 0) {
+						fprintf(stderr, "-c must be followed by a cpu number\n");
+						return -1;
+					}
+					break;
+
+				case 'p':
+					pin = 0;
+					break;
+
+				case 'S':
+					if(!argv[++i] || !(rng_state = strtoul(argv[i], 0, 0))) {
+						fprintf(stderr, "-S must be followed by a non-zero seed\n");
+						return -1;
+					}
+					break;
+
+				case 'C':
+					conv_mode = 1;
+					break;
+
+				case 'f':
+					if(!(conv_opt.ref_fname = argv[++i])) {
+						fprintf(stderr, "-f must be followed by the reference image filename\n");
+						return -1;
+					}
+					break;
+
+				case 'R':
+					if(!argv[++i] || (conv_opt.ref_samples = atoi(argv[i])) <= 0) {
+						fprintf(stderr, "-R must be followed by the number of reference samples\n");
+						return -1;
+					}
+					break;
+
+				case 'D':
+					if(!argv[++i] || (conv_opt.ref_depth = atoi(argv[i])) < 0) {
+						fprintf(stderr, "-D must be followed by the reference max ray depth\n");
+						return -1;
+					}
+					break;
+
+				case 's':
+					if(!argv[++i] || sscanf(argv[i], "%dx%d", &conv_opt.width, &conv_opt.height) != 2 ||
+							conv_opt.width <= 0 || conv_opt.height <= 0) {
+						fprintf(stderr, "-s must be followed by WIDTHxHEIGHT\n");
+						return -1;
+					}
+					break;
+
+				case 'T':
+					if(!argv[++i] || (conv_opt.num_checkpoints = parse_list(argv[i],
+								conv_opt.checkpoints, CONV_MAX_CHECKPOINTS)) <= 0) {
+						fprintf(stderr, "-T must be followed by a list of times in seconds\n");
+						return -1;
+					}
+					break;
+
+				case 'd':
+					{
+						int j;
+						float depths[CONV_MAX_DEPTHS];
+						if(!argv[++i] || (conv_opt.num_depths = parse_list(argv[i], depths,
+									CONV_MAX_DEPTHS)) <= 0) {
+							fprintf(stderr, "-d must be followed by a list of ray depths\n");
+							return -1;
+						}
+						for(j=0; j<conv_opt.num_depths; j++) {
+							conv_opt.depths[j] = (int)depths[j];
+						}
+					}
+					break;
+
+				case 'i':
+					if(!argv[++i]) {
+						fprintf(stderr, "-i must be followed by a list of integrators\n");
+						return -1;
+					}
+					conv_opt.integrators = 0;
+					if(strstr(argv[i], "direct")) conv_opt.integrators |= CONV_DIRECT;
+					if(strstr(argv[i], "gi")) conv_opt.integrators |= CONV_GI;
+					if(strstr(argv[i], "wavefront")) conv_opt.integrators |= CONV_WAVEFRONT;
+					if(!conv_opt.integrators) {
+						fprintf(stderr, "-i: no known integrators in: %s\n", argv[i]);
+						return -1;
+					}
+					break;
+
+				case 'h':
+					print_usage(argv[0]);
+					exit(0);
+
+				default:
+					fprintf(stderr, "invalid option: %s\n", argv[i]);
+					return -1;
+				}
+			} else {
+				fprintf(stderr, "invalid option: %s\n", argv[i]);
+				return -1;
+			}
+		} else {
+			if(filter) {
+				fprintf(stderr, "unexpected argument: %s\n", argv[i]);
+				return -1;
+			}
+			filter = argv[i];
+		}
+	}
+
+	if(conv_mode && !filter) {
+		fprintf(stderr, "you need to pass a scene file for the convergence benchmark\n");
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,50 @@
+/*
+csgray - simple CSG raytracer
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#define CONV_MAX_CHECKPOINTS	32
+#define CONV_MAX_DEPTHS			8
+
+enum {
+	CONV_DIRECT		= 1,	/* CSG_DEFAULT_SHADER */
+	CONV_GI			= 2,	/* CSG_GI_SHADER */
+	CONV_WAVEFRONT	= 4		/* CSG_GI_SHADER with CSG_OPT_WAVEFRONT */
+};
+
+struct conv_options {
+	const char *ref_fname;
+	int ref_samples, ref_depth;
+	int width, height;
+
+	float checkpoints[CONV_MAX_CHECKPOINTS];	/* seconds, ascending */
+	int num_checkpoints;
+	int depths[CONV_MAX_DEPTHS];				/* CSG_OPT_MAX_ITER settings */
+	int num_depths;
+	unsigned int integrators;					/* CONV_* bitmask */
+};
+
+/* converge.c: renders the scene progressively with every integrator/depth
+ * combination, and writes a CSV time-to-quality curve to stdout.
+ */
+int converge_bench(const char *scene_fname, struct conv_options *opt);
+
+/* bench.c */
+void pin_thread(int cpu);
+
+#endif	/* BENCH_H_ */
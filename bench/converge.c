@@ -0,0 +1,255 @@
+/*
+csgray - simple CSG raytracer
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/* convergence benchmark: error versus render time against a high-sample
+ * reference image, for every integrator and sampler setting.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include "csgray.h"
+#include "timer.h"
+#include "bench.h"
+
+/* keeps relMSE finite for black reference pixels */
+#define RELMSE_EPSILON	1e-2
+
+static int run(float *pixels, float *ref, struct conv_options *opt, const char *name, int depth);
+static void calc_error(float *pix, float *ref, int npix, double *rmse, double *relmse);
+static int render_reference(float *pixels, struct conv_options *opt);
+static float *load_pfm(const char *fname, int *xsz, int *ysz);
+static int save_pfm(const char *fname, float *pix, int xsz, int ysz);
+static int host_little_endian(void);
+
+int converge_bench(const char *scene_fname, struct conv_options *opt)
+{
+	int i, xsz, ysz, res = -1;
+	float *pixels = 0, *ref = 0;
+	long npix = (long)opt->width * opt->height;
+
+	if(csg_init() == -1) {
+		return -1;
+	}
+	if(csg_load(scene_fname) == -1) {
+		goto end;
+	}
+
+	if(!(pixels = malloc(npix * 3 * sizeof *pixels))) {
+		perror("failed to allocate framebuffer");
+		goto end;
+	}
+
+	if(!(ref = load_pfm(opt->ref_fname, &xsz, &ysz))) {
+		if(errno != ENOENT) {
+			goto end;
+		}
+		if(!(ref = malloc(npix * 3 * sizeof *ref))) {
+			perror("failed to allocate reference framebuffer");
+			goto end;
+		}
+		if(render_reference(ref, opt) == -1) {
+			goto end;
+		}
+	} else if(xsz != opt->width || ysz != opt->height) {
+		fprintf(stderr, "reference image %s is %dx%d, but rendering at %dx%d\n",
+				opt->ref_fname, xsz, ysz, opt->width, opt->height);
+		goto end;
+	}
+
+	printf("integrator,depth,time,samples,rmse,relmse\n");
+
+	if(opt->integrators & CONV_DIRECT) {
+		/* the direct lighting shader doesn't recurse, max depth is irrelevant */
+		csg_shader(CSG_DEFAULT_SHADER, 0);
+		if(run(pixels, ref, opt, "direct", -1) == -1) {
+			goto end;
+		}
+	}
+	if(opt->integrators & CONV_GI) {
+		csg_shader(CSG_GI_SHADER, 0);
+		for(i=0; i<opt->num_depths; i++) {
+			csg_option(CSG_OPT_MAX_ITER, opt->depths[i]);
+			if(run(pixels, ref, opt, "gi", opt->depths[i]) == -1) {
+				goto end;
+			}
+		}
+	}
+	if(opt->integrators & CONV_WAVEFRONT) {
+		csg_shader(CSG_GI_SHADER, 0);
+		csg_option(CSG_OPT_WAVEFRONT, 1);
+		for(i=0; i<opt->num_depths; i++) {
+			csg_option(CSG_OPT_MAX_ITER, opt->depths[i]);
+			if(run(pixels, ref, opt, "wavefront", opt->depths[i]) == -1) {
+				goto end;
+			}
+		}
+		csg_option(CSG_OPT_WAVEFRONT, 0);
+	}
+	res = 0;
+
+end:
+	free(pixels);
+	free(ref);
+	csg_destroy();
+	return res;
+}
+
+/* Render passes back to back, accumulating samples through the sample
+ * progression of csg_render_image. Only time spent rendering is counted, the
+ * error evaluation at each checkpoint is not.
+ */
+static int run(float *pixels, float *ref, struct conv_options *opt, const char *name, int depth)
+{
+	int sample = 0, cp = 0;
+	double t0, elapsed = 0.0, rmse, relmse;
+	int npix = opt->width * opt->height;
+
+	while(cp < opt->num_checkpoints) {
+		t0 = get_time_nsec();
+		csg_render_image(pixels, opt->width, opt->height, sample++);
+		elapsed += (get_time_nsec() - t0) * 1e-9;
+
+		while(cp < opt->num_checkpoints && elapsed >= opt->checkpoints[cp]) {
+			calc_error(pixels, ref, npix, &rmse, &relmse);
+			if(depth >= 0) {
+				printf("%s,%d,%.3f,%d,%g,%g\n", name, depth, elapsed, sample, rmse, relmse);
+			} else {
+				printf("%s,-,%.3f,%d,%g,%g\n", name, elapsed, sample, rmse, relmse);
+			}
+			fflush(stdout);
+			cp++;
+		}
+	}
+	return 0;
+}
+
+static void calc_error(float *pix, float *ref, int npix, double *rmse, double *relmse)
+{
+	int i;
+	double d, sqerr = 0.0, relerr = 0.0;
+
+	for(i=0; i<npix * 3; i++) {
+		d = pix[i] - ref[i];
+		sqerr += d * d;
+		relerr += d * d / ((double)ref[i] * ref[i] + RELMSE_EPSILON);
+	}
+	*rmse = sqrt(sqerr / (npix * 3));
+	*relmse = relerr / (npix * 3);
+}
+
+static int render_reference(float *pixels, struct conv_options *opt)
+{
+	int i;
+	double t0 = get_time_nsec();
+
+	fprintf(stderr, "%s not found, rendering reference image (%d samples, max depth %d)\n",
+			opt->ref_fname, opt->ref_samples, opt->ref_depth);
+
+	csg_shader(CSG_GI_SHADER, 0);
+	csg_option(CSG_OPT_MAX_ITER, opt->ref_depth);
+
+	for(i=0; i<opt->ref_samples; i++) {
+		csg_render_image(pixels, opt->width, opt->height, i);
+		if((i & 15) == 15) {
+			fprintf(stderr, "\r%d/%d", i + 1, opt->ref_samples);
+		}
+	}
+	fprintf(stderr, "\rdone in %.1f sec\n", (get_time_nsec() - t0) * 1e-9);
+
+	return save_pfm(opt->ref_fname, pixels, opt->width, opt->height);
+}
+
+static void swap_floats(float *buf, int count)
+{
+	int i;
+	unsigned char *p = (unsigned char*)buf, tmp;
+
+	for(i=0; i<count; i++) {
+		tmp = p[0]; p[0] = p[3]; p[3] = tmp;
+		tmp = p[1]; p[1] = p[2]; p[2] = tmp;
+		p += 4;
+	}
+}
+
+static float *load_pfm(const char *fname, int *xsz, int *ysz)
+{
+	int i, rowsz;
+	float scale;
+	float *pix;
+	FILE *fp;
+
+	if(!(fp = fopen(fname, "rb"))) {
+		return 0;
+	}
+	if(fscanf(fp, "PF %d %d %f", xsz, ysz, &scale) != 3 || fgetc(fp) == EOF ||
+			*xsz <= 0 || *ysz <= 0) {
+		fprintf(stderr, "%s is not an RGB PFM image\n", fname);
+		fclose(fp);
+		errno = EINVAL;
+		return 0;
+	}
+
+	rowsz = *xsz * 3;
+	if(!(pix = malloc(rowsz * *ysz * sizeof *pix))) {
+		perror("failed to allocate reference image");
+		fclose(fp);
+		return 0;
+	}
+
+	/* PFM scanlines are stored bottom to top */
+	for(i=0; i<*ysz; i++) {
+		float *row = pix + (*ysz - i - 1) * rowsz;
+		if(fread(row, sizeof *row, rowsz, fp) < rowsz) {
+			fprintf(stderr, "%s: unexpected end of file\n", fname);
+			free(pix);
+			fclose(fp);
+			errno = EINVAL;
+			return 0;
+		}
+		if((scale < 0.0f) != host_little_endian()) {
+			swap_floats(row, rowsz);
+		}
+	}
+	fclose(fp);
+	return pix;
+}
+
+static int save_pfm(const char *fname, float *pix, int xsz, int ysz)
+{
+	int i;
+	FILE *fp;
+
+	if(!(fp = fopen(fname, "wb"))) {
+		fprintf(stderr, "failed to open %s for writing: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	fprintf(fp, "PF\n%d %d\n%s\n", xsz, ysz, host_little_endian() ? "-1.0" : "1.0");
+
+	for(i=0; i<ysz; i++) {
+		fwrite(pix + (ysz - i - 1) * xsz * 3, sizeof *pix, xsz * 3, fp);
+	}
+	fclose(fp);
+	return 0;
+}
+
+static int host_little_endian(void)
+{
+	unsigned int val = 1;
+	return *(unsigned char*)&val == 1;
+}
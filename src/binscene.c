@@ -0,0 +1,898 @@
+/*
+csgray - simple CSG raytracer
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include "binscene.h"
+#include "geom.h"
+#include "material.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/* detects files written on a host with a different byte order */
+#define BYTE_ORDER_MARK	0x01020304
+
+struct bin_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t num_nodes;
+	uint32_t num_operands;
+	uint32_t num_materials;
+	uint32_t strtab_size;
+	uint32_t node_offs, operand_offs, material_offs, strtab_offs;
+
+	float vpos[3], vtarg[3];
+	float fov;
+	float ambient[3];
+};
+
+enum {
+	BNODE_ROOT	= 1,	/* top-level scene object */
+	BNODE_DEF	= 2		/* shared definition */
+};
+
+struct bin_node {
+	int32_t type;
+	uint32_t flags;
+	int32_t name;			/* string table offset, -1 for none */
+	int32_t child;			/* first operand table entry of csg operations, or the
+							 * node index of the definition of instances, or -1 */
+	int32_t num_children;	/* number of csg operands */
+	int32_t material;		/* material table index */
+	float param[4];			/* primitive dimensions, see get_params */
+	float xform[16], inv_xform[16];
+	float bmin[3], bmax[3];
+};
+
+struct bin_material {
+	int32_t name;			/* string table offset, -1 for anonymous materials */
+	int32_t metallic;
+	float color[3], emission[3];
+	float roughness, opacity;
+};
+
+struct writer {
+	struct bin_node *nodes;
+	int num_nodes;
+	int32_t *operands;		/* operand table, node indices of all csg operands */
+	int num_operands, max_operands;
+	struct bin_material *mtl;	/* every distinct material used */
+	struct material **mtl_src;	/* the material each entry was written from */
+	int num_mtl, max_mtl;
+	int *mtl_hash;				/* mtl entries by material address, -1 if empty */
+	int mtl_hash_size;
+	char *strtab;
+	int strtab_size, strtab_max;
+
+	csg_object **defs;		/* definitions in dependency order */
+	int *def_idx;			/* node index of each definition */
+	int num_defs, max_defs;
+};
+
+static int count_nodes(csg_object *o);
+static int add_operands(struct writer *w, int count);
+static int add_material(struct writer *w, struct material *m);
+static int *mtl_slot(struct writer *w, struct material *m);
+static int grow_mtl_hash(struct writer *w);
+static int collect_defs(struct writer *w, csg_object *o);
+static int find_def(struct writer *w, csg_object *def);
+static int write_node(struct writer *w, csg_object *o, unsigned int flags);
+static int add_string(struct writer *w, const char *s);
+static void get_params(csg_object *o, float *param);
+static void set_params(csg_object *o, float *param);
+static int valid_operand(struct bin_node *nodes, int idx, int child, int num_nodes);
+static int valid_node(struct bin_node *nodes, int32_t *operands, int idx, int start,
+		struct bin_header *hdr);
+static void *map_file(const char *fname, size_t *size);
+static void unmap_file(void *data, size_t size);
+
+
+int bin_scene_file(const char *fname)
+{
+	FILE *fp;
+	char magic[sizeof BINSCN_MAGIC - 1];
+	int res;
+
+	if(!(fp = fopen(fname, "rb"))) {
+		return 0;
+	}
+	res = fread(magic, 1, sizeof magic, fp) == sizeof magic &&
+		memcmp(magic, BINSCN_MAGIC, sizeof magic) == 0;
+	fclose(fp);
+	return res;
+}
+
+struct scene_arena *bin_load_scene(const char *fname, struct bin_scene_env *env, csg_object **roots,
+		struct material **mtllist)
+{
+	int i, j, start, max_ref;
+	void *data;
+	size_t size, arena_size;
+	struct bin_header *hdr;
+	struct bin_node *nodes, *n;
+	struct bin_material *bmtl;
+	int32_t *operands;
+	struct scene_arena *arena = 0;
+	struct material tmp, **mtl = 0;
+	csg_object *obj, *o, *tail = 0, **sub;
+	char *strtab;
+
+	if(!(data = map_file(fname, &size))) {
+		return 0;
+	}
+	hdr = data;
+
+	if(size < sizeof *hdr || memcmp(hdr->magic, BINSCN_MAGIC, sizeof hdr->magic) != 0) {
+		fprintf(stderr, "%s is not a compiled scene file\n", fname);
+		goto end;
+	}
+	if(hdr->byte_order != BYTE_ORDER_MARK) {
+		fprintf(stderr, "%s was compiled on a host with a different byte order\n", fname);
+		goto end;
+	}
+	if(hdr->version != BINSCN_VERSION) {
+		fprintf(stderr, "%s: unsupported compiled scene version %u, recompile it\n", fname,
+				(unsigned int)hdr->version);
+		goto end;
+	}
+	if(hdr->node_offs % sizeof(float) || hdr->node_offs > size ||
+			hdr->num_nodes > (size - hdr->node_offs) / sizeof *nodes ||
+			hdr->operand_offs % sizeof *operands || hdr->operand_offs > size ||
+			hdr->num_operands > (size - hdr->operand_offs) / sizeof *operands ||
+			hdr->material_offs % sizeof(float) || hdr->material_offs > size ||
+			hdr->num_materials > (size - hdr->material_offs) / sizeof *bmtl ||
+			hdr->strtab_offs > size || hdr->strtab_size > size - hdr->strtab_offs ||
+			(hdr->strtab_size && ((char*)data)[hdr->strtab_offs + hdr->strtab_size - 1] != 0)) {
+		fprintf(stderr, "%s: corrupted compiled scene file\n", fname);
+		goto end;
+	}
+	nodes = (struct bin_node*)((char*)data + hdr->node_offs);
+	operands = (int32_t*)((char*)data + hdr->operand_offs);
+	bmtl = (struct bin_material*)((char*)data + hdr->material_offs);
+	for(i=0; i<hdr->num_operands; i++) {
+		if(operands[i] < 0 || operands[i] >= hdr->num_nodes) {
+			fprintf(stderr, "%s: corrupted compiled scene operand %d\n", fname, i);
+			goto end;
+		}
+	}
+	for(i=0; i<hdr->num_materials; i++) {
+		if(bmtl[i].name < -1 || bmtl[i].name >= (int)hdr->strtab_size) {
+			fprintf(stderr, "%s: corrupted compiled scene material %d\n", fname, i);
+			goto end;
+		}
+	}
+
+	/* The nodes of each definition and top-level object are contiguous, and
+	 * instances only refer to definitions before the one they're part of.
+	 * Together with operands following their parent, that rules out cycles.
+	 */
+	start = max_ref = -1;
+	for(i=0; i<hdr->num_nodes; i++) {
+		n = nodes + i;
+		if(n->flags & (BNODE_ROOT | BNODE_DEF)) {
+			if(max_ref >= i) {
+				start = -1;		/* operands outside of their object */
+			} else {
+				start = i;
+			}
+		}
+		if(start < 0 || !valid_node(nodes, operands, i, start, hdr)) {
+			fprintf(stderr, "%s: corrupted compiled scene node %d\n", fname, i);
+			goto end;
+		}
+		if(n->type == OB_UNION || n->type == OB_INTERSECTION || n->type == OB_SUBTRACTION) {
+			for(j=0; j<n->num_children; j++) {
+				if(operands[n->child + j] > max_ref) max_ref = operands[n->child + j];
+			}
+		}
+	}
+
+	/* materials go to the material table, the loader holds a reference to each
+	 * until the objects have theirs
+	 */
+	if(!(mtl = calloc(hdr->num_materials + 1, sizeof *mtl))) {
+		perror("failed to allocate compiled scene materials");
+		goto end;
+	}
+	for(i=0; i<hdr->num_materials; i++) {
+		mtl_defaults(&tmp);
+		for(j=0; j<3; j++) {
+			(&tmp.r)[j] = bmtl[i].color[j];
+			(&tmp.emr)[j] = bmtl[i].emission[j];
+		}
+		tmp.roughness = bmtl[i].roughness;
+		tmp.opacity = bmtl[i].opacity;
+		tmp.metallic = bmtl[i].metallic;
+		calc_material(&tmp);
+
+		if(bmtl[i].name >= 0) {
+			mtl[i] = mtl_create(mtllist, (char*)data + hdr->strtab_offs + bmtl[i].name, &tmp);
+		} else {
+			mtl[i] = mtl_share(&tmp);
+		}
+		if(!mtl[i]) {
+			goto end;
+		}
+	}
+
+	/* arena header, then all the objects, the operand arrays, and a copy of the
+	 * string table
+	 */
+	arena_size = sizeof *arena + hdr->num_nodes * sizeof *obj +
+		hdr->num_operands * sizeof *sub + hdr->strtab_size;
+	if(!(arena = malloc(arena_size))) {
+		perror("failed to allocate scene arena");
+		goto end;
+	}
+	arena->next = 0;
+	arena->num_obj = hdr->num_nodes;
+	obj = (csg_object*)(arena + 1);
+	sub = (csg_object**)(obj + hdr->num_nodes);
+	strtab = (char*)(sub + hdr->num_operands);
+	for(i=0; i<hdr->num_operands; i++) {
+		sub[i] = obj + operands[i];
+	}
+	memcpy(strtab, (char*)data + hdr->strtab_offs, hdr->strtab_size);
+	memset(obj, 0, hdr->num_nodes * sizeof *obj);
+
+	*roots = 0;
+	for(i=0; i<hdr->num_nodes; i++) {
+		n = nodes + i;
+		o = obj + i;
+
+		o->ob.type = n->type;
+		o->ob.flags = OBF_ARENA | OBF_BOUNDS;
+		if(n->name >= 0) {
+			o->ob.name = strtab + n->name;
+			o->ob.flags |= OBF_ARENA_NAME;
+		}
+
+		o->ob.mtl = mtl[n->material];
+		mtl_ref(o->ob.mtl);
+
+		memcpy(o->ob.xform, n->xform, sizeof o->ob.xform);
+		memcpy(o->ob.inv_xform, n->inv_xform, sizeof o->ob.inv_xform);
+		calc_xform(o);
+		for(j=0; j<3; j++) {
+			o->ob.bmin[j] = n->bmin[j];
+			o->ob.bmax[j] = n->bmax[j];
+		}
+
+		if(n->type == OB_UNION || n->type == OB_INTERSECTION || n->type == OB_SUBTRACTION) {
+			o->csg.sub = sub + n->child;
+			o->csg.num_sub = o->csg.max_sub = n->num_children;
+			o->ob.flags |= OBF_ARENA_SUB;
+		} else if(n->type == OB_INSTANCE) {
+			o->inst.def = obj + n->child;
+		} else {
+			set_params(o, n->param);
+		}
+
+		if(n->flags & BNODE_ROOT) {
+			if(*roots) {
+				tail->ob.next = o;
+			} else {
+				*roots = o;
+			}
+			tail = o;
+		}
+	}
+
+	/* the operand hierarchies aren't stored, operands always come after their
+	 * operation, so build them bottom-up
+	 */
+	for(i=hdr->num_nodes - 1; i>=0; i--) {
+		o = obj + i;
+		if(o->ob.type == OB_UNION || o->ob.type == OB_INTERSECTION || o->ob.type == OB_SUBTRACTION) {
+			calc_csg_bounds(o);
+		}
+	}
+
+	for(i=0; i<3; i++) {
+		env->vpos[i] = hdr->vpos[i];
+		env->vtarg[i] = hdr->vtarg[i];
+		env->ambient[i] = hdr->ambient[i];
+	}
+	env->fov = hdr->fov;
+
+end:
+	if(mtl) {
+		for(i=0; i<hdr->num_materials; i++) {
+			mtl_release(mtl[i]);
+		}
+		free(mtl);
+	}
+	unmap_file(data, size);
+	return arena;
+}
+
+void bin_free_arena(struct scene_arena *arena)
+{
+	int i;
+	csg_object *o = (csg_object*)(arena + 1);
+
+	for(i=0; i<arena->num_obj; i++) {
+		if(o->ob.type == OB_UNION || o->ob.type == OB_INTERSECTION || o->ob.type == OB_SUBTRACTION) {
+			if(!(o->ob.flags & OBF_ARENA_SUB)) {
+				free(o->csg.sub);
+			}
+			free(o->csg.bvh);
+		}
+		/* objects which were never freed, like definitions, still hold theirs */
+		mtl_release(o->ob.mtl);
+		o++;
+	}
+	free(arena);
+}
+
+int bin_save_scene(const char *fname, csg_object *oblist, struct bin_scene_env *env)
+{
+	int i, num_roots = 0, res = -1;
+	FILE *fp = 0;
+	csg_object *o, **roots = 0;
+	struct bin_header hdr;
+	struct writer w;
+
+	memset(&w, 0, sizeof w);
+
+	o = oblist;
+	while(o) {
+		w.num_nodes += count_nodes(o);
+		if(collect_defs(&w, o) == -1) {
+			goto end;
+		}
+		num_roots++;
+		o = o->ob.next;
+	}
+	for(i=0; i<w.num_defs; i++) {
+		w.num_nodes += count_nodes(w.defs[i]);
+	}
+
+	if(!(roots = malloc(num_roots * sizeof *roots + 1)) ||
+			!(w.nodes = malloc(w.num_nodes * sizeof *w.nodes + 1))) {
+		perror("failed to allocate compiled scene nodes");
+		goto end;
+	}
+	o = oblist;
+	for(i=0; i<num_roots; i++) {
+		roots[i] = o;
+		o = o->ob.next;
+	}
+
+	/* write the objects in the order they were added, which the loader
+	 * preserves when adding them back.
+	 */
+	w.num_nodes = 0;
+	for(i=0; i<w.num_defs; i++) {
+		w.def_idx[i] = w.num_nodes;
+		calc_bounds(w.defs[i]);
+		if(write_node(&w, w.defs[i], BNODE_DEF) == -1) {
+			goto end;
+		}
+	}
+	for(i=num_roots - 1; i>=0; i--) {
+		calc_bounds(roots[i]);
+		if(write_node(&w, roots[i], BNODE_ROOT) == -1) {
+			goto end;
+		}
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, BINSCN_MAGIC, sizeof hdr.magic);
+	hdr.version = BINSCN_VERSION;
+	hdr.byte_order = BYTE_ORDER_MARK;
+	hdr.num_nodes = w.num_nodes;
+	hdr.num_operands = w.num_operands;
+	hdr.num_materials = w.num_mtl;
+	hdr.strtab_size = w.strtab_size;
+	hdr.node_offs = sizeof hdr;
+	hdr.operand_offs = hdr.node_offs + w.num_nodes * sizeof *w.nodes;
+	hdr.material_offs = hdr.operand_offs + w.num_operands * sizeof *w.operands;
+	hdr.strtab_offs = hdr.material_offs + w.num_mtl * sizeof *w.mtl;
+	for(i=0; i<3; i++) {
+		hdr.vpos[i] = env->vpos[i];
+		hdr.vtarg[i] = env->vtarg[i];
+		hdr.ambient[i] = env->ambient[i];
+	}
+	hdr.fov = env->fov;
+
+	if(!(fp = fopen(fname, "wb"))) {
+		fprintf(stderr, "failed to open %s for writing: %s\n", fname, strerror(errno));
+		goto end;
+	}
+	if(fwrite(&hdr, sizeof hdr, 1, fp) < 1 ||
+			fwrite(w.nodes, sizeof *w.nodes, w.num_nodes, fp) < w.num_nodes ||
+			fwrite(w.operands, sizeof *w.operands, w.num_operands, fp) < w.num_operands ||
+			fwrite(w.mtl, sizeof *w.mtl, w.num_mtl, fp) < w.num_mtl ||
+			fwrite(w.strtab, 1, w.strtab_size, fp) < w.strtab_size) {
+		fprintf(stderr, "failed to write compiled scene %s: %s\n", fname, strerror(errno));
+		goto end;
+	}
+	res = 0;
+
+end:
+	if(fp && fclose(fp) == EOF && res == 0) {
+		fprintf(stderr, "failed to write compiled scene %s: %s\n", fname, strerror(errno));
+		res = -1;
+	}
+	free(roots);
+	free(w.nodes);
+	free(w.operands);
+	free(w.mtl);
+	free(w.mtl_src);
+	free(w.mtl_hash);
+	free(w.strtab);
+	free(w.defs);
+	free(w.def_idx);
+	return res;
+}
+
+static int count_nodes(csg_object *o)
+{
+	int i, count = 1;
+
+	if(o->ob.type == OB_UNION || o->ob.type == OB_INTERSECTION || o->ob.type == OB_SUBTRACTION) {
+		for(i=0; i<o->csg.num_sub; i++) {
+			count += count_nodes(o->csg.sub[i]);
+		}
+	}
+	return count;
+}
+
+/* reserves count operand table entries, returning the first one, or -1 */
+static int add_operands(struct writer *w, int count)
+{
+	int first;
+
+	if(w->num_operands + count > w->max_operands) {
+		int newsz = w->max_operands ? w->max_operands * 2 : 256;
+		int32_t *tmp;
+
+		while(newsz < w->num_operands + count) newsz *= 2;
+
+		if(!(tmp = realloc(w->operands, newsz * sizeof *w->operands))) {
+			perror("failed to resize compiled scene operand table");
+			return -1;
+		}
+		w->operands = tmp;
+		w->max_operands = newsz;
+	}
+
+	first = w->num_operands;
+	w->num_operands += count;
+	return first;
+}
+
+/* Returns the material table index of m, adding it the first time. The
+ * entries are found by the address of the material they were written from,
+ * which is only known to this writer: materials are shared between contexts,
+ * which could be saving scenes at the same time.
+ */
+static int add_material(struct writer *w, struct material *m)
+{
+	int i, *slot;
+	struct bin_material *bm;
+
+	if(w->num_mtl * 2 >= w->mtl_hash_size && grow_mtl_hash(w) == -1) {
+		return -1;
+	}
+	slot = mtl_slot(w, m);
+	if(*slot >= 0) {
+		return *slot;
+	}
+
+	if(w->num_mtl >= w->max_mtl) {
+		int newsz = w->max_mtl ? w->max_mtl * 2 : 16;
+		struct bin_material *tmp;
+		struct material **tmp_src;
+
+		if(!(tmp = realloc(w->mtl, newsz * sizeof *w->mtl))) {
+			perror("failed to resize compiled scene material table");
+			return -1;
+		}
+		w->mtl = tmp;
+		if(!(tmp_src = realloc(w->mtl_src, newsz * sizeof *w->mtl_src))) {
+			perror("failed to resize compiled scene material table");
+			return -1;
+		}
+		w->mtl_src = tmp_src;
+		w->max_mtl = newsz;
+	}
+
+	bm = w->mtl + w->num_mtl;
+	memset(bm, 0, sizeof *bm);
+	if((bm->name = add_string(w, m->name)) == -2) {
+		return -1;
+	}
+	for(i=0; i<3; i++) {
+		bm->color[i] = (&m->r)[i];
+		bm->emission[i] = (&m->emr)[i];
+	}
+	bm->roughness = m->roughness;
+	bm->opacity = m->opacity;
+	bm->metallic = m->metallic;
+
+	w->mtl_src[w->num_mtl] = m;
+	*slot = w->num_mtl;
+	return w->num_mtl++;
+}
+
+/* the hash slot of m, or the empty slot it goes in */
+static int *mtl_slot(struct writer *w, struct material *m)
+{
+	unsigned int mask = w->mtl_hash_size - 1;
+	unsigned int h = (unsigned int)((uintptr_t)m / sizeof *m * 2654435761u) & mask;
+
+	while(w->mtl_hash[h] >= 0 && w->mtl_src[w->mtl_hash[h]] != m) {
+		h = (h + 1) & mask;
+	}
+	return w->mtl_hash + h;
+}
+
+/* doubles the hash table, which is kept at most half full */
+static int grow_mtl_hash(struct writer *w)
+{
+	int i, *tmp;
+	int newsz = w->mtl_hash_size ? w->mtl_hash_size * 2 : 64;
+
+	if(!(tmp = malloc(newsz * sizeof *tmp))) {
+		perror("failed to resize compiled scene material table");
+		return -1;
+	}
+	free(w->mtl_hash);
+	w->mtl_hash = tmp;
+	w->mtl_hash_size = newsz;
+
+	for(i=0; i<newsz; i++) {
+		w->mtl_hash[i] = -1;
+	}
+	for(i=0; i<w->num_mtl; i++) {
+		*mtl_slot(w, w->mtl_src[i]) = i;
+	}
+	return 0;
+}
+
+/* appends the definitions used by o which haven't been seen yet, after the
+ * definitions they use in turn
+ */
+static int collect_defs(struct writer *w, csg_object *o)
+{
+	int i;
+	csg_object *def;
+
+	switch(o->ob.type) {
+	case OB_UNION:
+	case OB_INTERSECTION:
+	case OB_SUBTRACTION:
+		for(i=0; i<o->csg.num_sub; i++) {
+			if(collect_defs(w, o->csg.sub[i]) == -1) {
+				return -1;
+			}
+		}
+		break;
+
+	case OB_INSTANCE:
+		def = o->inst.def;
+		if(find_def(w, def) >= 0) {
+			break;
+		}
+		if(collect_defs(w, def) == -1) {
+			return -1;
+		}
+
+		if(w->num_defs >= w->max_defs) {
+			int newsz = w->max_defs ? w->max_defs * 2 : 16;
+			csg_object **tmp;
+			int *tmpidx;
+
+			if(!(tmp = realloc(w->defs, newsz * sizeof *w->defs))) {
+				perror("failed to resize compiled scene definition list");
+				return -1;
+			}
+			w->defs = tmp;
+			if(!(tmpidx = realloc(w->def_idx, newsz * sizeof *w->def_idx))) {
+				perror("failed to resize compiled scene definition list");
+				return -1;
+			}
+			w->def_idx = tmpidx;
+			w->max_defs = newsz;
+		}
+		w->defs[w->num_defs++] = def;
+		break;
+
+	default:
+		break;
+	}
+	return 0;
+}
+
+static int find_def(struct writer *w, csg_object *def)
+{
+	int i;
+	for(i=0; i<w->num_defs; i++) {
+		if(w->defs[i] == def) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* appends o and its sub-objects in depth-first order, children always come
+ * after their parent
+ */
+static int write_node(struct writer *w, csg_object *o, unsigned int flags)
+{
+	int i, first, idx = w->num_nodes++;
+	struct bin_node *n = w->nodes + idx;
+
+	memset(n, 0, sizeof *n);
+	n->type = o->ob.type;
+	n->flags = flags;
+	if((n->name = add_string(w, o->ob.name)) == -2) {
+		return -1;
+	}
+	if((n->material = add_material(w, o->ob.mtl)) == -1) {
+		return -1;
+	}
+
+	memcpy(n->xform, o->ob.xform, sizeof n->xform);
+	memcpy(n->inv_xform, o->ob.inv_xform, sizeof n->inv_xform);
+	for(i=0; i<3; i++) {
+		n->bmin[i] = o->ob.bmin[i];
+		n->bmax[i] = o->ob.bmax[i];
+	}
+
+	n->child = -1;
+	if(o->ob.type == OB_UNION || o->ob.type == OB_INTERSECTION || o->ob.type == OB_SUBTRACTION) {
+		if((first = add_operands(w, o->csg.num_sub)) == -1) {
+			return -1;
+		}
+		n->child = first;
+		n->num_children = o->csg.num_sub;
+
+		for(i=0; i<o->csg.num_sub; i++) {
+			w->operands[first + i] = w->num_nodes;
+			if(write_node(w, o->csg.sub[i], 0) == -1) {
+				return -1;
+			}
+		}
+	} else if(o->ob.type == OB_INSTANCE) {
+		n->child = w->def_idx[find_def(w, o->inst.def)];
+	} else {
+		get_params(o, n->param);
+	}
+	return 0;
+}
+
+/* returns the string table offset of s, -1 for null strings, or -2 on error */
+static int add_string(struct writer *w, const char *s)
+{
+	int len, offs;
+
+	if(!s) return -1;
+
+	len = strlen(s) + 1;
+	if(w->strtab_size + len > w->strtab_max) {
+		int newsz = w->strtab_max ? w->strtab_max * 2 : 256;
+		char *tmp;
+
+		while(newsz < w->strtab_size + len) newsz *= 2;
+
+		if(!(tmp = realloc(w->strtab, newsz))) {
+			perror("failed to resize compiled scene string table");
+			return -2;
+		}
+		w->strtab = tmp;
+		w->strtab_max = newsz;
+	}
+
+	offs = w->strtab_size;
+	memcpy(w->strtab + offs, s, len);
+	w->strtab_size += len;
+	return offs;
+}
+
+static void get_params(csg_object *o, float *param)
+{
+	switch(o->ob.type) {
+	case OB_SPHERE:
+		param[0] = o->sph.rad;
+		break;
+
+	case OB_CYLINDER:
+		param[0] = o->cyl.rad;
+		param[1] = o->cyl.height;
+		break;
+
+	case OB_PLANE:
+		param[0] = o->plane.nx;
+		param[1] = o->plane.ny;
+		param[2] = o->plane.nz;
+		param[3] = o->plane.d;
+		break;
+
+	case OB_BOX:
+		param[0] = o->box.xsz;
+		param[1] = o->box.ysz;
+		param[2] = o->box.zsz;
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void set_params(csg_object *o, float *param)
+{
+	switch(o->ob.type) {
+	case OB_SPHERE:
+		o->sph.rad = param[0];
+		break;
+
+	case OB_CYLINDER:
+		o->cyl.rad = param[0];
+		o->cyl.height = param[1];
+		break;
+
+	case OB_PLANE:
+		o->plane.nx = param[0];
+		o->plane.ny = param[1];
+		o->plane.nz = param[2];
+		o->plane.d = param[3];
+		break;
+
+	case OB_BOX:
+		o->box.xsz = param[0];
+		o->box.ysz = param[1];
+		o->box.zsz = param[2];
+		break;
+
+	default:
+		break;
+	}
+}
+
+/* operands must follow their parent, and instances must refer to a definition
+ * before the object starting at node start
+ */
+static int valid_operand(struct bin_node *nodes, int idx, int child, int num_nodes)
+{
+	return child > idx && child < num_nodes && !(nodes[child].flags & (BNODE_ROOT | BNODE_DEF));
+}
+
+static int valid_node(struct bin_node *nodes, int32_t *operands, int idx, int start,
+		struct bin_header *hdr)
+{
+	int i;
+	struct bin_node *n = nodes + idx;
+
+	if(n->name < -1 || n->name >= (int)hdr->strtab_size ||
+			n->material < 0 || n->material >= (int)hdr->num_materials) {
+		return 0;
+	}
+
+	switch(n->type) {
+	case OB_UNION:
+	case OB_INTERSECTION:
+	case OB_SUBTRACTION:
+		if(n->child < 0 || n->num_children < 1 || n->child > (int)hdr->num_operands ||
+				n->num_children > (int)hdr->num_operands - n->child) {
+			return 0;
+		}
+		for(i=0; i<n->num_children; i++) {
+			if(!valid_operand(nodes, idx, operands[n->child + i], hdr->num_nodes)) {
+				return 0;
+			}
+		}
+		return 1;
+
+	case OB_INSTANCE:
+		return n->child >= 0 && n->child < start && (nodes[n->child].flags & BNODE_DEF);
+
+	case OB_NULL:
+	case OB_SPHERE:
+	case OB_CYLINDER:
+	case OB_PLANE:
+	case OB_BOX:
+		return 1;
+
+	default:
+		break;
+	}
+	return 0;
+}
+
+#ifdef _WIN32
+static void *map_file(const char *fname, size_t *size)
+{
+	HANDLE file, mapping;
+	LARGE_INTEGER fsz;
+	void *data = 0;
+
+	if((file = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, 0, 0)) == INVALID_HANDLE_VALUE) {
+		fprintf(stderr, "failed to open %s\n", fname);
+		return 0;
+	}
+	if(!GetFileSizeEx(file, &fsz) || fsz.QuadPart == 0) {
+		fprintf(stderr, "%s is not a compiled scene file\n", fname);
+		CloseHandle(file);
+		return 0;
+	}
+	*size = fsz.QuadPart;
+
+	if((mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0))) {
+		data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping);
+	}
+	CloseHandle(file);
+
+	if(!data) {
+		fprintf(stderr, "failed to map %s\n", fname);
+	}
+	return data;
+}
+
+static void unmap_file(void *data, size_t size)
+{
+	UnmapViewOfFile(data);
+}
+
+#else	/* !WIN32 */
+
+static void *map_file(const char *fname, size_t *size)
+{
+	int fd;
+	struct stat st;
+	void *data;
+
+	if((fd = open(fname, O_RDONLY)) == -1) {
+		fprintf(stderr, "failed to open %s: %s\n", fname, strerror(errno));
+		return 0;
+	}
+	if(fstat(fd, &st) == -1 || st.st_size == 0) {
+		fprintf(stderr, "%s is not a compiled scene file\n", fname);
+		close(fd);
+		return 0;
+	}
+	*size = st.st_size;
+
+	data = mmap(0, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if(data == MAP_FAILED) {
+		fprintf(stderr, "failed to map %s: %s\n", fname, strerror(errno));
+		return 0;
+	}
+	return data;
+}
+
+static void unmap_file(void *data, size_t size)
+{
+	munmap(data, size);
+}
+#endif
@@ -0,0 +1,70 @@
+/*
+csgray - simple CSG raytracer
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef BINSCENE_H_
+#define BINSCENE_H_
+
+#include "csgimpl.h"
+
+/* Compiled scene files are a header, followed by a flat array of nodes in
+ * depth-first order, the operand and material tables, and a string table. They
+ * store the final object matrices and bounds, and are written in host byte
+ * order. Shared definitions come first, and are written once no matter how many
+ * instances refer to them. So are materials, however many objects use them.
+ *
+ * version 2: instances and definitions
+ * version 3: operations with any number of operands, in an operand table
+ *            between the nodes and the string table
+ * version 4: a material table, which the nodes refer to
+ */
+#define BINSCN_MAGIC	"CSGRAYB\n"
+#define BINSCN_VERSION	4
+
+/* everything in a scene file which isn't an object */
+struct bin_scene_env {
+	float vpos[3], vtarg[3];
+	float fov;					/* degrees */
+	float ambient[3];
+};
+
+/* All objects of a loaded compiled scene live in a single arena allocation,
+ * which has to outlive them. Free it with bin_free_arena.
+ */
+struct scene_arena {
+	struct scene_arena *next;
+	int num_obj;
+};
+
+/* returns 1 if fname starts with the compiled scene magic */
+int bin_scene_file(const char *fname);
+
+/* loads a compiled scene, returning the arena with all its objects. The
+ * top-level objects are returned through roots, linked with ob.next in the
+ * order they were originally added, and its named materials are added to
+ * mtllist.
+ */
+struct scene_arena *bin_load_scene(const char *fname, struct bin_scene_env *env, csg_object **roots,
+		struct material **mtllist);
+/* frees the arena, and whatever its objects allocated after loading */
+void bin_free_arena(struct scene_arena *arena);
+
+/* writes the objects of oblist (linked with ob.next, most recently added
+ * first, like the scene object list) to a compiled scene file.
+ */
+int bin_save_scene(const char *fname, csg_object *oblist, struct bin_scene_env *env);
+
+#endif	/* BINSCENE_H_ */
@@ -0,0 +1,260 @@
+/*
+csgray - simple CSG raytracer
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cscene.h"
+#include "geom.h"
+
+static void reset_ids(csg_object *o);
+static void count_nodes(csg_object *o, struct cscene *sc);
+static int emit_node(csg_object *o, struct cscene *sc);
+static int emit_block(const struct bvh_node *leaf, struct cscene *sc);
+
+/* Objects are counted first, so that everything fits in one allocation, and
+ * then written out. Object IDs mark the definitions already counted or written.
+ */
+struct cscene *build_cscene(csg_object *oblist)
+{
+	int i;
+	size_t size;
+	struct cscene count, *sc;
+	csg_object *o;
+
+	memset(&count, 0, sizeof count);
+	for(o=oblist; o; o=o->ob.next) {
+		reset_ids(o);
+	}
+	for(o=oblist; o; o=o->ob.next) {
+		count_nodes(o, &count);
+		count.num_roots++;
+	}
+
+	size = sizeof *sc + count.num_nodes * (sizeof *sc->objects + sizeof *sc->nodes) +
+		count.num_blocks * sizeof *sc->blocks + count.num_bvh * sizeof *sc->bvh +
+		(count.num_operands + count.num_roots) * sizeof(int);
+	if(!(sc = malloc(size))) {
+		perror("failed to allocate compiled scene");
+		return 0;
+	}
+	/* pointers first, for their alignment */
+	sc->objects = (csg_object**)(sc + 1);
+	sc->nodes = (struct cnode*)(sc->objects + count.num_nodes);
+	sc->blocks = (struct leaf_block*)(sc->nodes + count.num_nodes);
+	sc->bvh = (struct bvh_node*)(sc->blocks + count.num_blocks);
+	sc->operands = (int*)(sc->bvh + count.num_bvh);
+	sc->roots = sc->operands + count.num_operands;
+
+	sc->num_nodes = sc->num_bvh = sc->num_blocks = sc->num_operands = 0;
+	sc->num_roots = count.num_roots;
+
+	i = 0;
+	for(o=oblist; o; o=o->ob.next) {
+		sc->roots[i] = emit_node(o, sc);
+		if(o->ob.light_source) {
+			sc->nodes[sc->roots[i]].flags |= CNODE_LIGHT;
+		}
+		i++;
+	}
+	return sc;
+}
+
+static void reset_ids(csg_object *o)
+{
+	int i;
+
+	o->ob.id = -1;
+
+	switch(o->ob.type) {
+	case OB_UNION:
+	case OB_INTERSECTION:
+	case OB_SUBTRACTION:
+		for(i=0; i<o->csg.num_sub; i++) {
+			reset_ids(o->csg.sub[i]);
+		}
+		break;
+
+	case OB_INSTANCE:
+		reset_ids(o->inst.def);
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void count_nodes(csg_object *o, struct cscene *sc)
+{
+	int i;
+	struct bvh_node *bn;
+
+	sc->num_nodes++;
+
+	switch(o->ob.type) {
+	case OB_UNION:
+	case OB_INTERSECTION:
+	case OB_SUBTRACTION:
+		sc->num_operands += o->csg.num_sub;
+		if(o->csg.bvh) {
+			sc->num_bvh += o->csg.num_bvh;
+			for(i=0; i<o->csg.num_bvh; i++) {
+				bn = o->csg.bvh + i;
+				if(bn->count && leaf_block_type(o->csg.sub + bn->first, bn->count) != -1) {
+					sc->num_blocks++;
+				}
+			}
+		}
+		for(i=0; i<o->csg.num_sub; i++) {
+			count_nodes(o->csg.sub[i], sc);
+		}
+		break;
+
+	case OB_INSTANCE:
+		if(o->inst.def->ob.id == -1) {
+			o->inst.def->ob.id = -2;
+			count_nodes(o->inst.def, sc);
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+/* writes the node of o, followed by its subtree, and returns its index */
+static int emit_node(csg_object *o, struct cscene *sc)
+{
+	int i, idx, nbvh;
+	struct cnode *n;
+	struct bvh_node *bn;
+
+	idx = sc->num_nodes++;
+	sc->objects[idx] = o;
+	o->ob.id = idx;
+
+	n = sc->nodes + idx;
+	memset(n, 0, sizeof *n);
+	n->type = o->ob.type;
+	n->xform_class = o->ob.xform_class;
+	memcpy(n->bmin, o->ob.bmin, sizeof n->bmin);
+	memcpy(n->bmax, o->ob.bmax, sizeof n->bmax);
+	memcpy(n->inv, o->ob.inv3x4, sizeof n->inv);
+
+	switch(o->ob.type) {
+	case OB_SPHERE:
+		n->u.param[0] = o->sph.rad;
+		break;
+
+	case OB_CYLINDER:
+		n->u.param[0] = o->cyl.rad;
+		n->u.param[1] = o->cyl.height;
+		break;
+
+	case OB_PLANE:
+		n->u.param[0] = o->plane.nx;
+		n->u.param[1] = o->plane.ny;
+		n->u.param[2] = o->plane.nz;
+		n->u.param[3] = o->plane.d;
+		break;
+
+	case OB_BOX:
+		n->u.param[0] = o->box.xsz;
+		n->u.param[1] = o->box.ysz;
+		n->u.param[2] = o->box.zsz;
+		break;
+
+	case OB_UNION:
+	case OB_INTERSECTION:
+	case OB_SUBTRACTION:
+		n->u.op.child = sc->num_operands;
+		n->u.op.num_child = o->csg.num_sub;
+		sc->num_operands += o->csg.num_sub;
+
+		if(o->csg.bvh) {
+			n->u.op.bvh = sc->num_bvh;
+			n->u.op.bvh_start = n->u.op.child + o->csg.bvh_start;
+
+			nbvh = o->csg.num_bvh;
+			bn = sc->bvh + sc->num_bvh;
+			memcpy(bn, o->csg.bvh, nbvh * sizeof *bn);
+			for(i=0; i<nbvh; i++) {
+				bn[i].first += n->u.op.child;
+				if(!bn[i].count) {
+					bn[i].second += n->u.op.bvh;
+				}
+			}
+			sc->num_bvh += nbvh;
+		} else {
+			n->u.op.bvh = -1;
+			n->u.op.bvh_start = n->u.op.child + o->csg.num_sub;
+		}
+
+		for(i=0; i<o->csg.num_sub; i++) {
+			sc->operands[n->u.op.child + i] = emit_node(o->csg.sub[i], sc);
+		}
+
+		/* blocks copy the operand nodes, so they come last */
+		if(o->csg.bvh) {
+			bn = sc->bvh + n->u.op.bvh;
+			for(i=0; i<o->csg.num_bvh; i++) {
+				if(bn[i].count) {
+					bn[i].second = -1;
+					if(leaf_block_type(o->csg.sub + o->csg.bvh[i].first, bn[i].count) != -1) {
+						bn[i].second = emit_block(bn + i, sc);
+					}
+				}
+			}
+		}
+		break;
+
+	case OB_INSTANCE:
+		n->u.op.child = o->inst.def->ob.id;
+		if(n->u.op.child < 0) {
+			n->u.op.child = emit_node(o->inst.def, sc);
+		}
+		break;
+
+	default:
+		break;
+	}
+	return idx;
+}
+
+/* copies the primitives of a hierarchy leaf to a new leaf block, and returns
+ * its index
+ */
+static int emit_block(const struct bvh_node *leaf, struct cscene *sc)
+{
+	int i, j, idx = sc->num_blocks++;
+	struct leaf_block *blk = sc->blocks + idx;
+	const struct cnode *n;
+
+	blk->count = leaf->count;
+
+	for(i=0; i<LEAF_BLOCK_SIZE; i++) {
+		n = sc->nodes + sc->operands[leaf->first + (i < leaf->count ? i : leaf->count - 1)];
+		blk->type = n->type;
+		for(j=0; j<12; j++) {
+			blk->inv[j][i] = n->inv[j];
+		}
+		for(j=0; j<3; j++) {
+			blk->param[j][i] = n->u.param[j];
+		}
+	}
+	return idx;
+}
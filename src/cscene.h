@@ -0,0 +1,91 @@
+/*
+csgray - simple CSG raytracer
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef CSCENE_H_
+#define CSCENE_H_
+
+#include "csgimpl.h"
+
+/* node flags */
+enum {
+	CNODE_LIGHT		= 1		/* top-level light source, skipped by GI rays */
+};
+
+/* The compact form of an object, with only what ray traversal needs. The index
+ * of a node is its ID: the object it was built from, which has everything else
+ * (materials, names), is at the same index of the object table.
+ */
+struct cnode {
+	unsigned char type;			/* OB_* */
+	unsigned char xform_class;	/* XFORM_* */
+	unsigned short flags;
+	float bmin[3], bmax[3];
+	float inv[12];				/* world to local rows, see inv3x4 */
+	union {
+		float param[4];			/* primitive dimensions */
+		struct {
+			int child;			/* ops: first operand entry, instances: definition node */
+			int num_child;
+			int bvh;			/* first hierarchy node, or -1 */
+			int bvh_start;		/* operand entry the hierarchy starts at */
+		} op;
+	} u;
+};
+
+/* primitives per leaf block: the SIMD width, 4 for SSE */
+#ifndef LEAF_BLOCK_SIZE
+#define LEAF_BLOCK_SIZE	4
+#endif
+
+/* The primitives of a hierarchy leaf, all of the same type, laid out for
+ * intersecting a ray with all of them at once. Unused slots repeat the last
+ * primitive.
+ */
+struct leaf_block {
+	float inv[12][LEAF_BLOCK_SIZE];		/* world to local rows */
+	float param[3][LEAF_BLOCK_SIZE];	/* primitive dimensions */
+	int type, count;
+};
+
+/* A compiled scene lives in a single allocation, with the nodes of every
+ * subtree contiguous in depth-first order. Operations find their operands
+ * through the operand table, and hierarchy nodes refer to operand entries and
+ * other hierarchy nodes by absolute index, and leaves of same type primitives
+ * to a leaf block with a copy of them. Definitions appear once, however
+ * many instances refer to them.
+ */
+struct cscene {
+	struct cnode *nodes;
+	int num_nodes;
+	struct bvh_node *bvh;
+	int num_bvh;
+	struct leaf_block *blocks;	/* referred to by hierarchy leaves */
+	int num_blocks;
+	int *operands;
+	int num_operands;
+	int *roots;					/* most recently added first */
+	int num_roots;
+	csg_object **objects;		/* the object each node was built from */
+};
+
+/* builds the compact form of the top-level objects in oblist, linked with
+ * ob.next, whose bounds must be up to date. Returns null on failure. The whole
+ * thing is freed with free().
+ */
+struct cscene *build_cscene(csg_object *oblist);
+
+#endif	/* CSCENE_H_ */
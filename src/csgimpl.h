@@ -28,13 +28,39 @@ enum {
 	OB_BOX,
 	OB_UNION,
 	OB_INTERSECTION,
-	OB_SUBTRACTION
+	OB_SUBTRACTION,
+	OB_INSTANCE
 };
 
-struct object {
-	int type;
+/* transformation classes, see calc_xform */
+enum {
+	XFORM_IDENTITY,
+	XFORM_TRANSLATE,
+	XFORM_USCALE,		/* positive uniform scale and translation */
+	XFORM_RIGID,		/* rotation and translation, normals keep their length */
+	XFORM_GENERAL
+};
 
-	char *name;
+/* object flags */
+enum {
+	OBF_ARENA		= 1,	/* allocated in a scene arena, not freed individually */
+	OBF_ARENA_NAME	= 2,	/* name points into a scene arena string table */
+	OBF_BOUNDS		= 4,	/* bmin/bmax are up to date */
+	OBF_ARENA_SUB	= 8		/* CSG operand array is in a scene arena */
+};
+
+/* material flags */
+enum {
+	MTL_SHARED		= 1		/* in the material table or named, and never modified */
+};
+
+/* Surface properties. Objects share materials from the material table, see
+ * material.h, and get a private copy while they're being modified.
+ */
+struct material {
+	char *name;				/* named materials stay in their list while unused */
+	unsigned int flags;
+	int nref;
 
 	float r, g, b;
 	float emr, emg, emb;
@@ -42,7 +68,33 @@ struct object {
 	float opacity;
 	int metallic;
 
+	/* shading constants, derived from the above by calc_material */
+	int emissive;
+	float gloss;			/* 1 - roughness */
+	float shininess;		/* phong exponent */
+	float lum, inv_lum;		/* luminance of the color */
+	float diff_tint[3];		/* color / lum, for diffuse bounces sampled by lum */
+	float spec_weight;		/* scales the specular bounce probability */
+	float spec_tint[3];		/* the color for metals, white otherwise */
+	float spec_gi_tint[3];	/* color / lum for metals, white otherwise */
+
+	struct material *next, *hnext;
+};
+
+struct object {
+	int type;
+	unsigned int flags;
+
+	char *name;
+	struct material *mtl;
+
 	float xform[16], inv_xform[16];
+	/* derived from inv_xform by calc_xform, for the intersection functions */
+	int xform_class;
+	float inv3x4[12];			/* world to local rows: local x = row 0 . (x, y, z, 1) */
+	float bmin[3], bmax[3];		/* world space bounds, see calc_bounds */
+
+	int id;						/* node index in the last compiled scene, see cscene.h */
 
 	csg_object *next;
 	csg_object *plt_next;
@@ -72,9 +124,39 @@ struct box {
 	float xsz, ysz, zsz;
 };
 
+/* bounding volume hierarchy node over the operands of a CSG operation. Inner
+ * nodes are followed by their first child, leaves have a range of operands.
+ */
+struct bvh_node {
+	float bmin[3], bmax[3];
+	int first, count;	/* leaves: operand range, count is 0 for inner nodes */
+	int second;			/* inner nodes: index of the second child,
+						 * leaves: leaf block in a compiled scene, or -1 */
+};
+
+/* Subtractions cut sub[1] ... sub[num_sub - 1] out of sub[0]. Unions and
+ * subtractions with enough bounded operands keep a hierarchy over
+ * sub[bvh_start] ... sub[num_sub - 1], built with the bounds, which orders
+ * those operands to match it. The operands before bvh_start are always tested.
+ * Intersections order their operands by the estimates below instead.
+ */
 struct csgop {
 	struct object ob;
-	csg_object *a, *b;
+	csg_object **sub;
+	int num_sub, max_sub;
+
+	struct bvh_node *bvh;
+	int num_bvh, bvh_start;
+
+	/* estimates for a ray reaching the bounds, see calc_csg_bounds */
+	float cost;			/* primitive tests */
+	float hit_prob;		/* chance of hitting anything */
+};
+
+/* the definition is shared between instances, and isn't owned by them */
+struct instance {
+	struct object ob;
+	csg_object *def;
 };
 
 union csg_object {
@@ -84,6 +166,7 @@ union csg_object {
 	struct plane plane;
 	struct box box;
 	struct csgop csg;
+	struct instance inst;
 };
 
 struct camera {
@@ -93,9 +176,19 @@ struct camera {
 	float fov;
 
 	float xform[16];
+	float inv_xform[16];	/* world to camera, for csg_project */
 };
 
+/* per-thread statistics counters, merged by csg_render_image */
+extern struct csg_stats csg_tstats;
+extern int csg_tdepth;
+#pragma omp threadprivate(csg_tstats, csg_tdepth)
+
+#define STAT_INC(x)		(csg_tstats.x++)
+#define STAT_ADD(x, n)	(csg_tstats.x += (n))
+
+/* set while the thread renders the pixel selected by csg_debug_pixel */
 extern int csg_dbg_pixel;
-extern int csg_dbg_pixel_x, csg_dbg_pixel_y;
+#pragma omp threadprivate(csg_dbg_pixel)
 
 #endif	/* CSGIMPL_H_ */
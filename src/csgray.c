@@ -25,58 +25,254 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "matrix.h"
 #include "mathutil.h"
 #include "geom.h"
+#include "timer.h"
+#include "binscene.h"
+#include "optimize.h"
+#include "cscene.h"
+#include "material.h"
+#include "tiles.h"
+
+/* render_packet looks up the tile of a packet by its first pixel */
+#if TILE_SIZE % PACKET_W || TILE_SIZE % PACKET_H
+#error "TILE_SIZE must be a multiple of the packet dimensions"
+#endif
 
 int csg_dbg_pixel;
-int csg_dbg_pixel_x, csg_dbg_pixel_y;
 
-static void calc_primary_ray(csg_ray *ray, int x, int y, int w, int h, float aspect, int sample);
+struct csg_stats csg_tstats;
+int csg_tdepth;
+
+struct wf_path;
+struct wf_shadow;
+
+static void calc_primary_ray(csg_context *ctx, csg_ray *ray, int x, int y, int w, int h, float aspect, int sample);
+static void trace_pixel_hit(csg_context *ctx, struct csg_pixel_hit *ph, int x, int y, int width, int height,
+		float aspect);
+static void render_packet(csg_context *ctx, float *pixels, int x, int y, int width, int height, float aspect, int sample);
+static void accum_color(float *color, float *c, int sample);
+static int wf_render(csg_context *ctx, float *pixels, int width, int height, int sample);
+static void wf_sort(int *live, int *tmp, int count, struct wf_path *paths, int by_object);
+static void wf_shade(csg_context *ctx, struct wf_path *p, struct wf_shadow *shadow);
+static void wf_gather(csg_context *ctx, struct wf_path *p, struct wf_shadow *shadow);
+static unsigned int find_packet_intersection(csg_context *ctx, struct ray_packet *pk, unsigned int mask,
+		const int *nodes, int count, csg_hit *best);
+static int find_nearest(csg_context *ctx, csg_ray *ray, const int *nodes, int count, csg_hit *best);
+static const int *primary_nodes(csg_context *ctx, int x, int y, int width, int height, float aspect,
+		int *count);
+static void nearest_hit(csg_hit *best, struct hinterv *hit, csg_object *root);
 static void def_shader(float *col, csg_ray *ray, csg_hit *hit, void *cls);
 static void dbg_shader(float *col, csg_ray *ray, csg_hit *hit, void *cls);
 static void background(float *col, csg_ray *ray);
-static csg_object *load_object(struct ts_node *node);
+static void trace_heatmap(csg_context *ctx, csg_ray *ray, float *col);
+static void heat_color(float *col, float val);
+static void merge_stats(csg_context *ctx);
+static int render_aborted(csg_context *ctx);
+static int emissive(csg_object *o);
+static struct material *light_material(csg_object *o);
+static struct material *edit_material(csg_object *o);
+static void share_materials(csg_object *o);
+static void update_cscene(csg_context *ctx);
+static void update_tiles(csg_context *ctx, int width, int height);
+static int load_compiled(csg_context *ctx, const char *fname);
+static int load_viewer(csg_context *ctx, struct ts_node *node);
+static int load_define(csg_context *ctx, struct ts_node *node);
+static int load_material(csg_context *ctx, struct ts_node *node);
+static int read_material(struct ts_node *node, struct material *m);
+static csg_object *find_define(csg_context *ctx, const char *name);
+static csg_object *load_object(csg_context *ctx, struct ts_node *node);
 static float sample_lambert_brdf(float *norm, float *res);
 static float sample_phong_brdf(float *outdir, float *norm, float sexp, float *res);
+static void face_forward(csg_hit *hit, csg_ray *ray);
+static void light_ray(csg_ray *sray, csg_hit *hit, csg_object *lt);
+static int light_visible(csg_ray *sray, csg_object *lt);
+static void light_color(float *diff, float *spec, csg_ray *ray, csg_hit *hit,
+		struct material *m, csg_ray *sray, csg_object *lt);
+static const float *sample_gi(csg_ray *giray, csg_ray *ray, csg_hit *hit, struct material *m);
+static float gi_falloff(float dist);
+static int add_view(csg_context *ctx, const char *name, const float *pos, const float *targ,
+		float fov);
+static int add_orbit(csg_context *ctx, const char *name, const float *pos, const float *targ,
+		float fov, int frames, float degrees);
+static void free_views(csg_context *ctx);
+
+/* a camera to render the scene from, see csg_add_view */
+struct view {
+	char *name;
+	float pos[3], targ[3];
+	float fov;
+};
+
+/* everything about a scene and how it's rendered, see csg_make_current */
+struct csg_context {
+	float ambient[3];
+	struct camera cam;
+	csg_object *oblist;
+	csg_object *plights;
+	struct scene_arena *arenas;
+	csg_object *deflist;		/* definitions loaded from scene files */
+	struct material *mtllist;	/* named materials defined by scene files */
+	struct cscene *cscene;		/* oblist compiled for traversal, see update_cscene */
+	struct screen_tiles tiles;	/* objects of each tile for primary rays, see update_tiles */
+	struct view *views;
+	int num_views, max_views;
+
+	csg_shader_func_type shader;
+	void *shader_cls;
+
+	int use_gi;
+	int max_ray_depth;
+	int optimize;
+	int wavefront;
+	int lazy;
+	int accumulate;
+
+	int heatmap;
+	int heat_metric;
+	int heat_scale;
+
+	int dbg_pixel_x, dbg_pixel_y;	/* see csg_debug_pixel */
+
+	const unsigned char *pixel_mask;	/* see csg_pixel_mask */
+
+	csg_abort_func_type abort_func;
+	void *abort_cls;
+	volatile int aborted;		/* the last render was aborted, see render_aborted */
+	unsigned char *row_done;	/* rows finished, tracked while there's an abort_func */
+	int last_height, max_rows;
+
+	struct csg_stats stats;
+};
+
+/* default cost mapped to the hottest color, for each metric */
+static const int def_heat_scale[] = {400, 1000, 400, 200000};
+
+static csg_context *defctx;		/* created by csg_init */
+static csg_context *curctx;		/* the calling thread's, if it made one current */
+#pragma omp threadprivate(curctx)
+
+#define CUR_CTX		(curctx ? curctx : defctx)
 
-static float ambient[3];
-static struct camera cam;
-static csg_object *oblist;
-static csg_object *plights;
 
-static csg_shader_func_type shader;
-static void *shader_cls;
-
-static int use_gi;
-static int max_ray_depth = 5;
+int csg_init(void)
+{
+	if(!(defctx = csg_create_context())) {
+		return -1;
+	}
+	return 0;
+}
 
+void csg_destroy(void)
+{
+	csg_free_context(defctx);
+	defctx = 0;
+}
 
-int csg_init(void)
+csg_context *csg_create_context(void)
 {
-	oblist = 0;
-	plights = 0;
+	csg_context *ctx, *prev = curctx;
+
+	if(!(ctx = calloc(1, sizeof *ctx))) {
+		perror("failed to allocate rendering context");
+		return 0;
+	}
+	ctx->max_ray_depth = 5;
+	ctx->optimize = 1;
+	ctx->lazy = 1;
+	ctx->accumulate = 1;
+	ctx->heat_metric = CSG_HEAT_PRIM_TESTS;
 
+	curctx = ctx;
 	csg_shader(CSG_DEFAULT_SHADER, 0);
 	csg_ambient(0, 0, 0);
 	csg_view(0, 0, 5, 0, 0, 0);
 	csg_fov(50);
+	curctx = prev;
 
-	return 0;
+	return ctx;
 }
 
-void csg_destroy(void)
+void csg_free_context(csg_context *ctx)
 {
-	while(oblist) {
-		csg_object *o = oblist;
-		oblist = oblist->ob.next;
+	if(!ctx) return;
+
+	free(ctx->cscene);
+	free_screen_tiles(&ctx->tiles);
+	free(ctx->row_done);
+
+	while(ctx->oblist) {
+		csg_object *o = ctx->oblist;
+		ctx->oblist = ctx->oblist->ob.next;
+		csg_free_object(o);
+	}
+
+	/* after the objects, which might be instances of them */
+	while(ctx->deflist) {
+		csg_object *o = ctx->deflist;
+		ctx->deflist = ctx->deflist->ob.next;
 		csg_free_object(o);
 	}
-	oblist = 0;
+
+	while(ctx->arenas) {
+		struct scene_arena *a = ctx->arenas;
+		ctx->arenas = ctx->arenas->next;
+		bin_free_arena(a);
+	}
+
+	/* after everything which might still refer to them */
+	mtl_free_list(ctx->mtllist);
+	free_views(ctx);
+
+	if(curctx == ctx) {
+		curctx = 0;
+	}
+	free(ctx);
+}
+
+void csg_make_current(csg_context *ctx)
+{
+	curctx = ctx;
+}
+
+csg_context *csg_current_context(void)
+{
+	return CUR_CTX;
 }
 
 void csg_option(int opt, int val)
 {
+	csg_context *ctx = CUR_CTX;
+
 	switch(opt) {
 	case CSG_OPT_MAX_ITER:
-		max_ray_depth = val;
+		ctx->max_ray_depth = val;
+		break;
+
+	case CSG_OPT_HEATMAP:
+		if(val < 0 || val >= CSG_NUM_HEAT_METRICS) {
+			fprintf(stderr, "csg_option: invalid heatmap metric: %d\n", val);
+			break;
+		}
+		ctx->heat_metric = val;
+		break;
+
+	case CSG_OPT_HEATMAP_SCALE:
+		ctx->heat_scale = val;
+		break;
+
+	case CSG_OPT_OPTIMIZE:
+		ctx->optimize = val;
+		break;
+
+	case CSG_OPT_WAVEFRONT:
+		ctx->wavefront = val;
+		break;
+
+	case CSG_OPT_LAZY:
+		ctx->lazy = val;
+		break;
+
+	case CSG_OPT_ACCUMULATE:
+		ctx->accumulate = val;
 		break;
 
 	default:
@@ -86,9 +282,29 @@ void csg_option(int opt, int val)
 
 int csg_get_option(int opt)
 {
+	csg_context *ctx = CUR_CTX;
+
 	switch(opt) {
 	case CSG_OPT_MAX_ITER:
-		return max_ray_depth;
+		return ctx->max_ray_depth;
+
+	case CSG_OPT_HEATMAP:
+		return ctx->heat_metric;
+
+	case CSG_OPT_HEATMAP_SCALE:
+		return ctx->heat_scale > 0 ? ctx->heat_scale : def_heat_scale[ctx->heat_metric];
+
+	case CSG_OPT_OPTIMIZE:
+		return ctx->optimize;
+
+	case CSG_OPT_WAVEFRONT:
+		return ctx->wavefront;
+
+	case CSG_OPT_LAZY:
+		return ctx->lazy;
+
+	case CSG_OPT_ACCUMULATE:
+		return ctx->accumulate;
 
 	default:
 		fprintf(stderr, "csg_get_option: invalid option number: %d\n", opt);
@@ -98,15 +314,16 @@ int csg_get_option(int opt)
 
 void csg_view(float x, float y, float z, float tx, float ty, float tz)
 {
+	csg_context *ctx = CUR_CTX;
 	float dir[3];
 	float len;
 
-	cam.x = x;
-	cam.y = y;
-	cam.z = z;
-	cam.tx = tx;
-	cam.ty = ty;
-	cam.tz = tz;
+	ctx->cam.x = x;
+	ctx->cam.y = y;
+	ctx->cam.z = z;
+	ctx->cam.tx = tx;
+	ctx->cam.ty = ty;
+	ctx->cam.tz = tz;
 
 	dir[0] = tx - x;
 	dir[1] = ty - y;
@@ -114,58 +331,232 @@ void csg_view(float x, float y, float z, float tx, float ty, float tz)
 	len = sqrt(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]);
 
 	if(1.0f - fabs(ty - y) / len < 1e-6f) {
-		cam.ux = cam.uy = 0.0f;
-		cam.uz = -1.0f;
+		ctx->cam.ux = ctx->cam.uy = 0.0f;
+		ctx->cam.uz = -1.0f;
 	} else {
-		cam.ux = cam.uz = 0.0f;
-		cam.uy = 1.0f;
+		ctx->cam.ux = ctx->cam.uz = 0.0f;
+		ctx->cam.uy = 1.0f;
 	}
 
-	mat4_lookat(cam.xform, x, y, z, tx, ty, tz, cam.ux, cam.uy, cam.uz);
+	mat4_lookat(ctx->cam.xform, x, y, z, tx, ty, tz, ctx->cam.ux, ctx->cam.uy, ctx->cam.uz);
+	mat4_copy(ctx->cam.inv_xform, ctx->cam.xform);
+	mat4_inverse(ctx->cam.inv_xform);
+	ctx->tiles.valid = 0;
 }
 
 float *csg_get_view_position(float *pos)
 {
+	csg_context *ctx = CUR_CTX;
+
 	if(pos) {
-		pos[0] = cam.x;
-		pos[1] = cam.y;
-		pos[2] = cam.z;
+		pos[0] = ctx->cam.x;
+		pos[1] = ctx->cam.y;
+		pos[2] = ctx->cam.z;
 	}
-	return &cam.x;
+	return &ctx->cam.x;
 }
 
 float *csg_get_view_target(float *tgt)
 {
+	csg_context *ctx = CUR_CTX;
+
 	if(tgt) {
-		tgt[0] = cam.tx;
-		tgt[1] = cam.ty;
-		tgt[2] = cam.tz;
+		tgt[0] = ctx->cam.tx;
+		tgt[1] = ctx->cam.ty;
+		tgt[2] = ctx->cam.tz;
 	}
-	return &cam.tx;
+	return &ctx->cam.tx;
 }
 
 void csg_fov(float fov)
 {
-	cam.fov = M_PI * fov / 180.0f;
+	csg_context *ctx = CUR_CTX;
+
+	ctx->cam.fov = M_PI * fov / 180.0f;
+	ctx->tiles.valid = 0;
 }
 
 float csg_get_fov(void)
 {
-	return 180.0f * cam.fov / M_PI;
+	csg_context *ctx = CUR_CTX;
+
+	return 180.0f * ctx->cam.fov / M_PI;
+}
+
+int csg_add_view(const char *name, float x, float y, float z, float tx, float ty, float tz,
+		float fov)
+{
+	csg_context *ctx = CUR_CTX;
+	float pos[3], targ[3];
+
+	pos[0] = x;
+	pos[1] = y;
+	pos[2] = z;
+	targ[0] = tx;
+	targ[1] = ty;
+	targ[2] = tz;
+	return add_view(ctx, name, pos, targ, fov);
+}
+
+int csg_add_orbit(const char *name, float x, float y, float z, float tx, float ty, float tz,
+		float fov, int frames, float degrees)
+{
+	csg_context *ctx = CUR_CTX;
+	float pos[3], targ[3];
+
+	pos[0] = x;
+	pos[1] = y;
+	pos[2] = z;
+	targ[0] = tx;
+	targ[1] = ty;
+	targ[2] = tz;
+	return add_orbit(ctx, name, pos, targ, fov, frames, degrees);
+}
+
+void csg_clear_views(void)
+{
+	free_views(CUR_CTX);
+}
+
+int csg_num_views(void)
+{
+	return CUR_CTX->num_views;
+}
+
+const char *csg_view_name(int idx)
+{
+	csg_context *ctx = CUR_CTX;
+
+	if(idx < 0 || idx >= ctx->num_views) {
+		return 0;
+	}
+	return ctx->views[idx].name;
+}
+
+int csg_use_view(int idx)
+{
+	csg_context *ctx = CUR_CTX;
+	struct view *v;
+
+	if(idx < 0 || idx >= ctx->num_views) {
+		fprintf(stderr, "csg_use_view: no view %d\n", idx);
+		return -1;
+	}
+	v = ctx->views + idx;
+
+	csg_view(v->pos[0], v->pos[1], v->pos[2], v->targ[0], v->targ[1], v->targ[2]);
+	csg_fov(v->fov);
+	return 0;
+}
+
+static int add_view(csg_context *ctx, const char *name, const float *pos, const float *targ,
+		float fov)
+{
+	struct view *v;
+
+	if(ctx->num_views >= ctx->max_views) {
+		int newsz = ctx->max_views ? ctx->max_views * 2 : 8;
+		if(!(v = realloc(ctx->views, newsz * sizeof *v))) {
+			perror("failed to resize view list");
+			return -1;
+		}
+		ctx->views = v;
+		ctx->max_views = newsz;
+	}
+	v = ctx->views + ctx->num_views;
+
+	if(name) {
+		if(!(v->name = malloc(strlen(name) + 1))) {
+			perror("failed to allocate view name");
+			return -1;
+		}
+		strcpy(v->name, name);
+	} else {
+		v->name = 0;
+	}
+	memcpy(v->pos, pos, sizeof v->pos);
+	memcpy(v->targ, targ, sizeof v->targ);
+	v->fov = fov;
+
+	return ctx->num_views++;
+}
+
+/* the frames are spaced evenly over the orbit, so a full turn doesn't repeat
+ * the first frame at the end. The position is rotated about the vertical axis
+ * through the target, and keeps its height.
+ */
+static int add_orbit(csg_context *ctx, const char *name, const float *pos, const float *targ,
+		float fov, int frames, float degrees)
+{
+	int i, first = ctx->num_views;
+	float fpos[3], angle, s, c, dx, dz;
+	char *fname = 0;
+
+	if(frames < 1) {
+		fprintf(stderr, "invalid number of orbit frames: %d\n", frames);
+		return -1;
+	}
+	if(name && !(fname = malloc(strlen(name) + 16))) {
+		perror("failed to allocate view name");
+		return -1;
+	}
+
+	dx = pos[0] - targ[0];
+	dz = pos[2] - targ[2];
+
+	for(i=0; i<frames; i++) {
+		angle = M_PI * degrees / 180.0f * i / frames;
+		s = sin(angle);
+		c = cos(angle);
+		fpos[0] = targ[0] + dx * c + dz * s;
+		fpos[1] = pos[1];
+		fpos[2] = targ[2] - dx * s + dz * c;
+
+		if(fname) {
+			sprintf(fname, "%s-%04d", name, i);
+		}
+		if(add_view(ctx, fname, fpos, targ, fov) == -1) {
+			/* leave no part of the orbit behind */
+			while(ctx->num_views > first) {
+				free(ctx->views[--ctx->num_views].name);
+			}
+			free(fname);
+			return -1;
+		}
+	}
+
+	free(fname);
+	return first;
+}
+
+static void free_views(csg_context *ctx)
+{
+	int i;
+
+	for(i=0; i<ctx->num_views; i++) {
+		free(ctx->views[i].name);
+	}
+	free(ctx->views);
+	ctx->views = 0;
+	ctx->num_views = ctx->max_views = 0;
 }
 
 void csg_shader(csg_shader_func_type sdr, void *cls)
 {
+	csg_context *ctx = CUR_CTX;
+
+	ctx->heatmap = 0;
+
 	switch((unsigned long)sdr) {
 	case CSG_DEFAULT_SHADER_ID:
 		sdr = def_shader;
-		use_gi = 0;
+		ctx->use_gi = 0;
 		cls = 0;
 		break;
 
 	case CSG_GI_SHADER_ID:
 		sdr = def_shader;
-		use_gi = 1;
+		ctx->use_gi = 1;
 		cls = 0;
 		break;
 
@@ -174,21 +565,37 @@ void csg_shader(csg_shader_func_type sdr, void *cls)
 		cls = 0;
 		break;
 
+	case CSG_HEATMAP_SHADER_ID:
+		sdr = def_shader;
+		ctx->use_gi = 0;
+		ctx->heatmap = 1;
+		cls = 0;
+		break;
+
 	default:
 		break;
 	}
 
-	shader = sdr;
-	shader_cls = cls;
+	ctx->shader = sdr;
+	ctx->shader_cls = cls;
 }
 
 int csg_load(const char *fname)
 {
+	csg_context *ctx = CUR_CTX;
 	struct ts_node *root = 0, *c;
 	csg_object *o;
+	int first_view = ctx->num_views;
+
+	if(bin_scene_file(fname)) {
+		return load_compiled(ctx, fname);
+	}
+
+	CSG_TRACE_BEGIN("csg_load", -1);
 
 	if(!(root = ts_load(fname))) {
 		fprintf(stderr, "failed to open %s\n", fname);
+		CSG_TRACE_END("csg_load");
 		return -1;
 	}
 	if(strcmp(root->name, "csgray_scene") != 0) {
@@ -199,58 +606,187 @@ int csg_load(const char *fname)
 	c = root->child_list;
 	while(c) {
 		if(strcmp(c->name, "viewer") == 0) {
-			static float def_pos[] = {0, 0, 5};
-			static float def_targ[] = {0, 0, 0};
+			if(load_viewer(ctx, c) == -1) {
+				goto err;
+			}
 
-			float *p = ts_get_attr_vec(c, "position", def_pos);
-			float *t = ts_get_attr_vec(c, "target", def_targ);
+		} else if(strcmp(c->name, "define") == 0) {
+			if(load_define(ctx, c) == -1) {
+				goto err;
+			}
 
-			csg_view(p[0], p[1], p[2], t[0], t[1], t[2]);
-			csg_fov(ts_get_attr_num(c, "fov", 50.0f));
+		} else if(strcmp(c->name, "material") == 0) {
+			if(load_material(ctx, c) == -1) {
+				goto err;
+			}
 
-		} else if((o = load_object(c))) {
-			csg_add_object(o);
+		} else if((o = load_object(ctx, c))) {
+			bake_xform(o);
+			/* light sources are sampled through their tree, leave them alone */
+			if(ctx->optimize && !emissive(o)) {
+				o = optimize_object(o);
+			}
+			if(o) {
+				csg_add_object(o);
+			}
 		}
 		c = c->next;
 	}
 
+	/* start from the first camera of the scene */
+	if(ctx->num_views > first_view) {
+		csg_use_view(first_view);
+	}
+
 	ts_free_tree(root);
+	CSG_TRACE_END("csg_load");
 	return 0;
 
 err:
 	if(root) {
 		ts_free_tree(root);
 	}
+	CSG_TRACE_END("csg_load");
 	return -1;
 }
 
 int csg_save(const char *fname)
 {
-	return -1;	/* TODO */
+	csg_context *ctx = CUR_CTX;
+	struct bin_scene_env env;
+
+	csg_get_view_position(env.vpos);
+	csg_get_view_target(env.vtarg);
+	env.fov = csg_get_fov();
+	env.ambient[0] = ctx->ambient[0];
+	env.ambient[1] = ctx->ambient[1];
+	env.ambient[2] = ctx->ambient[2];
+
+	return bin_save_scene(fname, ctx->oblist, &env);
+}
+
+static int load_compiled(csg_context *ctx, const char *fname)
+{
+	struct scene_arena *arena;
+	struct bin_scene_env env;
+	csg_object *o, *next;
+
+	CSG_TRACE_BEGIN("csg_load", -1);
+
+	if(!(arena = bin_load_scene(fname, &env, &o, &ctx->mtllist))) {
+		CSG_TRACE_END("csg_load");
+		return -1;
+	}
+	arena->next = ctx->arenas;
+	ctx->arenas = arena;
+
+	/* compiled scenes keep only the camera they were saved with */
+	if(add_view(ctx, 0, env.vpos, env.vtarg, env.fov) == -1) {
+		CSG_TRACE_END("csg_load");
+		return -1;
+	}
+	csg_use_view(ctx->num_views - 1);
+	csg_ambient(env.ambient[0], env.ambient[1], env.ambient[2]);
+
+	while(o) {
+		next = o->ob.next;
+		csg_add_object(o);
+		o = next;
+	}
+
+	CSG_TRACE_END("csg_load");
+	return 0;
 }
 
 void csg_add_object(csg_object *o)
 {
-	o->ob.next = oblist;
-	oblist = o;
+	csg_context *ctx = CUR_CTX;
+
+	o->ob.next = ctx->oblist;
+	ctx->oblist = o;
+	free(ctx->cscene);
+	ctx->cscene = 0;
+	ctx->tiles.valid = 0;
+
+	share_materials(o);
+	bake_xform(o);
+	if(!(o->ob.flags & OBF_BOUNDS)) {
+		calc_bounds(o);
+	}
 
-	if(o->ob.emr > 0.0f || o->ob.emg > 0.0f || o->ob.emb > 0.0f) {
+	if(emissive(o)) {
 		o->ob.light_source = 1;
-		o->ob.plt_next = plights;
-		plights = o;
+		o->ob.plt_next = ctx->plights;
+		ctx->plights = o;
+	}
+}
+
+static int emissive(csg_object *o)
+{
+	return light_material(o)->emissive;
+}
+
+/* the material the surface of a light source is shaded with: instances are
+ * shaded with the materials of their definition, not their own
+ */
+static struct material *light_material(csg_object *o)
+{
+	while(o->ob.type == OB_INSTANCE) {
+		o = o->inst.def;
+	}
+	return o->ob.mtl;
+}
+
+/* Shared materials are copied before being modified, and go back to being
+ * shared when the object is added to the scene.
+ */
+static struct material *edit_material(csg_object *o)
+{
+	struct material *m = o->ob.mtl;
+
+	if(m->flags & MTL_SHARED) {
+		if(!(m = mtl_private(m))) {
+			abort();
+		}
+		mtl_release(o->ob.mtl);
+		o->ob.mtl = m;
+	}
+	return m;
+}
+
+static void share_materials(csg_object *o)
+{
+	int i;
+	struct material *m = o->ob.mtl;
+
+	if(!(m->flags & MTL_SHARED)) {
+		if(!(o->ob.mtl = mtl_share(m))) {
+			abort();
+		}
+		mtl_release(m);
+	}
+
+	if(o->ob.type == OB_UNION || o->ob.type == OB_INTERSECTION || o->ob.type == OB_SUBTRACTION) {
+		for(i=0; i<o->csg.num_sub; i++) {
+			share_materials(o->csg.sub[i]);
+		}
 	}
 }
 
 int csg_remove_object(csg_object *o)
 {
+	csg_context *ctx = CUR_CTX;
 	csg_object dummy, *n;
 
-	dummy.ob.next = oblist;
+	dummy.ob.next = ctx->oblist;
 	n = &dummy;
 
 	while(n->ob.next) {
 		if(n->ob.next == o) {
 			n->ob.next = o->ob.next;
+			free(ctx->cscene);
+			ctx->cscene = 0;
+			ctx->tiles.valid = 0;
 			return 1;
 		}
 		n = n->ob.next;
@@ -262,33 +798,52 @@ void csg_free_object(csg_object *o)
 {
 	if(o) {
 		if(o->ob.type == OB_UNION || o->ob.type == OB_INTERSECTION || o->ob.type == OB_SUBTRACTION) {
-			csg_free_object(o->csg.a);
-			csg_free_object(o->csg.b);
+			int i;
+			for(i=0; i<o->csg.num_sub; i++) {
+				csg_free_object(o->csg.sub[i]);
+			}
+			if(!(o->ob.flags & OBF_ARENA_SUB)) {
+				free(o->csg.sub);
+			}
+			free(o->csg.bvh);
+			/* arena nodes can be reached again through the arena */
+			o->csg.sub = 0;
+			o->csg.num_sub = 0;
+			o->csg.bvh = 0;
 		}
-		free(o->ob.name);
+		if(!(o->ob.flags & OBF_ARENA_NAME)) {
+			free(o->ob.name);
+		}
+		mtl_release(o->ob.mtl);
+		o->ob.mtl = 0;
 		if(o->ob.destroy) {
 			o->ob.destroy(o);
 		}
-		free(o);
+		/* arena objects are freed with their scene by csg_free_context */
+		if(!(o->ob.flags & OBF_ARENA)) {
+			free(o);
+		}
 	}
 }
 
 static union csg_object *alloc_object(int type)
 {
 	csg_object *o;
+	struct material mtl;
 
 	if(!(o = calloc(sizeof *o, 1))) {
 		return 0;
 	}
+	mtl_defaults(&mtl);
+	if(!(o->ob.mtl = mtl_share(&mtl))) {
+		free(o);
+		return 0;
+	}
+
 	o->ob.type = type;
 	mat4_identity(o->ob.xform);
 	mat4_identity(o->ob.inv_xform);
-
-	csg_emission(o, 0, 0, 0);
-	csg_color(o, 1, 1, 1);
-	csg_roughness(o, 1);
-	csg_opacity(o, 1);
-
+	calc_xform(o);
 	return o;
 }
 
@@ -302,6 +857,7 @@ csg_object *csg_null(float x, float y, float z)
 
 	mat4_translation(o->ob.xform, x, y, z);
 	mat4_translation(o->ob.inv_xform, -x, -y, -z);
+	calc_xform(o);
 	return o;
 }
 
@@ -316,6 +872,7 @@ csg_object *csg_sphere(float x, float y, float z, float r)
 	o->sph.rad = r;
 	mat4_translation(o->ob.xform, x, y, z);
 	mat4_translation(o->ob.inv_xform, -x, -y, -z);
+	calc_xform(o);
 	return o;
 }
 
@@ -351,6 +908,7 @@ csg_object *csg_cylinder(float x0, float y0, float z0, float x1, float y1, float
 	mat4_lookat(o->ob.xform, x, y, z, dx, dz, -dy, 0, major == 2 ? 0 : 1, major == 2 ? 1 : 0);
 	mat4_copy(o->ob.inv_xform, o->ob.xform);
 	mat4_inverse(o->ob.inv_xform);
+	calc_xform(o);
 	return o;
 }
 
@@ -378,6 +936,7 @@ csg_object *csg_plane(float x, float y, float z, float nx, float ny, float nz)
 
 	mat4_translation(o->ob.xform, x, y, z);
 	mat4_translation(o->ob.inv_xform, -x, -y, -z);
+	calc_xform(o);
 	return o;
 }
 
@@ -395,56 +954,100 @@ csg_object *csg_box(float x, float y, float z, float xsz, float ysz, float zsz)
 
 	mat4_translation(o->ob.xform, x, y, z);
 	mat4_translation(o->ob.inv_xform, -x, -y, -z);
+	calc_xform(o);
 	return o;
 }
 
-csg_object *csg_union(csg_object *a, csg_object *b)
+csg_object *csg_instance(csg_object *def)
 {
 	csg_object *o;
 
-	if(!(o = alloc_object(OB_UNION))) {
+	if(!(o = alloc_object(OB_INSTANCE))) {
 		return 0;
 	}
-	o->csg.a = a;
-	o->csg.b = b;
+	o->inst.def = def;
+
+	/* the hits are on the definition's objects, and are shaded with their
+	 * materials, so the instance's own is never used, see light_material.
+	 */
+	share_materials(def);
+	mtl_release(o->ob.mtl);
+	o->ob.mtl = def->ob.mtl;
+	mtl_ref(o->ob.mtl);
 	return o;
 }
 
-csg_object *csg_intersection(csg_object *a, csg_object *b)
+static csg_object *csg_operation(int type, csg_object *a, csg_object *b)
 {
 	csg_object *o;
 
-	if(!(o = alloc_object(OB_INTERSECTION))) {
+	if(!(o = alloc_object(type))) {
+		return 0;
+	}
+	if((a && csg_add_operand(o, a) == -1) || (b && csg_add_operand(o, b) == -1)) {
+		o->csg.num_sub = 0;
+		csg_free_object(o);
 		return 0;
 	}
-	o->csg.a = a;
-	o->csg.b = b;
 	return o;
 }
 
+csg_object *csg_union(csg_object *a, csg_object *b)
+{
+	return csg_operation(OB_UNION, a, b);
+}
+
+csg_object *csg_intersection(csg_object *a, csg_object *b)
+{
+	return csg_operation(OB_INTERSECTION, a, b);
+}
+
 csg_object *csg_subtraction(csg_object *a, csg_object *b)
 {
-	csg_object *o;
+	return csg_operation(OB_SUBTRACTION, a, b);
+}
 
-	if(!(o = alloc_object(OB_SUBTRACTION))) {
-		return 0;
+int csg_add_operand(csg_object *op, csg_object *o)
+{
+	if(op->csg.num_sub >= op->csg.max_sub || (op->ob.flags & OBF_ARENA_SUB)) {
+		int newsz = op->csg.max_sub > 0 ? op->csg.max_sub * 2 : 4;
+		csg_object **tmp;
+
+		if(!(tmp = malloc(newsz * sizeof *tmp))) {
+			perror("failed to resize CSG operand array");
+			return -1;
+		}
+		if(op->csg.num_sub > 0) {
+			memcpy(tmp, op->csg.sub, op->csg.num_sub * sizeof *tmp);
+		}
+		if(!(op->ob.flags & OBF_ARENA_SUB)) {
+			free(op->csg.sub);
+		}
+		op->csg.sub = tmp;
+		op->csg.max_sub = newsz;
+		op->ob.flags &= ~OBF_ARENA_SUB;
 	}
-	o->csg.a = a;
-	o->csg.b = b;
-	return o;
+	op->csg.sub[op->csg.num_sub++] = o;
+	op->ob.flags &= ~OBF_BOUNDS;
+	return 0;
 }
 
 void csg_ambient(float r, float g, float b)
 {
-	ambient[0] = r;
-	ambient[1] = g;
-	ambient[2] = b;
+	csg_context *ctx = CUR_CTX;
+
+	ctx->ambient[0] = r;
+	ctx->ambient[1] = g;
+	ctx->ambient[2] = b;
 }
 
 void csg_name(csg_object *o, const char *name)
 {
-	free(o->ob.name);
+	if(!(o->ob.flags & OBF_ARENA_NAME)) {
+		free(o->ob.name);
+	}
 	o->ob.name = 0;
+	o->ob.flags &= ~OBF_ARENA_NAME;
 
 	if(name) {
 		if(!(o->ob.name = malloc(strlen(name) + 1))) {
@@ -457,43 +1060,71 @@ void csg_name(csg_object *o, const char *name)
 
 void csg_emission(csg_object *o, float r, float g, float b)
 {
-	o->ob.emr = r;
-	o->ob.emg = g;
-	o->ob.emb = b;
+	struct material *m = edit_material(o);
+	m->emr = r;
+	m->emg = g;
+	m->emb = b;
+	calc_material(m);
 }
 
 void csg_color(csg_object *o, float r, float g, float b)
 {
-	o->ob.r = r;
-	o->ob.g = g;
-	o->ob.b = b;
+	struct material *m = edit_material(o);
+	m->r = r;
+	m->g = g;
+	m->b = b;
+	calc_material(m);
 }
 
 void csg_roughness(csg_object *o, float r)
 {
-	o->ob.roughness = r;
+	struct material *m = edit_material(o);
+	m->roughness = r;
+	calc_material(m);
 }
 
 void csg_opacity(csg_object *o, float p)
 {
-	o->ob.opacity = p;
+	struct material *m = edit_material(o);
+	m->opacity = p;
+	calc_material(m);
 }
 
 void csg_metallic(csg_object *o, int m)
 {
-	o->ob.metallic = m;
+	struct material *mtl = edit_material(o);
+	mtl->metallic = m;
+	calc_material(mtl);
+}
+
+int csg_material(csg_object *o, const char *name)
+{
+	csg_context *ctx = CUR_CTX;
+	struct material *m;
+
+	if(!(m = mtl_find(ctx->mtllist, name))) {
+		return -1;
+	}
+	mtl_release(o->ob.mtl);
+	o->ob.mtl = m;
+	mtl_ref(m);
+	return 0;
 }
 
 void csg_reset_xform(csg_object *o)
 {
 	mat4_identity(o->ob.xform);
 	mat4_identity(o->ob.inv_xform);
+	calc_xform(o);
+	o->ob.flags &= ~OBF_BOUNDS;
 }
 
 void csg_translate(csg_object *o, float x, float y, float z)
 {
 	mat4_translate(o->ob.xform, x, y, z);
 	mat4_pre_translate(o->ob.inv_xform, -x, -y, -z);
+	calc_xform(o);
+	o->ob.flags &= ~OBF_BOUNDS;
 }
 
 void csg_rotate(csg_object *o, float angle, float x, float y, float z)
@@ -501,120 +1132,873 @@ void csg_rotate(csg_object *o, float angle, float x, float y, float z)
 	angle = M_PI * angle / 180.0f;
 	mat4_rotate(o->ob.xform, angle, x, y, z);
 	mat4_pre_rotate(o->ob.inv_xform, -angle, x, y, z);
+	calc_xform(o);
+	o->ob.flags &= ~OBF_BOUNDS;
 }
 
 void csg_scale(csg_object *o, float x, float y, float z)
 {
 	mat4_scale(o->ob.xform, x, y, z);
 	mat4_pre_scale(o->ob.inv_xform, 1.0f / x, 1.0f / y, 1.0f / z);
+	calc_xform(o);
+	o->ob.flags &= ~OBF_BOUNDS;
 }
 
 void csg_lookat(csg_object *o, float x, float y, float z, float tx, float ty, float tz, float ux, float uy, float uz)
 {
 	mat4_lookat(o->ob.xform, x, y, z, tx, ty, tz, ux, uy, uz);
 	mat4_inv_lookat(o->ob.inv_xform, x, y, z, tx, ty, tz, ux, uy, uz);
+	calc_xform(o);
+	o->ob.flags &= ~OBF_BOUNDS;
+}
+
+void csg_debug_pixel(int x, int y)
+{
+	csg_context *ctx = CUR_CTX;
+
+	ctx->dbg_pixel_x = x;
+	ctx->dbg_pixel_y = y;
 }
 
 void csg_render_pixel(int x, int y, int width, int height, float aspect, int sample, float *color)
 {
+	csg_context *ctx = CUR_CTX;
 	csg_ray ray;
+	csg_hit hit;
+	float c[3];
+	const int *nodes;
+	int count;
 
-	if(csg_dbg_pixel_x > 0 && csg_dbg_pixel_x == x && csg_dbg_pixel_y == y) {
-		csg_dbg_pixel = 1;
-		csg_dbg_pixel_x = 0;
-	} else {
-		csg_dbg_pixel = 0;
-	}
+	csg_dbg_pixel = ctx->dbg_pixel_x > 0 && ctx->dbg_pixel_x == x && ctx->dbg_pixel_y == y;
 
-	calc_primary_ray(&ray, x, y, width, height, aspect, sample);
-	if(sample == 0) {
-		csg_ray_trace(&ray, color);
+	calc_primary_ray(ctx, &ray, x, y, width, height, aspect, sample);
+	if(ctx->heatmap) {
+		trace_heatmap(ctx, &ray, c);
 	} else {
-		float c[3];
-		float w = 1.0f / (float)(sample + 1);
-		float wprev = w * (float)sample;
-		csg_ray_trace(&ray, c);
-		color[0] = color[0] * wprev + c[0] * w;
-		color[1] = color[1] * wprev + c[1] * w;
-		color[2] = color[2] * wprev + c[2] * w;
+		/* csg_ray_trace, with the objects of the tile */
+		STAT_INC(shader_calls);
+		nodes = primary_nodes(ctx, x, y, width, height, aspect, &count);
+		if(find_nearest(ctx, &ray, nodes, count, &hit)) {
+			ctx->shader(c, &ray, &hit, ctx->shader_cls);
+		} else {
+			ctx->shader(c, &ray, 0, ctx->shader_cls);
+		}
 	}
+	accum_color(color, c, ctx->accumulate ? sample : 0);
 }
 
-void csg_render_image(float *pixels, int width, int height, int sample)
+/* Primary rays are traced in packets of neighbouring pixels, which follow much
+ * the same path through the scene. Heatmaps and the debug pixel need the rays
+ * traced one at a time. If it's enabled, the wavefront integrator (wf_render)
+ * takes over from the packets for the default and GI shaders.
+ */
+int csg_render_image(float *pixels, int width, int height, int sample)
 {
+	csg_context *ctx = CUR_CTX;
 	int i, j;
 	float aspect = (float)width / (float)height;
-
-#pragma omp parallel for private(j) schedule(dynamic, 32)
-	for(i=0; i<height; i++) {
-		float *pptr = pixels + i * width * 3;
-		for(j=0; j<width; j++) {
-			csg_render_pixel(j, i, width, height, aspect, sample, pptr);
-			pptr += 3;
+	int packets = !ctx->heatmap && ctx->dbg_pixel_x <= 0;
+
+	ctx->aborted = 0;
+	ctx->last_height = height;
+	if(ctx->abort_func) {
+		if(height > ctx->max_rows) {
+			free(ctx->row_done);
+			if(!(ctx->row_done = malloc(height))) {
+				perror("failed to allocate the rows done");
+				ctx->max_rows = ctx->last_height = 0;
+				ctx->aborted = 1;
+				return -1;
+			}
+			ctx->max_rows = height;
 		}
+		memset(ctx->row_done, 0, height);
 	}
-}
 
-float csg_ray_trace(csg_ray *ray, float *col)
-{
-	csg_hit hit;
+	CSG_TRACE_BEGIN("csg_render_image", sample);
 
-	if(!csg_find_intersection(ray, &hit)) {
-		shader(col, ray, 0, shader_cls);
-		return 0.0f;
-	}
+	update_cscene(ctx);
+	update_tiles(ctx, width, height);
 
-	shader(col, ray, &hit, shader_cls);
-	return hit.t;
-}
+	if(ctx->wavefront && packets && ctx->shader == def_shader &&
+			wf_render(ctx, pixels, width, height, sample) != -1) {
+		CSG_TRACE_END("csg_render_image");
+		return ctx->aborted ? -1 : 0;
+	}
 
-int csg_find_intersection(csg_ray *ray, csg_hit *best)
-{
-	int idx = 0;
-	csg_object *o;
-	struct hinterv *hit, *it;
+#pragma omp parallel private(i, j)
+	{
+		/* shaders reach the context through csg_ray_trace */
+		csg_context *prev = curctx;
+		curctx = ctx;
 
-	best->t = FLT_MAX;
-	best->o = 0;
+		if(packets) {
+#pragma omp for schedule(dynamic, 32 / PACKET_H)
+			for(i=0; i<height; i+=PACKET_H) {
+				if(render_aborted(ctx)) continue;
 
-	o = oblist;
-	while(o) {
-		if(ray->iter > 0 && o->ob.light_source) {
-			/* skip light sources on GI bounce rays */
-			o = o->ob.next;
-			continue;
-		}
+				CSG_TRACE_BEGIN("row", i);
+				for(j=0; j<width; j+=PACKET_W) {
+					render_packet(ctx, pixels, j, i, width, height, aspect, sample);
+				}
+				if(ctx->abort_func) {
+					memset(ctx->row_done + i, 1, height - i < PACKET_H ? height - i : PACKET_H);
+				}
+				CSG_TRACE_END("row");
+			}
+		} else {
+#pragma omp for schedule(dynamic, 32)
+			for(i=0; i<height; i++) {
+				float *pptr = pixels + i * width * 3;
+
+				if(render_aborted(ctx)) continue;
+
+				CSG_TRACE_BEGIN("row", i);
+				for(j=0; j<width; j++) {
+					if(!ctx->pixel_mask || ctx->pixel_mask[i * width + j]) {
+						csg_render_pixel(j, i, width, height, aspect, sample, pptr);
+					}
+					pptr += 3;
+				}
+				if(ctx->abort_func) {
+					ctx->row_done[i] = 1;
+				}
+				CSG_TRACE_END("row");
+			}
+		}
+
+		merge_stats(ctx);
+		curctx = prev;
+	}
+
+	/* the debug pixel is traced once */
+	ctx->dbg_pixel_x = 0;
+
+	CSG_TRACE_END("csg_render_image");
+	return ctx->aborted ? -1 : 0;
+}
+
+void csg_abort_func(csg_abort_func_type func, void *cls)
+{
+	csg_context *ctx = CUR_CTX;
+
+	ctx->abort_func = func;
+	ctx->abort_cls = cls;
+}
+
+int csg_rows_done(unsigned char *done)
+{
+	csg_context *ctx = CUR_CTX;
+	int i, count = 0;
+
+	if(!ctx->aborted) {
+		memset(done, 1, ctx->last_height);
+		return ctx->last_height;
+	}
+	for(i=0; i<ctx->last_height; i++) {
+		count += (done[i] = ctx->row_done[i]);
+	}
+	return count;
+}
+
+/* Asks abort_func whether to stop, until it says so once; the rest of the
+ * render threads only need to look at the flag after that.
+ */
+static int render_aborted(csg_context *ctx)
+{
+	if(ctx->aborted) {
+		return 1;
+	}
+	if(ctx->abort_func && ctx->abort_func(ctx->abort_cls)) {
+		ctx->aborted = 1;
+		return 1;
+	}
+	return 0;
+}
+
+void csg_pixel_mask(const unsigned char *mask)
+{
+	CUR_CTX->pixel_mask = mask;
+}
+
+int csg_render_hits(struct csg_pixel_hit *hits, int width, int height)
+{
+	csg_context *ctx = CUR_CTX;
+	int i, j;
+	float aspect = (float)width / (float)height;
+
+	/* the rows aren't tracked, see csg_rows_done */
+	ctx->aborted = 0;
+	ctx->last_height = 0;
+
+	update_cscene(ctx);
+	update_tiles(ctx, width, height);
+
+#pragma omp parallel private(i, j)
+	{
+		csg_context *prev = curctx;
+		curctx = ctx;
+
+#pragma omp for schedule(dynamic, 32)
+		for(i=0; i<height; i++) {
+			if(render_aborted(ctx)) continue;
+
+			for(j=0; j<width; j++) {
+				trace_pixel_hit(ctx, hits + i * width + j, j, i, width, height, aspect);
+			}
+		}
+
+		merge_stats(ctx);
+		curctx = prev;
+	}
+
+	return ctx->aborted ? -1 : 0;
+}
+
+static void trace_pixel_hit(csg_context *ctx, struct csg_pixel_hit *ph, int x, int y, int width, int height,
+		float aspect)
+{
+	csg_ray ray;
+	csg_hit hit;
+	const int *nodes;
+	int count;
+	float len, dx, dy, dz;
+
+	calc_primary_ray(ctx, &ray, x, y, width, height, aspect, 0);
+	nodes = primary_nodes(ctx, x, y, width, height, aspect, &count);
+	if(!find_nearest(ctx, &ray, nodes, count, &hit)) {
+		memset(ph, 0, sizeof *ph);
+		ph->id = ph->root = -1;
+		return;
+	}
+
+	ph->pos[0] = hit.x;
+	ph->pos[1] = hit.y;
+	ph->pos[2] = hit.z;
+
+	len = sqrt(hit.nx * hit.nx + hit.ny * hit.ny + hit.nz * hit.nz);
+	if(len > 0.0f) len = 1.0f / len;
+	ph->norm[0] = hit.nx * len;
+	ph->norm[1] = hit.ny * len;
+	ph->norm[2] = hit.nz * len;
+
+	dx = hit.x - ctx->cam.x;
+	dy = hit.y - ctx->cam.y;
+	dz = hit.z - ctx->cam.z;
+	ph->depth = sqrt(dx * dx + dy * dy + dz * dz);
+	ph->id = hit.o->ob.id;
+	ph->root = hit.root->ob.id;
+	ph->inst_path = hit.inst_path;
+}
+
+/* the inverse of calc_primary_ray */
+int csg_project(float *pix, const float *pos, int width, int height)
+{
+	csg_context *ctx = CUR_CTX;
+	float pc[3], s, aspect = (float)width / (float)height;
+
+	mat4_xform3(pc, ctx->cam.inv_xform, (float*)pos);
+	/* the camera looks down -Z */
+	if(pc[2] >= 0.0f) {
+		return -1;
+	}
+
+	s = -1.0f / (tan(ctx->cam.fov * 0.5f) * pc[2]);
+	pix[0] = (pc[0] * s / aspect + 1.0f) * 0.5f * width;
+	pix[1] = (1.0f - pc[1] * s) * 0.5f * height;
+	return 0;
+}
+
+/* renders the block of pixels starting at x, y. Lanes past the edges of the
+ * image repeat the last pixel, and are left out of the packet mask, along with
+ * the pixels left out of the pixel mask.
+ */
+static void render_packet(csg_context *ctx, float *pixels, int x, int y, int width, int height, float aspect, int sample)
+{
+	int i, px, py;
+	unsigned int mask = 0, hitmask;
+	struct ray_packet pk;
+	csg_hit hits[PACKET_SIZE];
+	csg_ray ray;
+	float c[3];
+	const int *nodes;
+	int count;
+
+	for(i=0; i<PACKET_SIZE; i++) {
+		px = x + i % PACKET_W;
+		py = y + i / PACKET_W;
+		if(px < width && py < height && (!ctx->pixel_mask || ctx->pixel_mask[py * width + px])) {
+			mask |= 1 << i;
+		}
+		if(px >= width) px = width - 1;
+		if(py >= height) py = height - 1;
+
+		calc_primary_ray(ctx, &ray, px, py, width, height, aspect, sample);
+		packet_set_ray(&pk, i, &ray);
+	}
+	if(!mask) return;
+
+	/* packets never straddle tiles */
+	nodes = primary_nodes(ctx, x, y, width, height, aspect, &count);
+	hitmask = find_packet_intersection(ctx, &pk, mask, nodes, count, hits);
+
+	for(i=0; i<PACKET_SIZE; i++) {
+		if(!(mask & (1 << i))) continue;
+
+		px = x + i % PACKET_W;
+		py = y + i / PACKET_W;
+
+		STAT_INC(shader_calls);
+		packet_get_ray(&ray, &pk, i);
+		ctx->shader(c, &ray, hitmask & (1 << i) ? hits + i : 0, ctx->shader_cls);
+		accum_color(pixels + (py * width + px) * 3, c, ctx->accumulate ? sample : 0);
+	}
+}
 
-		if((hit = ray_intersect(ray, o))) {
-			it = hit;
-			while(it) {
-				if(it->end[0].t > 1e-6) {
-					idx = 0;
-					break;
+/* averages the color of a new sample into the pixel */
+static void accum_color(float *color, float *c, int sample)
+{
+	if(sample == 0) {
+		color[0] = c[0];
+		color[1] = c[1];
+		color[2] = c[2];
+	} else {
+		float w = 1.0f / (float)(sample + 1);
+		float wprev = w * (float)sample;
+		color[0] = color[0] * wprev + c[0] * w;
+		color[1] = color[1] * wprev + c[1] * w;
+		color[2] = color[2] * wprev + c[2] * w;
+	}
+}
+
+/* The wavefront integrator traces the paths of a batch of pixels a bounce at a
+ * time: every live path is extended, then shaded, then the shadow rays of all
+ * of them are traced, before moving on to the next bounce. Rays are sorted
+ * before each stage, by direction for tracing and by the object they hit for
+ * shading, so that neighbouring rays in a stage visit the same parts of the
+ * scene. It evaluates the same estimator as def_shader, with the recursion
+ * flattened into a throughput carried along each path.
+ */
+
+/* rays in flight per batch, paths and their shadow rays */
+#define WF_BATCH_RAYS	262144
+/* sort bins, the octants of ray directions or hashed objects */
+#define WF_BINS			256
+
+struct wf_path {
+	csg_ray ray;		/* the ray extending the path */
+	csg_hit hit;		/* where it hit, o is null for a miss */
+	csg_ray next;		/* GI ray continuing the path from the hit */
+	const float *tint;	/* tint of the light along next, null if the path ends */
+	float thru[3];		/* throughput of the path up to ray */
+	float col[3];		/* light gathered by the path so far */
+	int pixel;
+	int bin;			/* for wf_sort */
+};
+
+struct wf_shadow {
+	csg_ray ray;
+	csg_object *light;	/* null if the hit was on the light itself */
+	int visible;
+};
+
+static int wf_render(csg_context *ctx, float *pixels, int width, int height, int sample)
+{
+	int i, start, batch, num_live = 0, num_lights = 0, npix = width * height;
+	float aspect = (float)width / (float)height;
+	struct wf_path *paths = 0;
+	struct wf_shadow *shadows = 0;
+	int *live = 0;
+	csg_object *lt;
+
+	for(lt=ctx->plights; lt; lt=lt->ob.plt_next) {
+		num_lights++;
+	}
+	if((batch = WF_BATCH_RAYS / (num_lights + 1)) > npix) {
+		batch = npix;
+	}
+	/* whole rows, which an abort leaves either finished or untouched */
+	batch = batch < width ? width : batch - batch % width;
+
+	if(!(paths = malloc(batch * sizeof *paths)) || !(live = malloc(batch * 2 * sizeof *live)) ||
+			!(shadows = malloc((batch * num_lights + 1) * sizeof *shadows))) {
+		perror("failed to allocate wavefront buffers");
+		free(paths);
+		free(live);
+		return -1;
+	}
+
+#pragma omp parallel private(i, start)
+	{
+		csg_context *prev = curctx;
+		curctx = ctx;
+
+		for(start=0; start<npix; start+=batch) {
+			int count = npix - start < batch ? npix - start : batch;
+
+#pragma omp single
+			render_aborted(ctx);
+			if(ctx->aborted) break;
+
+			CSG_TRACE_BEGIN("camera", start);
+#pragma omp for
+			for(i=0; i<count; i++) {
+				struct wf_path *p = paths + i;
+				p->pixel = start + i;
+				calc_primary_ray(ctx, &p->ray, p->pixel % width, p->pixel / width, width, height,
+						aspect, sample);
+				p->thru[0] = p->thru[1] = p->thru[2] = 1.0f;
+				p->col[0] = p->col[1] = p->col[2] = 0.0f;
+				live[i] = i;
+			}
+			CSG_TRACE_END("camera");
+
+#pragma omp single
+			{
+				num_live = count;
+				if(ctx->pixel_mask) {
+					num_live = 0;
+					for(i=0; i<count; i++) {
+						if(ctx->pixel_mask[start + i]) {
+							live[num_live++] = i;
+						}
+					}
 				}
-				if(it->end[1].t > 1e-6) {
-					idx = 1;
-					break;
+			}
+
+			while(num_live > 0) {
+#pragma omp single
+				render_aborted(ctx);
+				if(ctx->aborted) break;
+
+				/* extend */
+#pragma omp single
+				wf_sort(live, live + batch, num_live, paths, 0);
+
+				CSG_TRACE_BEGIN("extend", num_live);
+#pragma omp for schedule(dynamic, 64)
+				for(i=0; i<num_live; i++) {
+					struct wf_path *p = paths + live[i];
+					const int *nodes = ctx->cscene->roots;
+					int count = ctx->cscene->num_roots;
+
+					if(p->ray.iter == 0) {
+						nodes = primary_nodes(ctx, p->pixel % width, p->pixel / width, width, height,
+								aspect, &count);
+					}
+					if(!find_nearest(ctx, &p->ray, nodes, count, &p->hit)) {
+						p->hit.o = 0;
+					}
+				}
+				CSG_TRACE_END("extend");
+
+				/* shade */
+#pragma omp single
+				wf_sort(live, live + batch, num_live, paths, 1);
+
+				CSG_TRACE_BEGIN("shade", num_live);
+#pragma omp for schedule(dynamic, 64)
+				for(i=0; i<num_live; i++) {
+					wf_shade(ctx, paths + live[i], shadows + live[i] * num_lights);
+				}
+				CSG_TRACE_END("shade");
+
+				/* shadow rays, in the order of the hits they start from */
+				CSG_TRACE_BEGIN("shadow", num_live);
+#pragma omp for schedule(dynamic, 64)
+				for(i=0; i<num_live * num_lights; i++) {
+					struct wf_shadow *s = shadows + live[i / num_lights] * num_lights + i % num_lights;
+					if(s->light) {
+						s->visible = light_visible(&s->ray, s->light);
+					}
+				}
+				CSG_TRACE_END("shadow");
+
+#pragma omp for schedule(dynamic, 64)
+				for(i=0; i<num_live; i++) {
+					wf_gather(ctx, paths + live[i], shadows + live[i] * num_lights);
+				}
+
+				/* drop the finished paths */
+#pragma omp single
+				{
+					int n = 0;
+					for(i=0; i<num_live; i++) {
+						if(paths[live[i]].tint) {
+							live[n++] = live[i];
+						}
+					}
+					num_live = n;
 				}
-				it = it->next;
 			}
+			if(ctx->aborted) break;
+
+			/* only once the whole batch is done, so that an abort leaves its
+			 * rows untouched
+			 */
+#pragma omp for
+			for(i=0; i<count; i++) {
+				if(!ctx->pixel_mask || ctx->pixel_mask[start + i]) {
+					accum_color(pixels + paths[i].pixel * 3, paths[i].col, ctx->accumulate ? sample : 0);
+				}
+			}
+			if(ctx->abort_func) {
+#pragma omp single
+				memset(ctx->row_done + start / width, 1, count / width);
+			}
+		}
+
+		merge_stats(ctx);
+		curctx = prev;
+	}
+
+	free(paths);
+	free(shadows);
+	free(live);
+	return 0;
+}
+
+/* Sorts the live paths into bins, by the octant of their ray direction, or by
+ * the object they hit. The sort is stable, so the paths in each bin stay in the
+ * order of their pixels.
+ */
+static void wf_sort(int *live, int *tmp, int count, struct wf_path *paths, int by_object)
+{
+	int i, bin, offs = 0;
+	int start[WF_BINS] = {0};
+	struct wf_path *p;
+
+	for(i=0; i<count; i++) {
+		p = paths + live[i];
+		if(by_object) {
+			bin = ((unsigned long)p->hit.o / sizeof(csg_object)) % WF_BINS;
+		} else {
+			bin = (p->ray.dx < 0.0f) | ((p->ray.dy < 0.0f) << 1) | ((p->ray.dz < 0.0f) << 2);
+		}
+		p->bin = bin;
+		start[bin]++;
+	}
+	for(i=0; i<WF_BINS; i++) {
+		int n = start[i];
+		start[i] = offs;
+		offs += n;
+	}
+	for(i=0; i<count; i++) {
+		tmp[start[paths[live[i]].bin]++] = live[i];
+	}
+	memcpy(live, tmp, count * sizeof *live);
+}
+
+/* The first half of def_shader: applies the falloff of the GI ray which hit,
+ * sets up the shadow rays, and samples the continuation of the path. Random
+ * numbers are drawn in the same order as def_shader.
+ */
+static void wf_shade(csg_context *ctx, struct wf_path *p, struct wf_shadow *shadow)
+{
+	float falloff, bg[3];
+	csg_object *lt;
+
+	STAT_INC(shader_calls);
+
+	if(p->ray.iter > 0) {
+		falloff = gi_falloff(p->hit.o ? p->hit.t : 0.0f);
+		p->thru[0] *= falloff;
+		p->thru[1] *= falloff;
+		p->thru[2] *= falloff;
+	}
+
+	if(!p->hit.o) {
+		background(bg, &p->ray);
+		p->col[0] += p->thru[0] * bg[0];
+		p->col[1] += p->thru[1] * bg[1];
+		p->col[2] += p->thru[2] * bg[2];
+		for(lt=ctx->plights; lt; lt=lt->ob.plt_next) {
+			(shadow++)->light = 0;
+		}
+		p->tint = 0;
+		return;
+	}
+
+	face_forward(&p->hit, &p->ray);
+
+	for(lt=ctx->plights; lt; lt=lt->ob.plt_next) {
+		if(lt == p->hit.root) {
+			shadow->light = 0;
+		} else {
+			light_ray(&shadow->ray, &p->hit, lt);
+			shadow->light = lt;
+		}
+		shadow++;
+	}
 
-			if(it && it->end[idx].t < best->t) {
-				*best = it->end[idx];
+	if(ctx->use_gi && p->ray.iter < ctx->max_ray_depth) {
+		p->tint = sample_gi(&p->next, &p->ray, &p->hit, p->hit.o->ob.mtl);
+	} else {
+		p->tint = 0;
+	}
+}
+
+/* The second half of def_shader: adds the light reaching the hit to the path,
+ * and moves it on to the GI ray.
+ */
+static void wf_gather(csg_context *ctx, struct wf_path *p, struct wf_shadow *shadow)
+{
+	struct material *m;
+	csg_object *lt;
+	float dcol[3], scol[3] = {0, 0, 0};
+	float diff[3], spec[3];
+
+	if(p->hit.o) {
+		m = p->hit.o->ob.mtl;
+		dcol[0] = ctx->ambient[0] + m->emr;
+		dcol[1] = ctx->ambient[1] + m->emg;
+		dcol[2] = ctx->ambient[2] + m->emb;
+
+		for(lt=ctx->plights; lt; lt=lt->ob.plt_next) {
+			if(shadow->light && shadow->visible) {
+				light_color(diff, spec, &p->ray, &p->hit, m, &shadow->ray, lt);
+				dcol[0] += diff[0];
+				dcol[1] += diff[1];
+				dcol[2] += diff[2];
+				scol[0] += spec[0];
+				scol[1] += spec[1];
+				scol[2] += spec[2];
 			}
-			free_hit_list(hit);
+			shadow++;
+		}
+
+		p->col[0] += p->thru[0] * (dcol[0] + scol[0]);
+		p->col[1] += p->thru[1] * (dcol[1] + scol[1]);
+		p->col[2] += p->thru[2] * (dcol[2] + scol[2]);
+	}
+
+	if(p->tint) {
+		p->thru[0] *= p->tint[0];
+		p->thru[1] *= p->tint[1];
+		p->thru[2] *= p->tint[2];
+		p->ray = p->next;
+	}
+}
+
+void csg_get_stats(struct csg_stats *st)
+{
+	csg_context *ctx = CUR_CTX;
+
+	/* pick up anything traced by this thread outside of csg_render_image */
+	merge_stats(ctx);
+	*st = ctx->stats;
+}
+
+void csg_reset_stats(void)
+{
+	csg_context *ctx = CUR_CTX;
+
+#pragma omp critical(stats)
+	memset(&ctx->stats, 0, sizeof ctx->stats);
+	memset(&csg_tstats, 0, sizeof csg_tstats);
+}
+
+/* add the calling thread's counters to the totals, and clear them */
+static void merge_stats(csg_context *ctx)
+{
+#pragma omp critical(stats)
+	{
+		ctx->stats.primary_rays += csg_tstats.primary_rays;
+		ctx->stats.shadow_rays += csg_tstats.shadow_rays;
+		ctx->stats.gi_rays += csg_tstats.gi_rays;
+		ctx->stats.prim_tests += csg_tstats.prim_tests;
+		ctx->stats.csg_nodes += csg_tstats.csg_nodes;
+		ctx->stats.intervals += csg_tstats.intervals;
+		ctx->stats.shader_calls += csg_tstats.shader_calls;
+		ctx->stats.light_samples += csg_tstats.light_samples;
+		if(csg_tstats.max_csg_depth > ctx->stats.max_csg_depth) {
+			ctx->stats.max_csg_depth = csg_tstats.max_csg_depth;
+		}
+	}
+	memset(&csg_tstats, 0, sizeof csg_tstats);
+}
+
+float csg_ray_trace(csg_ray *ray, float *col)
+{
+	csg_context *ctx = CUR_CTX;
+	csg_hit hit;
+
+	STAT_INC(shader_calls);
+
+	if(!csg_find_intersection(ray, &hit)) {
+		ctx->shader(col, ray, 0, ctx->shader_cls);
+		return 0.0f;
+	}
+
+	ctx->shader(col, ray, &hit, ctx->shader_cls);
+	return hit.t;
+}
+
+int csg_find_intersection(csg_ray *ray, csg_hit *best)
+{
+	csg_context *ctx = CUR_CTX;
+
+	update_cscene(ctx);
+	return find_nearest(ctx, ray, ctx->cscene->roots, ctx->cscene->num_roots, best);
+}
+
+/* csg_find_intersection among the top-level objects with count node indices */
+static int find_nearest(csg_context *ctx, csg_ray *ray, const int *nodes, int count, csg_hit *best)
+{
+	int i;
+	struct cnode *n;
+	struct hinterv *hit;
+
+	best->t = FLT_MAX;
+	best->o = best->root = 0;
+
+	if(ray->iter > 0) {
+		STAT_INC(gi_rays);
+	} else if(ray->iter < 0) {
+		STAT_INC(shadow_rays);
+	} else {
+		STAT_INC(primary_rays);
+	}
+
+	for(i=0; i<count; i++) {
+		n = ctx->cscene->nodes + nodes[i];
+		if(ray->iter > 0 && (n->flags & CNODE_LIGHT)) {
+			/* skip light sources on GI bounce rays */
+			continue;
+		}
+
+		/* only the first hit of each object matters, and only if it's nearer
+		 * than what was found so far
+		 */
+		if(ctx->lazy) {
+			hit = ray_nearest(ray, ctx->cscene, n, best->t);
+		} else {
+			hit = ray_intersect(ray, ctx->cscene, n);
+		}
+		if(hit) {
+			nearest_hit(best, hit, ctx->cscene->objects[nodes[i]]);
 		}
-		o = o->ob.next;
 	}
 
 	return best->o != 0;
 }
 
-static void calc_primary_ray(csg_ray *ray, int x, int y, int w, int h, float aspect, int sample)
+/* The objects primary rays through pixel x, y need to test: those of its
+ * tile, if the tiles were built for this image, or else all of them.
+ */
+static const int *primary_nodes(csg_context *ctx, int x, int y, int width, int height, float aspect,
+		int *count)
+{
+	struct screen_tiles *st = &ctx->tiles;
+
+	update_cscene(ctx);
+
+	if(st->valid && st->width == width && st->height == height &&
+			aspect == (float)width / (float)height) {
+		*count = TILE_COUNT(st, x, y);
+		return TILE_NODES(st, x, y);
+	}
+	*count = ctx->cscene->num_roots;
+	return ctx->cscene->roots;
+}
+
+/* find_nearest for the rays of a packet in mask, returning the rays which hit
+ * anything
+ */
+static unsigned int find_packet_intersection(csg_context *ctx, struct ray_packet *pk, unsigned int mask,
+		const int *nodes, int count, csg_hit *best)
+{
+	int i, j;
+	unsigned int res = 0;
+	struct cnode *n;
+	struct hinterv *hits[PACKET_SIZE];
+
+	for(i=0; i<PACKET_SIZE; i++) {
+		best[i].t = FLT_MAX;
+		best[i].o = best[i].root = 0;
+
+		if(mask & (1 << i)) {
+			if(pk->iter > 0) {
+				STAT_INC(gi_rays);
+			} else if(pk->iter < 0) {
+				STAT_INC(shadow_rays);
+			} else {
+				STAT_INC(primary_rays);
+			}
+		}
+	}
+
+	for(i=0; i<count; i++) {
+		n = ctx->cscene->nodes + nodes[i];
+		if(pk->iter > 0 && (n->flags & CNODE_LIGHT)) {
+			continue;
+		}
+
+		packet_intersect(pk, mask, ctx->cscene, n, hits);
+		for(j=0; j<PACKET_SIZE; j++) {
+			if(hits[j]) {
+				nearest_hit(best + j, hits[j], ctx->cscene->objects[nodes[i]]);
+			}
+		}
+	}
+
+	for(i=0; i<PACKET_SIZE; i++) {
+		if(best[i].o) {
+			res |= 1 << i;
+		}
+	}
+	return res;
+}
+
+/* keeps the nearest hit in front of the ray origin, if it's nearer than best,
+ * along with the top-level object it came from, and frees the hit list
+ */
+static void nearest_hit(csg_hit *best, struct hinterv *hit, csg_object *root)
+{
+	const csg_hit *first = first_hit(hit);
+
+	if(first && first->t < best->t) {
+		*best = *first;
+		best->root = root;
+	}
+	free_hit_list(hit);
+}
+
+/* The scene is compiled the first time it's needed after objects were added or
+ * removed, which might be by any of the rendering threads.
+ */
+static void update_cscene(csg_context *ctx)
+{
+	if(!ctx->cscene) {
+#pragma omp critical(cscene)
+		{
+			if(!ctx->cscene && !(ctx->cscene = build_cscene(ctx->oblist))) {
+				abort();
+			}
+		}
+	}
+}
+
+/* The screen tiles are rebuilt for the next image after the camera, the
+ * scene or the image size changed. If that fails, primary rays test every
+ * object instead.
+ */
+static void update_tiles(csg_context *ctx, int width, int height)
+{
+	struct screen_tiles *st = &ctx->tiles;
+
+	if(!st->valid || st->width != width || st->height != height) {
+		CSG_TRACE_BEGIN("screen_tiles", -1);
+		build_screen_tiles(st, ctx->cscene, ctx->cam.xform, ctx->cam.fov, width, height);
+		CSG_TRACE_END("screen_tiles");
+	}
+}
+
+static void calc_primary_ray(csg_context *ctx, csg_ray *ray, int x, int y, int w, int h, float aspect, int sample)
 {
 	ray->dx = aspect * ((float)x / (float)w * 2.0f - 1.0f);
 	ray->dy = 1.0f - (float)y / (float)h * 2.0f;
-	ray->dz = -1.0f / tan(cam.fov * 0.5f);
+	ray->dz = -1.0f / tan(ctx->cam.fov * 0.5f);
 
 	if(sample) {
 		float pw = 1.0f / w;
@@ -630,193 +2014,208 @@ static void calc_primary_ray(csg_ray *ray, int x, int y, int w, int h, float asp
 	ray->energy = 1.0f;
 	ray->iter = 0;
 
-	xform_ray(ray, cam.xform);
+	xform_ray(ray, ctx->cam.xform);
 }
 
 
-static int dbg_in_shadow_ray;
-#define LUMINANCE(r, g, b)	((r) * 0.299f + (g) * 0.587f + (b) * 0.114f)
-#define SHININESS(r)	(pow((2.0 - r), 11.0))
-
+/* everything which depends only on the material is precalculated, see
+ * calc_material
+ */
 static void def_shader(float *col, csg_ray *ray, csg_hit *hit, void *cls)
 {
-	float ndotl, ndoth, len, falloff, spec, gloss;
-	csg_object *o, *lt = plights;
+	csg_context *ctx = CUR_CTX;
+	float falloff;
+	csg_object *lt = ctx->plights;
+	struct material *m;
 	float dcol[3], scol[3] = {0, 0, 0};
-	float lpos[3], ldir[3], lcol[3], hdir[3];
-	csg_ray sray;
-	csg_hit tmphit;
-	/*int entering = 1;*/
+	float diff[3], spec[3];
+	const float *tint;
+	csg_ray sray, giray;
 
 	if(!hit) {
 		background(col, ray);
 		return;
 	}
 
-	if(ray->dx * hit->nx + ray->dy * hit->ny + ray->dz * hit->nz > 0.0f) {
-		/*entering = 0;*/
-		hit->nx = -hit->nx;
-		hit->ny = -hit->ny;
-		hit->nz = -hit->nz;
-	}
-
-	dbg_in_shadow_ray = 1;
-
-	o = hit->o;
-	dcol[0] = ambient[0] + o->ob.emr;
-	dcol[1] = ambient[1] + o->ob.emg;
-	dcol[2] = ambient[2] + o->ob.emb;
+	face_forward(hit, ray);
 
-	gloss = 1.0f - o->ob.roughness;
+	m = hit->o->ob.mtl;
+	dcol[0] = ctx->ambient[0] + m->emr;
+	dcol[1] = ctx->ambient[1] + m->emg;
+	dcol[2] = ctx->ambient[2] + m->emb;
 
 	while(lt) {
-		if(lt == hit->o) {
-			lt = lt->ob.plt_next;
-			continue;
-		}
-
-		sample_object(lt, lpos);
-
-		ldir[0] = lpos[0] - hit->x;
-		ldir[1] = lpos[1] - hit->y;
-		ldir[2] = lpos[2] - hit->z;
-
-		sray.iter = -1;
-		sray.x = hit->x;
-		sray.y = hit->y;
-		sray.z = hit->z;
-		sray.dx = ldir[0];
-		sray.dy = ldir[1];
-		sray.dz = ldir[2];
-
-		if(!csg_find_intersection(&sray, &tmphit) || tmphit.o == lt || tmphit.t < 0.00001 || tmphit.t > 1.0f) {
-			if((len = sqrt(ldir[0] * ldir[0] + ldir[1] * ldir[1] + ldir[2] * ldir[2])) != 0.0f) {
-				float s = 1.0f / len;
-				ldir[0] *= s;
-				ldir[1] *= s;
-				ldir[2] *= s;
-			}
-			falloff = 1.0f / (len * len);
-
-			lcol[0] = lt->ob.emr * falloff;
-			lcol[1] = lt->ob.emg * falloff;
-			lcol[2] = lt->ob.emb * falloff;
-
-			if((ndotl = hit->nx * ldir[0] + hit->ny * ldir[1] + hit->nz * ldir[2]) < 0.0f) {
-				ndotl = 0.0f;
-			}
-
-			dcol[0] += o->ob.r * lcol[0] * ndotl;
-			dcol[1] += o->ob.g * lcol[1] * ndotl;
-			dcol[2] += o->ob.b * lcol[2] * ndotl;
-
-			if(o->ob.roughness < 1.0f) {
-				hdir[0] = ldir[0] - ray->dx;
-				hdir[1] = ldir[1] - ray->dy;
-				hdir[2] = ldir[2] - ray->dz;
-				if((len = sqrt(hdir[0] * hdir[0] + hdir[1] * hdir[1] + hdir[2] * hdir[2])) != 0.0f) {
-					float s = 1.0f / len;
-					hdir[0] *= s;
-					hdir[1] *= s;
-					hdir[2] *= s;
-				}
-
-				if((ndoth = hit->nx * hdir[0] + hit->ny * hdir[1] + hit->nz * hdir[2]) < 0.0f) {
-					ndoth = 0.0f;
-				}
-				spec = gloss * pow(ndoth, SHININESS(o->ob.roughness));
-
-				if(o->ob.metallic) {
-					lcol[0] *= o->ob.r;
-					lcol[1] *= o->ob.g;
-					lcol[2] *= o->ob.b;
-				}
-				scol[0] += lcol[0] * spec;
-				scol[1] += lcol[1] * spec;
-				scol[2] += lcol[2] * spec;
+		if(lt != hit->root) {
+			light_ray(&sray, hit, lt);
+			if(light_visible(&sray, lt)) {
+				light_color(diff, spec, ray, hit, m, &sray, lt);
+				dcol[0] += diff[0];
+				dcol[1] += diff[1];
+				dcol[2] += diff[2];
+				scol[0] += spec[0];
+				scol[1] += spec[1];
+				scol[2] += spec[2];
 			}
 		}
-
 		lt = lt->ob.plt_next;
 	}
 
-	dbg_in_shadow_ray = 0;
-
 	col[0] = dcol[0] + scol[0];
 	col[1] = dcol[1] + scol[1];
 	col[2] = dcol[2] + scol[2];
 
 	/* global illumination */
-	if(use_gi && ray->iter < max_ray_depth) {
-		float dist, rndval, brdf_val, lum = 1.0f;
+	if(ctx->use_gi && ray->iter < ctx->max_ray_depth && (tint = sample_gi(&giray, ray, hit, m))) {
 		float gicol[3] = {0, 0, 0};
-		float gi_falloff;
-		float vdir[3];
-		csg_ray giray;
 
-		giray.energy = ray->energy;
-		giray.iter = ray->iter + 1;
+		falloff = gi_falloff(csg_ray_trace(&giray, gicol));
 
-		giray.x = hit->x;
-		giray.y = hit->y;
-		giray.z = hit->z;
+		col[0] += gicol[0] * tint[0] * falloff;
+		col[1] += gicol[1] * tint[1] * falloff;
+		col[2] += gicol[2] * tint[2] * falloff;
+	}
+}
 
-		rndval = frand();
-		if(rndval < o->ob.roughness) {
-			/* diffuse interaction */
-			brdf_val = sample_lambert_brdf(&hit->nx, &giray.dx);
+/* flips the normal of the hit to face the ray */
+static void face_forward(csg_hit *hit, csg_ray *ray)
+{
+	if(ray->dx * hit->nx + ray->dy * hit->ny + ray->dz * hit->nz > 0.0f) {
+		hit->nx = -hit->nx;
+		hit->ny = -hit->ny;
+		hit->nz = -hit->nz;
+	}
+}
 
-			lum = LUMINANCE(o->ob.r, o->ob.g, o->ob.b);
+/* sets up a shadow ray from the hit to a random point on the light, ending at
+ * t = 1
+ */
+static void light_ray(csg_ray *sray, csg_hit *hit, csg_object *lt)
+{
+	float lpos[3];
+
+	sample_object(lt, lpos);
+	STAT_INC(light_samples);
+
+	sray->iter = -1;
+	sray->x = hit->x;
+	sray->y = hit->y;
+	sray->z = hit->z;
+	sray->dx = lpos[0] - hit->x;
+	sray->dy = lpos[1] - hit->y;
+	sray->dz = lpos[2] - hit->z;
+}
 
-			rndval = frand() * lum;
+static int light_visible(csg_ray *sray, csg_object *lt)
+{
+	csg_hit hit;
 
-			if(rndval < brdf_val) {
-				float inv_lum = 1.0f / lum;
-				if((dist = csg_ray_trace(&giray, gicol)) <= 0.0f) {
-					gi_falloff = 1.0f;
-				} else {
-					gi_falloff = 1.0f / (dist * dist);
-				}
-				if(gi_falloff > 1.0f) gi_falloff = 1.0f;
+	return !csg_find_intersection(sray, &hit) || hit.root == lt || hit.t < 0.00001 || hit.t > 1.0f;
+}
 
-				col[0] += gicol[0] * o->ob.r * inv_lum * gi_falloff;
-				col[1] += gicol[1] * o->ob.g * inv_lum * gi_falloff;
-				col[2] += gicol[2] * o->ob.b * inv_lum * gi_falloff;
-			}
+/* diffuse and specular light reflected along ray, from the light sample at the
+ * end of the shadow ray sray
+ */
+static void light_color(float *diff, float *spec, csg_ray *ray, csg_hit *hit,
+		struct material *m, csg_ray *sray, csg_object *lt)
+{
+	float ndotl, ndoth, len, falloff, sval;
+	struct material *lm = light_material(lt);
+	float ldir[3], lcol[3], hdir[3];
+
+	ldir[0] = sray->dx;
+	ldir[1] = sray->dy;
+	ldir[2] = sray->dz;
+	if((len = sqrt(ldir[0] * ldir[0] + ldir[1] * ldir[1] + ldir[2] * ldir[2])) != 0.0f) {
+		float s = 1.0f / len;
+		ldir[0] *= s;
+		ldir[1] *= s;
+		ldir[2] *= s;
+	}
+	falloff = 1.0f / (len * len);
 
-		} else {
-			/* specular interaction */
-			vdir[0] = -ray->dx;
-			vdir[1] = -ray->dy;
-			vdir[2] = -ray->dz;
-			brdf_val = sample_phong_brdf(vdir, &hit->nx, SHININESS(o->ob.roughness), &giray.dx);
-
-			rndval = frand();
-			if(o->ob.metallic) {
-				lum = LUMINANCE(o->ob.r, o->ob.g, o->ob.b);
-				rndval *= lum;
-			}
+	lcol[0] = lm->emr * falloff;
+	lcol[1] = lm->emg * falloff;
+	lcol[2] = lm->emb * falloff;
 
-			if(rndval < brdf_val) {
-				if((dist = csg_ray_trace(&giray, gicol)) <= 0.0f) {
-					gi_falloff = 1.0f;
-				} else {
-					gi_falloff = 1.0f / (dist * dist);
-				}
-				if(gi_falloff > 1.0f) gi_falloff = 1.0f;
+	if((ndotl = hit->nx * ldir[0] + hit->ny * ldir[1] + hit->nz * ldir[2]) < 0.0f) {
+		ndotl = 0.0f;
+	}
 
-				if(o->ob.metallic) {
-					float inv_lum = 1.0f / lum;
-					gicol[0] *= o->ob.r * inv_lum;
-					gicol[1] *= o->ob.g * inv_lum;
-					gicol[2] *= o->ob.b * inv_lum;
-				}
-				col[0] += gicol[0] * gi_falloff;
-				col[1] += gicol[1] * gi_falloff;
-				col[2] += gicol[2] * gi_falloff;
-			}
+	diff[0] = m->r * lcol[0] * ndotl;
+	diff[1] = m->g * lcol[1] * ndotl;
+	diff[2] = m->b * lcol[2] * ndotl;
+
+	if(m->roughness < 1.0f) {
+		hdir[0] = ldir[0] - ray->dx;
+		hdir[1] = ldir[1] - ray->dy;
+		hdir[2] = ldir[2] - ray->dz;
+		if((len = sqrt(hdir[0] * hdir[0] + hdir[1] * hdir[1] + hdir[2] * hdir[2])) != 0.0f) {
+			float s = 1.0f / len;
+			hdir[0] *= s;
+			hdir[1] *= s;
+			hdir[2] *= s;
+		}
+
+		if((ndoth = hit->nx * hdir[0] + hit->ny * hdir[1] + hit->nz * hdir[2]) < 0.0f) {
+			ndoth = 0.0f;
 		}
+		sval = m->gloss * pow(ndoth, m->shininess);
+
+		spec[0] = lcol[0] * m->spec_tint[0] * sval;
+		spec[1] = lcol[1] * m->spec_tint[1] * sval;
+		spec[2] = lcol[2] * m->spec_tint[2] * sval;
+	} else {
+		spec[0] = spec[1] = spec[2] = 0.0f;
+	}
+}
+
+/* Chooses between a diffuse and a specular bounce, and samples its direction
+ * into giray. Returns the tint of the light gathered along giray, or null if
+ * russian roulette ends the path.
+ */
+static const float *sample_gi(csg_ray *giray, csg_ray *ray, csg_hit *hit, struct material *m)
+{
+	float rndval, brdf_val;
+	float vdir[3];
+
+	giray->energy = ray->energy;
+	giray->iter = ray->iter + 1;
+
+	giray->x = hit->x;
+	giray->y = hit->y;
+	giray->z = hit->z;
+
+	rndval = frand();
+	if(rndval < m->roughness) {
+		/* diffuse interaction */
+		brdf_val = sample_lambert_brdf(&hit->nx, &giray->dx);
+
+		rndval = frand() * m->lum;
+		return rndval < brdf_val ? m->diff_tint : 0;
+	}
+
+	/* specular interaction */
+	vdir[0] = -ray->dx;
+	vdir[1] = -ray->dy;
+	vdir[2] = -ray->dz;
+	brdf_val = sample_phong_brdf(vdir, &hit->nx, m->shininess, &giray->dx);
+
+	rndval = frand() * m->spec_weight;
+	return rndval < brdf_val ? m->spec_gi_tint : 0;
+}
+
+/* falloff of the light gathered by a GI ray, which hit at distance dist, or
+ * nothing if it's 0
+ */
+static float gi_falloff(float dist)
+{
+	float falloff;
+
+	if(dist <= 0.0f) {
+		return 1.0f;
 	}
+	falloff = 1.0f / (dist * dist);
+	return falloff > 1.0f ? 1.0f : falloff;
 }
 
 static float sample_lambert_brdf(float *norm, float *res)
@@ -920,13 +2319,224 @@ static void background(float *col, csg_ray *ray)
 	col[0] = col[1] = col[2] = 0.0f;
 }
 
+/* trace with the default shader, but return the cost of the ray tree instead
+ * of its color, using the thread's statistics counters
+ */
+static void trace_heatmap(csg_context *ctx, csg_ray *ray, float *col)
+{
+	double t0 = 0.0;
+	float cost;
+	struct csg_stats st0 = csg_tstats;
+
+	if(ctx->heat_metric == CSG_HEAT_TIME) {
+		t0 = get_time_nsec();
+	}
+
+	csg_ray_trace(ray, col);
+
+	switch(ctx->heat_metric) {
+	case CSG_HEAT_PRIM_TESTS:
+		cost = csg_tstats.prim_tests - st0.prim_tests;
+		break;
+	case CSG_HEAT_CSG_NODES:
+		cost = csg_tstats.csg_nodes - st0.csg_nodes;
+		break;
+	case CSG_HEAT_INTERVALS:
+		cost = csg_tstats.intervals - st0.intervals;
+		break;
+	case CSG_HEAT_TIME:
+	default:
+		cost = get_time_nsec() - t0;
+	}
+
+	heat_color(col, cost / (float)(ctx->heat_scale > 0 ? ctx->heat_scale : def_heat_scale[ctx->heat_metric]));
+}
+
+/* black -> blue -> cyan -> green -> yellow -> red, white above the scale */
+static void heat_color(float *col, float val)
+{
+	static const float ramp[][3] = {
+		{0, 0, 0}, {0, 0, 1}, {0, 1, 1}, {0, 1, 0}, {1, 1, 0}, {1, 0, 0}
+	};
+	static const int ramp_max = sizeof ramp / sizeof *ramp - 1;
+	int idx;
+	float t;
+
+	if(val >= 1.0f) {
+		col[0] = col[1] = col[2] = 1.0f;
+		return;
+	}
+	if(val < 0.0f) val = 0.0f;
+
+	t = val * ramp_max;
+	idx = (int)t;
+	t -= idx;
+
+	col[0] = ramp[idx][0] + (ramp[idx + 1][0] - ramp[idx][0]) * t;
+	col[1] = ramp[idx][1] + (ramp[idx + 1][1] - ramp[idx][1]) * t;
+	col[2] = ramp[idx][2] + (ramp[idx + 1][2] - ramp[idx][2]) * t;
+}
+
 
-static csg_object *load_object(struct ts_node *node)
+/* a viewer is a single camera, or an orbit of several frames around its target
+ * if it has a frame count
+ */
+static int load_viewer(csg_context *ctx, struct ts_node *node)
 {
+	static float def_pos[] = {0, 0, 5};
+	static float def_targ[] = {0, 0, 0};
+
+	float *p = ts_get_attr_vec(node, "position", def_pos);
+	float *t = ts_get_attr_vec(node, "target", def_targ);
+	float fov = ts_get_attr_num(node, "fov", 50.0f);
+	const char *name = ts_get_attr_str(node, "name", 0);
+	int frames = ts_get_attr_int(node, "frames", 0);
+
+	if(frames) {
+		float orbit = ts_get_attr_num(node, "orbit", 360.0f);
+		return add_orbit(ctx, name, p, t, fov, frames, orbit);
+	}
+	return add_view(ctx, name, p, t, fov);
+}
+
+/* define {
+ *	name = "name"
+ *	<object>
+ * }
+ * The object is stored once, and can be used any number of times after its
+ * definition with instance { ref = "name" }, which also takes the usual
+ * transformation attributes.
+ */
+static int load_define(csg_context *ctx, struct ts_node *node)
+{
+	const char *name;
+	csg_object *o = 0;
+	struct ts_node *c;
+
+	if(!(name = ts_get_attr_str(node, "name", 0))) {
+		fprintf(stderr, "define without a name\n");
+		return -1;
+	}
+	if(find_define(ctx, name)) {
+		fprintf(stderr, "duplicate definition: %s\n", name);
+		return -1;
+	}
+
+	c = node->child_list;
+	while(c) {
+		if(o) {
+			fprintf(stderr, "definition %s has more than one object\n", name);
+			csg_free_object(o);
+			return -1;
+		}
+		if(!(o = load_object(ctx, c))) {
+			fprintf(stderr, "failed to load the object of definition %s\n", name);
+			return -1;
+		}
+		c = c->next;
+	}
+	if(!o) {
+		fprintf(stderr, "definition %s has no object\n", name);
+		return -1;
+	}
+
+	bake_xform(o);
+	if(ctx->optimize && !emissive(o)) {
+		/* an empty definition still has to be found by its instances */
+		if(!(o = optimize_object(o)) && !(o = csg_null(0, 0, 0))) {
+			return -1;
+		}
+	}
+
+	csg_name(o, name);
+	o->ob.next = ctx->deflist;
+	ctx->deflist = o;
+	return 0;
+}
+
+/* Named materials are defined at the top level of the scene:
+ * material {
+ *	name = "name"
+ *	<material attributes>
+ * }
+ * and used by any number of objects after their definition, with
+ * material = "name". Material attributes of those objects modify it.
+ */
+static int load_material(csg_context *ctx, struct ts_node *node)
+{
+	const char *name;
+	struct material mtl, *m;
+
+	if(!(name = ts_get_attr_str(node, "name", 0))) {
+		fprintf(stderr, "material without a name\n");
+		return -1;
+	}
+
+	mtl_defaults(&mtl);
+	read_material(node, &mtl);
+	if(!(m = mtl_create(&ctx->mtllist, name, &mtl))) {
+		return -1;
+	}
+	/* the list keeps named materials */
+	mtl_release(m);
+	return 0;
+}
+
+/* reads the material attributes of node into m, returns how many there were */
+static int read_material(struct ts_node *node, struct material *m)
+{
+	int count = 0;
 	float *avec;
+
+	if((avec = ts_get_attr_vec(node, "color", 0))) {
+		m->r = avec[0];
+		m->g = avec[1];
+		m->b = avec[2];
+		count++;
+	}
+	if((avec = ts_get_attr_vec(node, "emission", 0))) {
+		m->emr = avec[0];
+		m->emg = avec[1];
+		m->emb = avec[2];
+		count++;
+	}
+	if(ts_get_attr(node, "roughness")) {
+		m->roughness = ts_get_attr_num(node, "roughness", m->roughness);
+		count++;
+	}
+	if(ts_get_attr(node, "opacity")) {
+		m->opacity = ts_get_attr_num(node, "opacity", m->opacity);
+		count++;
+	}
+	if(ts_get_attr(node, "metallic")) {
+		m->metallic = ts_get_attr_int(node, "metallic", m->metallic);
+		count++;
+	}
+
+	calc_material(m);
+	return count;
+}
+
+static csg_object *find_define(csg_context *ctx, const char *name)
+{
+	csg_object *o = ctx->deflist;
+	while(o) {
+		if(strcmp(o->ob.name, name) == 0) {
+			return o;
+		}
+		o = o->ob.next;
+	}
+	return 0;
+}
+
+static csg_object *load_object(csg_context *ctx, struct ts_node *node)
+{
+	float *avec;
+	const char *str;
 	struct ts_node *c;
-	csg_object *sub, *o = 0, *olist = 0, *otail = 0;
-	int num_subobj = 0, is_csgop = 0;
+	struct material mtl, *m;
+	csg_object *sub, *o = 0;
+	int is_csgop = 0;
 
 	if(strcmp(node->name, "null") == 0) {
 		if(!(o = csg_null(0, 0, 0))) {
@@ -960,6 +2570,24 @@ static csg_object *load_object(struct ts_node *node)
 			goto err;
 		}
 
+	} else if(strcmp(node->name, "instance") == 0) {
+		const char *ref = ts_get_attr_str(node, "ref", "");
+		csg_object *def;
+
+		if(!(def = find_define(ctx, ref))) {
+			fprintf(stderr, "instance of undefined object: \"%s\"\n", ref);
+			goto err;
+		}
+		mtl = *def->ob.mtl;
+		if(ts_get_attr(node, "material") || read_material(node, &mtl)) {
+			fprintf(stderr, "instance of \"%s\" with material attributes: instances use the"
+					" materials of their definition\n", ref);
+			goto err;
+		}
+		if(!(o = csg_instance(def))) {
+			goto err;
+		}
+
 	} else if(strcmp(node->name, "union") == 0) {
 		if(!(o = csg_union(0, 0))) {
 			goto err;
@@ -985,24 +2613,17 @@ static csg_object *load_object(struct ts_node *node)
 	if(is_csgop) {
 		c = node->child_list;
 		while(c) {
-			if((sub = load_object(c))) {
-				if(olist) {
-					otail->ob.next = sub;
-					otail = sub;
-				} else {
-					olist = otail = sub;
-				}
-				++num_subobj;
+			if((sub = load_object(ctx, c)) && csg_add_operand(o, sub) == -1) {
+				csg_free_object(sub);
+				goto err;
 			}
 			c = c->next;
 		}
 
-		if(num_subobj != 2) {
+		if(o->csg.num_sub < 2) {
+			fprintf(stderr, "%s needs at least two operands\n", node->name);
 			goto err;
 		}
-		o->csg.a = olist;
-		o->csg.b = olist->ob.next;
-		olist->ob.next = 0;
 	}
 
 	if((avec = ts_get_attr_vec(node, "position", 0))) {
@@ -1026,25 +2647,25 @@ static csg_object *load_object(struct ts_node *node)
 
 	csg_name(o, ts_get_attr_str(node, "name", 0));
 
-	if((avec = ts_get_attr_vec(node, "color", 0))) {
-		csg_color(o, avec[0], avec[1], avec[2]);
+	/* material attributes modify the named material, if there is one */
+	if((str = ts_get_attr_str(node, "material", 0)) && csg_material(o, str) == -1) {
+		fprintf(stderr, "undefined material: \"%s\"\n", str);
+		goto err;
 	}
-	if((avec = ts_get_attr_vec(node, "emission", 0))) {
-		csg_emission(o, avec[0], avec[1], avec[2]);
+	mtl = *o->ob.mtl;
+	if(read_material(node, &mtl)) {
+		mtl.name = 0;
+		mtl.flags = 0;
+		if(!(m = mtl_share(&mtl))) {
+			goto err;
+		}
+		mtl_release(o->ob.mtl);
+		o->ob.mtl = m;
 	}
 
-	csg_roughness(o, ts_get_attr_num(node, "roughness", o->ob.roughness));
-	csg_opacity(o, ts_get_attr_num(node, "opacity", o->ob.opacity));
-	csg_metallic(o, ts_get_attr_int(node, "metallic", o->ob.metallic));
-
 	return o;
 
 err:
 	csg_free_object(o);
-	while(olist) {
-		o = olist;
-		olist = olist->ob.next;
-		csg_free_object(o);
-	}
 	return 0;
 }
@@ -33,6 +33,11 @@ typedef struct csg_hit {
 	float x, y, z;
 	float nx, ny, nz;
 	csg_object *o;
+	csg_object *root;	/* the top-level object o is part of, or an instance of */
+	/* hash of the instance nodes o was reached through, 0 if none, which tells
+	 * apart the instances sharing o
+	 */
+	unsigned int inst_path;
 } csg_hit;
 
 typedef void (*csg_shader_func_type)(float *col, csg_ray *ray, csg_hit *hit, void *cls);
@@ -40,22 +45,74 @@ typedef void (*csg_shader_func_type)(float *col, csg_ray *ray, csg_hit *hit, voi
 enum {
 	CSG_DEFAULT_SHADER_ID,
 	CSG_GI_SHADER_ID,
-	CSG_DEBUG_SHADER_ID = 16
+	CSG_DEBUG_SHADER_ID = 16,
+	CSG_HEATMAP_SHADER_ID
 };
 
 #define CSG_DEFAULT_SHADER	((csg_shader_func_type)CSG_DEFAULT_SHADER_ID)
 #define CSG_GI_SHADER		((csg_shader_func_type)CSG_GI_SHADER_ID)
 #define CSG_DEBUG_SHADER	((csg_shader_func_type)CSG_DEBUG_SHADER_ID)
+#define CSG_HEATMAP_SHADER	((csg_shader_func_type)CSG_HEATMAP_SHADER_ID)
+
+/* cost metrics for CSG_HEATMAP_SHADER, see CSG_OPT_HEATMAP */
+enum {
+	CSG_HEAT_PRIM_TESTS,	/* primitive intersection tests */
+	CSG_HEAT_CSG_NODES,		/* CSG operator nodes visited */
+	CSG_HEAT_INTERVALS,		/* hit interval nodes allocated */
+	CSG_HEAT_TIME,			/* nanoseconds */
+
+	CSG_NUM_HEAT_METRICS
+};
+
+/* runtime statistics, see csg_get_stats */
+struct csg_stats {
+	unsigned long long primary_rays;
+	unsigned long long shadow_rays;
+	unsigned long long gi_rays;
+	unsigned long long prim_tests;		/* leaf primitive intersection tests */
+	unsigned long long csg_nodes;		/* CSG operator nodes visited */
+	unsigned long long intervals;		/* hit interval nodes allocated */
+	unsigned long long shader_calls;
+	unsigned long long light_samples;	/* direct lighting samples taken by the shaders */
+	int max_csg_depth;					/* deepest CSG tree recursion */
+};
 
 enum {
 	CSG_OPT_MAX_ITER,
+	CSG_OPT_HEATMAP,		/* heatmap cost metric (CSG_HEAT_*) */
+	CSG_OPT_HEATMAP_SCALE,	/* cost mapped to the hottest color, 0 for the default */
+	CSG_OPT_OPTIMIZE,		/* restructure CSG trees for speed in csg_load (default: 1) */
+	CSG_OPT_WAVEFRONT,		/* render with the wavefront integrator (default: 0) */
+	CSG_OPT_LAZY,			/* evaluate CSG only as far as the nearest hit of single rays,
+							 * instead of whole interval lists (default: 1) */
+	CSG_OPT_ACCUMULATE,		/* average samples into the image, or overwrite it with them,
+							 * to be averaged by the caller (default: 1) */
 
 	CSG_NUM_OPTIONS
 };
 
+/* A rendering context holds a scene, with its camera, shader, options and
+ * statistics. Every function below works on the calling thread's current
+ * context, so different threads can load and render different contexts
+ * concurrently, but a context must not be used by two threads at once. The
+ * threads rendering an image share the context of the thread which called
+ * csg_render_image.
+ *
+ * csg_init creates the default context, which is current for every thread
+ * which hasn't made another one current, and csg_destroy frees it.
+ */
+typedef struct csg_context csg_context;
+
 int csg_init(void);
 void csg_destroy(void);
 
+csg_context *csg_create_context(void);
+/* frees the context, with all the objects of its scene */
+void csg_free_context(csg_context *ctx);
+/* makes ctx current for the calling thread, or the default context if null */
+void csg_make_current(csg_context *ctx);
+csg_context *csg_current_context(void);
+
 void csg_option(int opt, int val);
 int csg_get_option(int opt);
 
@@ -66,11 +123,33 @@ float *csg_get_view_target(float *tgt);
 void csg_fov(float fov);
 float csg_get_fov(void);
 
+/* Views are cameras to render the scene from, like the viewer blocks of scene
+ * files, numbered in the order they're added. csg_load switches to the first
+ * view of the file. Names are optional, and the add functions return the index
+ * of the (first) view they added, or -1 on failure.
+ */
+int csg_add_view(const char *name, float x, float y, float z, float tx, float ty, float tz,
+		float fov);
+/* adds a turntable of frames views, orbiting the position around the target by
+ * degrees in total. Named orbits get a frame number suffix: name-0000, ...
+ */
+int csg_add_orbit(const char *name, float x, float y, float z, float tx, float ty, float tz,
+		float fov, int frames, float degrees);
+void csg_clear_views(void);
+int csg_num_views(void);
+const char *csg_view_name(int idx);
+/* sets the view parameters to those of view idx. Returns -1 if there's no such view */
+int csg_use_view(int idx);
+
 /* Set the shader function used to calculate the color returned by each ray.
  * Pass the address of a custom shader function, or one of the pre-defined shaders:
  * - CSG_DEFAULT_SHADER: default photorealistic shader
  * - CSG_GI_SHADER: default global illumination shader
  * - CSG_DEBUG_SHADER: debug shader using normals as colors
+ * - CSG_HEATMAP_SHADER: colors each pixel by the work spent on it, while
+ *   rendering it with the default shader. The cost metric and the cost which
+ *   maps to the hottest color are set with CSG_OPT_HEATMAP and
+ *   CSG_OPT_HEATMAP_SCALE.
  *
  * The cls pointer will be passed to the shader function on every invocation.
  *
@@ -79,9 +158,19 @@ float csg_get_fov(void);
  */
 void csg_shader(csg_shader_func_type sdr, void *cls);
 
+/* csg_load reads either a text scene description, or a compiled scene written
+ * by csg_save. Compiled scenes are copied from the file into a single
+ * allocation shared by all their objects, so loading them takes no parsing or
+ * matrix calculations.
+ * Objects of compiled scenes can be removed, but not freed until their context
+ * is.
+ */
 int csg_load(const char *fname);
 int csg_save(const char *fname);
 
+/* Objects are bounded when they're added to the scene, for culling during
+ * traversal. Transform them before adding them, or remove and add them again.
+ */
 void csg_add_object(csg_object *o);
 int csg_remove_object(csg_object *o);
 void csg_free_object(csg_object *o);
@@ -92,9 +181,23 @@ csg_object *csg_cylinder(float x0, float y0, float z0, float x1, float y1, float
 csg_object *csg_plane(float x, float y, float z, float nx, float ny, float nz);
 csg_object *csg_box(float x, float y, float z, float xsz, float ysz, float zsz);
 
+/* Instance of a shared object definition, with a transformation of its own.
+ * The definition is not copied, and isn't freed with its instances: it must
+ * outlive them, and must not be added to the scene directly. Instances share
+ * the materials of their definition, and changing the material of an instance
+ * has no effect.
+ */
+csg_object *csg_instance(csg_object *def);
+
+/* CSG operations take any number of operands, and own them. The operands
+ * passed to the constructors can be null, to add them later. A subtraction
+ * cuts all its other operands out of the first one.
+ */
 csg_object *csg_union(csg_object *a, csg_object *b);
 csg_object *csg_intersection(csg_object *a, csg_object *b);
 csg_object *csg_subtraction(csg_object *a, csg_object *b);
+/* appends o to the operands of a CSG operation. Returns -1 on failure */
+int csg_add_operand(csg_object *op, csg_object *o);
 
 void csg_ambient(float r, float g, float b);
 
@@ -105,6 +208,10 @@ void csg_color(csg_object *o, float r, float g, float b);
 void csg_roughness(csg_object *o, float r);
 void csg_opacity(csg_object *o, float p);
 void csg_metallic(csg_object *o, int m);
+/* use a named material defined by a loaded scene file, instead of the above.
+ * Returns -1 if there's no such material.
+ */
+int csg_material(csg_object *o, const char *name);
 
 void csg_reset_xform(csg_object *o);
 void csg_translate(csg_object *o, float x, float y, float z);
@@ -112,8 +219,84 @@ void csg_rotate(csg_object *o, float angle, float x, float y, float z);
 void csg_scale(csg_object *o, float x, float y, float z);
 void csg_lookat(csg_object *o, float x, float y, float z, float tx, float ty, float tz, float ux, float uy, float uz);
 
+/* traces pixel x, y with csg_dbg_pixel set during the next csg_render_image,
+ * to break on in a debugger
+ */
+void csg_debug_pixel(int x, int y);
+
 void csg_render_pixel(int x, int y, int width, int height, float aspect, int sample, float *color);
-void csg_render_image(float *pixels, int width, int height, int sample);
+/* Returns -1 if the render was aborted, see csg_abort_func, or 0 if every
+ * pixel was rendered.
+ */
+int csg_render_image(float *pixels, int width, int height, int sample);
+
+/* Stops renders early. The render threads call func before every row of pixels
+ * they start, or every bounce of the wavefront integrator, possibly several of
+ * them at once, and once it returns non-zero they skip the rest of the image.
+ * The rows which were finished have the sample accumulated, and the others are
+ * left untouched. Pass a null func to never abort.
+ */
+typedef int (*csg_abort_func_type)(void *cls);
+void csg_abort_func(csg_abort_func_type func, void *cls);
+/* Sets done[y] to 1 for every row y which the last csg_render_image finished,
+ * and to 0 for the rest, up to the height of that image. Returns the number of
+ * rows done.
+ */
+int csg_rows_done(unsigned char *done);
+
+/* Makes csg_render_image skip the pixels which are 0 in mask, leaving them
+ * untouched. The mask has a byte per pixel, row by row, and must outlive the
+ * renders using it. Pass null to render every pixel again.
+ */
+void csg_pixel_mask(const unsigned char *mask);
+
+/* what the first, unjittered ray of a pixel hits, see csg_render_hits */
+struct csg_pixel_hit {
+	float pos[3];		/* world space */
+	float norm[3];		/* unit length, facing out of the object */
+	float depth;		/* distance from the camera */
+	int id;				/* of the primitive, -1 if the ray hit nothing */
+	int root;			/* of the top-level object, or -1 */
+	unsigned int inst_path;	/* see csg_hit: with id, tells apart the instances
+							 * sharing a primitive, nested or not */
+};
+
+/* Traces the unjittered ray of every pixel, through the pixel coordinates x, y
+ * of its corner, without shading, like the first sample of csg_render_image.
+ * Aborts like csg_render_image too, returning -1 with some rows missing.
+ */
+int csg_render_hits(struct csg_pixel_hit *hits, int width, int height);
+/* Projects the point pos onto a width x height image from the current view,
+ * into the pixel coordinates of csg_render_pixel, where the unjittered ray of
+ * pixel x, y passes through x, y. Returns -1 if it's behind the camera.
+ */
+int csg_project(float *pix, const float *pos, int width, int height);
+
+/* Counters are gathered per thread while rendering, and merged into the context
+ * at the end of csg_render_image. They accumulate across frames until
+ * csg_reset_stats.
+ */
+void csg_get_stats(struct csg_stats *st);
+void csg_reset_stats(void);
+
+/* Timeline instrumentation, written as a Chrome trace JSON file which can be
+ * opened in chrome://tracing or the Perfetto UI. Only available when built
+ * with -DCSG_TRACE (make trace=1); otherwise the CSG_TRACE_* macros expand to
+ * nothing and the instrumentation is compiled out completely.
+ */
+#ifdef CSG_TRACE
+int csg_trace_open(const char *fname);
+void csg_trace_close(void);
+/* arg is attached to the event if non-negative */
+void csg_trace_begin(const char *name, int arg);
+void csg_trace_end(const char *name);
+
+#define CSG_TRACE_BEGIN(name, arg)	csg_trace_begin(name, arg)
+#define CSG_TRACE_END(name)			csg_trace_end(name)
+#else
+#define CSG_TRACE_BEGIN(name, arg)
+#define CSG_TRACE_END(name)
+#endif
 
 /* trace a single ray, invoke shaders, and return the color through the col pointer
  * returns the intersection distance, or 0 if no intersection was found
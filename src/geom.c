@@ -17,6 +17,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <float.h>
 #include <assert.h>
@@ -25,10 +26,94 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "mathutil.h"
 
 #define EPSILON		1e-6f
-
-static struct hinterv *interval_union(struct hinterv *a, struct hinterv *b);
-static struct hinterv *interval_isect(struct hinterv *a, struct hinterv *b);
-static struct hinterv *interval_sub(struct hinterv *a, struct hinterv *b);
+/* relative slack added to bounding boxes, for rounding errors */
+#define BOUNDS_SLACK	1e-5f
+
+/* CSG operations with fewer bounded operands than this just test them all */
+#define BVH_MIN_OPERANDS	4
+#define BVH_LEAF_SIZE		1
+/* enough for any hierarchy built by median splits */
+#define BVH_MAX_DEPTH		64
+
+/* intersections with more operands keep their order, see order_operands */
+#define ORDER_MAX_OPERANDS	64
+/* caps hit probabilities to keep order_operands from dividing by zero */
+#define MAX_HIT_PROB		0.99f
+/* half the surface area of a box with extents e */
+#define AREA(e)		((e)[0] * (e)[1] + (e)[1] * (e)[2] + (e)[2] * (e)[0])
+
+/* the object a compiled scene node was built from */
+#define NODE_OBJ(sc, n)		((sc)->objects[(n) - (sc)->nodes])
+/* node of operand table entry i */
+#define OPERAND(sc, i)		((sc)->nodes + (sc)->operands[i])
+
+static int ray_bounds(csg_ray *ray, const float *bmin, const float *bmax, float tmin, float tmax);
+static int reaches(csg_ray *ray, const struct cnode *n, const struct hinterv *res, float tmax);
+static void result_range(const struct hinterv *res, float *tmin, float *tmax);
+static struct hinterv *combine(int op, struct hinterv *res, struct hinterv *hits);
+static struct hinterv *ray_csg_bvh(csg_ray *ray, const struct cscene *sc, const struct cnode *n,
+		struct hinterv *res);
+static struct hinterv *sphere_hits(csg_ray *ray, const struct cscene *sc, const struct cnode *n,
+		csg_ray *locray, float *t);
+static struct hinterv *cylinder_hits(csg_ray *ray, const struct cscene *sc, const struct cnode *n,
+		csg_ray *locray, float *t, int *cap);
+static struct hinterv *box_hits(csg_ray *ray, const struct cscene *sc, const struct cnode *n,
+		csg_ray *locray, float tmin, float tmax);
+static struct hinterv *ray_leaf_block(csg_ray *ray, const struct cscene *sc, const struct cnode *n,
+		const struct bvh_node *leaf, struct hinterv *res);
+static void block_local_rays(const struct leaf_block *blk, const csg_ray *ray,
+		float (*lr)[LEAF_BLOCK_SIZE]);
+static unsigned int block_spheres(const struct leaf_block *blk, const csg_ray *ray,
+		float (*t)[LEAF_BLOCK_SIZE]);
+static unsigned int block_cylinders(const struct leaf_block *blk, const csg_ray *ray,
+		float (*t)[LEAF_BLOCK_SIZE], int (*cap)[LEAF_BLOCK_SIZE]);
+static unsigned int block_boxes(const struct leaf_block *blk, const csg_ray *ray,
+		float (*t)[LEAF_BLOCK_SIZE]);
+static void build_bvh(csg_object *o);
+static int rigid(const float *m);
+static void local_ray(csg_ray *res, csg_ray *ray, const struct cnode *n);
+static void world_normal(float *norm, const struct cnode *n);
+static void instance_hits(csg_ray *ray, const struct cscene *sc, const struct cnode *n,
+		struct hinterv *hit);
+static struct hinterv *lazy_intersect(csg_ray *ray, const struct cscene *sc, const struct cnode *n,
+		float *tmax, int nearest);
+static struct hinterv *lazy_un(csg_ray *ray, const struct cscene *sc, const struct cnode *n,
+		float *tmax, int nearest);
+static struct hinterv *lazy_isect(csg_ray *ray, const struct cscene *sc, const struct cnode *n,
+		float *tmax);
+static struct hinterv *lazy_sub(csg_ray *ray, const struct cscene *sc, const struct cnode *n,
+		float *tmax, int nearest);
+static struct hinterv *lazy_bvh(csg_ray *ray, const struct cscene *sc, const struct cnode *n,
+		struct hinterv *res, float *tmax, int nearest);
+static struct hinterv *lazy_instance(csg_ray *ray, const struct cscene *sc, const struct cnode *n,
+		float *tmax, int nearest);
+static int cull_cutters(const struct cscene *sc, const struct cnode *n);
+static void lower_to_hit(const struct hinterv *res, float *tmax);
+static struct hinterv *copy_hits(const struct hinterv *list);
+static unsigned int packet_bounds(const struct ray_packet *pk, unsigned int mask,
+		const float *bmin, const float *bmax, const float *tmin, const float *tmax);
+static unsigned int combine_lanes(int op, unsigned int mask, struct hinterv **res,
+		struct hinterv **hits);
+static unsigned int live_lanes(unsigned int mask, struct hinterv **res);
+static unsigned int packet_reaches(const struct ray_packet *pk, unsigned int mask,
+		const struct cnode *n, struct hinterv **res);
+static void packet_csg_un(const struct ray_packet *pk, unsigned int mask, const struct cscene *sc,
+		const struct cnode *n, struct hinterv **res);
+static void packet_csg_isect(const struct ray_packet *pk, unsigned int mask, const struct cscene *sc,
+		const struct cnode *n, struct hinterv **res);
+static void packet_csg_sub(const struct ray_packet *pk, unsigned int mask, const struct cscene *sc,
+		const struct cnode *n, struct hinterv **res);
+static void packet_csg_bvh(const struct ray_packet *pk, unsigned int mask, const struct cscene *sc,
+		const struct cnode *n, struct hinterv **res);
+static void packet_instance(const struct ray_packet *pk, unsigned int mask, const struct cscene *sc,
+		const struct cnode *n, struct hinterv **res);
+static int build_bvh_node(struct csgop *op, int idx, int first, int count);
+static void order_operands(csg_object *o);
+static void calc_estimates(csg_object *o);
+static void estimate(csg_object *o, float *cost, float *prob);
+static float area_ratio(csg_object *o, csg_object *outer);
+static void split_operands(csg_object **sub, int count, int axis, int mid);
+static float centroid(csg_object *o, int axis);
 
 /* TODO custom hit allocator */
 struct hinterv *alloc_hit(void)
@@ -46,6 +131,8 @@ struct hinterv *alloc_hits(int n)
 	int i;
 	struct hinterv *list = 0;
 
+	STAT_ADD(intervals, n);
+
 	for(i=0; i<n; i++) {
 		struct hinterv *hit = alloc_hit();
 		hit->next = list;
@@ -69,42 +156,123 @@ void free_hit_list(struct hinterv *hit)
 	}
 }
 
-struct hinterv *ray_intersect(csg_ray *ray, csg_object *o)
+struct hinterv *ray_intersect(csg_ray *ray, const struct cscene *sc, const struct cnode *n)
 {
-	switch(o->ob.type) {
+	struct hinterv *res;
+
+	switch(n->type) {
 	case OB_SPHERE:
-		return ray_sphere(ray, o);
+		STAT_INC(prim_tests);
+		return ray_sphere(ray, sc, n);
 	case OB_CYLINDER:
-		return ray_cylinder(ray, o);
+		STAT_INC(prim_tests);
+		return ray_cylinder(ray, sc, n);
 	case OB_PLANE:
-		return ray_plane(ray, o);
+		STAT_INC(prim_tests);
+		return ray_plane(ray, sc, n);
 	case OB_BOX:
-		return ray_box(ray, o);
+		STAT_INC(prim_tests);
+		return ray_box(ray, sc, n);
+	case OB_NULL:
+		return 0;
+	default:
+		break;
+	}
+
+	if(!ray_bounds(ray, n->bmin, n->bmax, 0.0f, FLT_MAX)) {
+		return 0;
+	}
+
+	STAT_INC(csg_nodes);
+	if(++csg_tdepth > csg_tstats.max_csg_depth) {
+		csg_tstats.max_csg_depth = csg_tdepth;
+	}
+
+	switch(n->type) {
 	case OB_UNION:
-		return ray_csg_un(ray, o);
+		res = ray_csg_un(ray, sc, n);
+		break;
 	case OB_INTERSECTION:
-		return ray_csg_isect(ray, o);
+		res = ray_csg_isect(ray, sc, n);
+		break;
 	case OB_SUBTRACTION:
-		return ray_csg_sub(ray, o);
-	default:
+		res = ray_csg_sub(ray, sc, n);
 		break;
+	case OB_INSTANCE:
+		res = ray_instance(ray, sc, n);
+		break;
+	default:
+		res = 0;
 	}
-	return 0;
+
+	--csg_tdepth;
+	return res;
 }
 
-struct hinterv *ray_sphere(csg_ray *ray, csg_object *o)
+/* Can the ray hit anything in the box between tmin and tmax? Only hits in
+ * front of the ray origin matter. Intervals entirely behind it can't change the
+ * nearest hit.
+ */
+static int ray_bounds(csg_ray *ray, const float *bmin, const float *bmax, float tmin, float tmax)
 {
 	int i;
-	float a, b, c, d, sqrt_d, t[2], sq_rad, tmp;
-	struct hinterv *hit;
-	csg_ray locray = *ray;
+	float t0, t1, tmp, inv_dir;
+
+	for(i=0; i<3; i++) {
+		float orig = (&ray->x)[i];
+
+		if(bmin[i] == -FLT_MAX || bmax[i] == FLT_MAX) {
+			continue;
+		}
+		inv_dir = 1.0f / (&ray->dx)[i];
+		t0 = (bmin[i] - orig) * inv_dir;
+		t1 = (bmax[i] - orig) * inv_dir;
+		if(t0 > t1) {
+			tmp = t0;
+			t0 = t1;
+			t1 = tmp;
+		}
+		/* written so that NaNs (zero direction, origin on the slab) pass */
+		if(t0 > tmin) tmin = t0;
+		if(t1 < tmax) tmax = t1;
+		if(tmin > tmax) {
+			return 0;
+		}
+	}
+	return 1;
+}
 
-	if(o->sph.rad == 0.0f) {
+/* Can the ray reach the bounds of n anywhere there's something left of res in
+ * front of its origin, up to tmax? Subtracting an operand it can't reach
+ * changes nothing, and intersecting with it leaves nothing.
+ */
+static int reaches(csg_ray *ray, const struct cnode *n, const struct hinterv *res, float tmax)
+{
+	float tmin, tend;
+
+	result_range(res, &tmin, &tend);
+	return ray_bounds(ray, n->bmin, n->bmax, tmin, tend < tmax ? tend : tmax);
+}
+
+/* the part of the ray the intervals of res span, in front of the origin */
+static void result_range(const struct hinterv *res, float *tmin, float *tmax)
+{
+	*tmin = res->end[0].t > 0.0f ? res->end[0].t : 0.0f;
+	while(res->next) res = res->next;
+	*tmax = res->end[1].t;
+}
+
+struct hinterv *ray_sphere(csg_ray *ray, const struct cscene *sc, const struct cnode *n)
+{
+	float a, b, c, d, sqrt_d, t[2], sq_rad, tmp, rad = n->u.param[0];
+	csg_ray locray;
+
+	if(rad == 0.0f) {
 		return 0;
 	}
-	sq_rad = o->sph.rad * o->sph.rad;
+	sq_rad = rad * rad;
 
-	xform_ray(&locray, o->ob.inv_xform);
+	local_ray(&locray, ray, n);
 
 	a = locray.dx * locray.dx + locray.dy * locray.dy + locray.dz * locray.dz;
 	b = 2.0f * (locray.dx * locray.x + locray.dy * locray.y + locray.dz * locray.z);
@@ -126,26 +294,29 @@ struct hinterv *ray_sphere(csg_ray *ray, csg_object *o)
 		t[0] = t[1];
 		t[1] = tmp;
 	}
+	return sphere_hits(ray, sc, n, &locray, t);
+}
+
+/* makes the interval of a sphere between t[0] and t[1] */
+static struct hinterv *sphere_hits(csg_ray *ray, const struct cscene *sc, const struct cnode *n,
+		csg_ray *locray, float *t)
+{
+	int i;
+	float rad = n->u.param[0];
+	struct hinterv *hit;
+	csg_object *o = NODE_OBJ(sc, n);
 
 	hit = alloc_hits(1);
 	hit->o = o;
 	for(i=0; i<2; i++) {
-		float c[3] = {0, 0, 0};
-		float x, y, z;
-
-		mat4_xform3(c, o->ob.xform, c);
-
-		x = ray->x + ray->dx * t[i];
-		y = ray->y + ray->dy * t[i];
-		z = ray->z + ray->dz * t[i];
-
 		hit->end[i].t = t[i];
-		hit->end[i].x = x;
-		hit->end[i].y = y;
-		hit->end[i].z = z;
-		hit->end[i].nx = (x - c[0]) / o->sph.rad;
-		hit->end[i].ny = (y - c[1]) / o->sph.rad;
-		hit->end[i].nz = (z - c[2]) / o->sph.rad;
+		hit->end[i].x = ray->x + ray->dx * t[i];
+		hit->end[i].y = ray->y + ray->dy * t[i];
+		hit->end[i].z = ray->z + ray->dz * t[i];
+		hit->end[i].nx = (locray->x + locray->dx * t[i]) / rad;
+		hit->end[i].ny = (locray->y + locray->dy * t[i]) / rad;
+		hit->end[i].nz = (locray->z + locray->dz * t[i]) / rad;
+		world_normal(&hit->end[i].nx, n);
 		hit->end[i].o = o;
 	}
 	return hit;
@@ -177,21 +348,20 @@ static int ray_cylcap(csg_ray *ray, float y, float rad, float *tres)
 	return 0;
 }
 
-struct hinterv *ray_cylinder(csg_ray *ray, csg_object *o)
+struct hinterv *ray_cylinder(csg_ray *ray, const struct cscene *sc, const struct cnode *n)
 {
-	int i, out[2] = {0}, t_is_cap[2] = {0};
+	int out[2] = {0}, t_is_cap[2] = {0};
 	float a, b, c, d, sqrt_d, t[2], sq_rad, tmp, y[2], hh, cap_t;
-	struct hinterv *hit;
-	csg_ray locray = *ray;
-	float dirmat[16];
+	float rad = n->u.param[0], height = n->u.param[1];
+	csg_ray locray;
 
-	if(o->cyl.rad == 0.0f || o->cyl.height == 0.0f) {
+	if(rad == 0.0f || height == 0.0f) {
 		return 0;
 	}
-	sq_rad = o->cyl.rad * o->cyl.rad;
-	hh = o->cyl.height / 2.0f;
+	sq_rad = rad * rad;
+	hh = height / 2.0f;
 
-	xform_ray(&locray, o->ob.inv_xform);
+	local_ray(&locray, ray, n);
 
 	a = locray.dx * locray.dx + locray.dz * locray.dz;
 	b = 2.0f * (locray.dx * locray.x + locray.dz * locray.z);
@@ -230,7 +400,7 @@ struct hinterv *ray_cylinder(csg_ray *ray, csg_object *o)
 		t[1] = t[0];
 	}
 
-	if(ray_cylcap(&locray, hh, o->cyl.rad, &cap_t)) {
+	if(ray_cylcap(&locray, hh, rad, &cap_t)) {
 		if(cap_t < t[0]) {
 			t[0] = cap_t;
 			t_is_cap[0] = 1;
@@ -242,7 +412,7 @@ struct hinterv *ray_cylinder(csg_ray *ray, csg_object *o)
 			out[1] = 0;
 		}
 	}
-	if(ray_cylcap(&locray, -hh, o->cyl.rad, &cap_t)) {
+	if(ray_cylcap(&locray, -hh, rad, &cap_t)) {
 		if(cap_t < t[0]) {
 			t[0] = cap_t;
 			t_is_cap[0] = -1;
@@ -258,61 +428,69 @@ struct hinterv *ray_cylinder(csg_ray *ray, csg_object *o)
 	if(out[0] && out[1]) {
 		return 0;
 	}
+	return cylinder_hits(ray, sc, n, &locray, t, t_is_cap);
+}
 
-	mat4_copy(dirmat, o->ob.xform);
-	mat4_upper3x3(dirmat);
+/* makes the interval of a cylinder between t[0] and t[1], with cap[i] 1 or -1
+ * if end i is on the top or bottom cap, 0 if it's on the side
+ */
+static struct hinterv *cylinder_hits(csg_ray *ray, const struct cscene *sc, const struct cnode *n,
+		csg_ray *locray, float *t, int *cap)
+{
+	int i;
+	float rad = n->u.param[0];
+	struct hinterv *hit;
+	csg_object *o = NODE_OBJ(sc, n);
 
 	hit = alloc_hits(1);
 	hit->o = o;
 	for(i=0; i<2; i++) {
-		float x, y, z;
-		float lnorm[3];
+		csg_hit *h = hit->end + i;
 
-		x = ray->x + ray->dx * t[i];
-		y = ray->y + ray->dy * t[i];
-		z = ray->z + ray->dz * t[i];
-
-		if(t_is_cap[i]) {
-			lnorm[0] = lnorm[2] = 0.0f;
-			lnorm[1] = t_is_cap[i] > 0 ? 1.0f : -1.0f;
+		if(cap[i]) {
+			h->nx = h->nz = 0.0f;
+			h->ny = cap[i] > 0 ? 1.0f : -1.0f;
 		} else {
-			lnorm[0] = (locray.x + locray.dx * t[i]) / o->cyl.rad;
-			lnorm[1] = 0;
-			lnorm[2] = (locray.z + locray.dz * t[i]) / o->cyl.rad;
+			h->nx = (locray->x + locray->dx * t[i]) / rad;
+			h->ny = 0;
+			h->nz = (locray->z + locray->dz * t[i]) / rad;
 		}
-		mat4_xform3(&hit->end[i].nx, dirmat, lnorm);
+		world_normal(&h->nx, n);
 
-		hit->end[i].t = t[i];
-		hit->end[i].x = x;
-		hit->end[i].y = y;
-		hit->end[i].z = z;
-		hit->end[i].o = o;
+		h->t = t[i];
+		h->x = ray->x + ray->dx * t[i];
+		h->y = ray->y + ray->dy * t[i];
+		h->z = ray->z + ray->dz * t[i];
+		h->o = o;
 	}
 	return hit;
 }
 
-struct hinterv *ray_plane(csg_ray *ray, csg_object *o)
+struct hinterv *ray_plane(csg_ray *ray, const struct cscene *sc, const struct cnode *n)
 {
 	float vx, vy, vz, ndotv, ndotr, t;
+	const float *pn = n->u.param;	/* normal and distance */
 	struct hinterv *hit;
-	csg_ray locray = *ray;
+	csg_object *o;
+	csg_ray locray;
 
-	xform_ray(&locray, o->ob.inv_xform);
+	local_ray(&locray, ray, n);
 
-	ndotr = o->plane.nx * locray.dx + o->plane.ny * locray.dy + o->plane.nz * locray.dz;
+	ndotr = pn[0] * locray.dx + pn[1] * locray.dy + pn[2] * locray.dz;
 	if(fabs(ndotr) < EPSILON) return 0;
 
-	vx = o->plane.nx * o->plane.d - locray.x;
-	vy = o->plane.ny * o->plane.d - locray.y;
-	vz = o->plane.nz * o->plane.d - locray.z;
+	vx = pn[0] * pn[3] - locray.x;
+	vy = pn[1] * pn[3] - locray.y;
+	vz = pn[2] * pn[3] - locray.z;
 
-	ndotv = o->plane.nx * vx + o->plane.ny * vy + o->plane.nz * vz;
+	ndotv = pn[0] * vx + pn[1] * vy + pn[2] * vz;
 
 	t = ndotv / ndotr;
 	if(t < EPSILON) {
 		return 0;
 	}
 
+	o = NODE_OBJ(sc, n);
 	hit = alloc_hits(1);
 	hit->o = hit->end[0].o = hit->end[1].o = o;
 	hit->end[0].t = t;
@@ -320,9 +498,13 @@ struct hinterv *ray_plane(csg_ray *ray, csg_object *o)
 	hit->end[0].y = ray->y + ray->dy * t;
 	hit->end[0].z = ray->z + ray->dz * t;
 
-	hit->end[0].nx = hit->end[1].nx = o->plane.nx;
-	hit->end[0].ny = hit->end[1].ny = o->plane.ny;
-	hit->end[0].nz = hit->end[1].nz = o->plane.nz;
+	hit->end[0].nx = pn[0];
+	hit->end[0].ny = pn[1];
+	hit->end[0].nz = pn[2];
+	world_normal(&hit->end[0].nx, n);
+	hit->end[1].nx = hit->end[0].nx;
+	hit->end[1].ny = hit->end[0].ny;
+	hit->end[1].nz = hit->end[0].nz;
 
 	hit->end[1].t = 10000.0f;
 	hit->end[1].x = ray->x + ray->dx * 10000.0f;
@@ -333,20 +515,19 @@ struct hinterv *ray_plane(csg_ray *ray, csg_object *o)
 
 #define BEXT(x)	((x) * 0.49999)
 
-struct hinterv *ray_box(csg_ray *ray, csg_object *o)
+struct hinterv *ray_box(csg_ray *ray, const struct cscene *sc, const struct cnode *n)
 {
 	int i, sign[3];
 	float param[2][3];
 	float inv_dir[3];
 	float tmin, tmax, tymin, tymax, tzmin, tzmax;
-	struct hinterv *hit;
-	csg_ray locray = *ray;
-	float dirmat[16];
+	const float *size = n->u.param;
+	csg_ray locray;
 
-	xform_ray(&locray, o->ob.inv_xform);
+	local_ray(&locray, ray, n);
 
 	for(i=0; i<3; i++) {
-		float sz = *(&o->box.xsz + i);
+		float sz = size[i];
 		param[0][i] = -0.5 * sz;
 		param[1][i] = 0.5 * sz;
 
@@ -381,26 +562,34 @@ struct hinterv *ray_box(csg_ray *ray, csg_object *o)
 	if(tzmax < tmax) {
 		tmax = tzmax;
 	}
+	return box_hits(ray, sc, n, &locray, tmin, tmax);
+}
 
-	mat4_copy(dirmat, o->ob.xform);
-	mat4_upper3x3(dirmat);
+/* makes the interval of a box between tmin and tmax */
+static struct hinterv *box_hits(csg_ray *ray, const struct cscene *sc, const struct cnode *n,
+		csg_ray *locray, float tmin, float tmax)
+{
+	int i;
+	const float *size = n->u.param;
+	struct hinterv *hit;
+	csg_object *o = NODE_OBJ(sc, n);
 
 	hit = alloc_hits(1);
 	hit->o = o;
 	for(i=0; i<2; i++) {
-		float n[3] = {0};
+		float norm[3] = {0};
 		float t = i == 0 ? tmin : tmax;
 
-		float x = (locray.x + locray.dx * t) / o->box.xsz;
-		float y = (locray.y + locray.dy * t) / o->box.ysz;
-		float z = (locray.z + locray.dz * t) / o->box.zsz;
+		float x = (locray->x + locray->dx * t) / size[0];
+		float y = (locray->y + locray->dy * t) / size[1];
+		float z = (locray->z + locray->dz * t) / size[2];
 
 		if(fabs(x) > fabs(y) && fabs(x) > fabs(z)) {
-			n[0] = x > 0.0f ? 1.0f : -1.0f;
+			norm[0] = x > 0.0f ? 1.0f : -1.0f;
 		} else if(fabs(y) > fabs(z)) {
-			n[1] = y > 0.0f ? 1.0f : -1.0f;
+			norm[1] = y > 0.0f ? 1.0f : -1.0f;
 		} else {
-			n[2] = z > 0.0f ? 1.0f : -1.0f;
+			norm[2] = z > 0.0f ? 1.0f : -1.0f;
 		}
 
 		hit->end[i].o = o;
@@ -408,269 +597,1952 @@ struct hinterv *ray_box(csg_ray *ray, csg_object *o)
 		hit->end[i].x = ray->x + ray->dx * t;
 		hit->end[i].y = ray->y + ray->dy * t;
 		hit->end[i].z = ray->z + ray->dz * t;
-		mat4_xform3(&hit->end[i].nx, dirmat, n);
+		world_normal(norm, n);
+		hit->end[i].nx = norm[0];
+		hit->end[i].ny = norm[1];
+		hit->end[i].nz = norm[2];
 	}
 	return hit;
 }
 
-struct hinterv *ray_csg_un(csg_ray *ray, csg_object *o)
+struct hinterv *ray_csg_un(csg_ray *ray, const struct cscene *sc, const struct cnode *n)
 {
-	struct hinterv *hita, *hitb, *res;
+	int i;
+	struct hinterv *res = 0;
 
-	hita = ray_intersect(ray, o->csg.a);
-	hitb = ray_intersect(ray, o->csg.b);
+	for(i=n->u.op.child; i<n->u.op.bvh_start; i++) {
+		res = combine(OB_UNION, res, ray_intersect(ray, sc, OPERAND(sc, i)));
+	}
+	if(n->u.op.bvh >= 0) {
+		res = ray_csg_bvh(ray, sc, n, res);
+	}
+	return res;
+}
 
-	if(!hita) return hitb;
-	if(!hitb) return hita;
+/* the operands are in the order of order_operands, which puts the ones most
+ * likely to end it early first
+ */
+struct hinterv *ray_csg_isect(csg_ray *ray, const struct cscene *sc, const struct cnode *n)
+{
+	int i, end = n->u.op.child + n->u.op.num_child;
+	struct hinterv *res;
 
-	res = interval_union(hita, hitb);
-	free_hit_list(hita);
-	free_hit_list(hitb);
+	if(!n->u.op.num_child || !(res = ray_intersect(ray, sc, OPERAND(sc, n->u.op.child)))) {
+		return 0;
+	}
+	for(i=n->u.op.child + 1; i<end; i++) {
+		if(!reaches(ray, OPERAND(sc, i), res, FLT_MAX)) {
+			free_hit_list(res);
+			return 0;
+		}
+		if(!(res = combine(OB_INTERSECTION, res, ray_intersect(ray, sc, OPERAND(sc, i))))) {
+			return 0;
+		}
+	}
 	return res;
 }
 
-struct hinterv *ray_csg_isect(csg_ray *ray, csg_object *o)
+struct hinterv *ray_csg_sub(csg_ray *ray, const struct cscene *sc, const struct cnode *n)
 {
-	struct hinterv *hita, *hitb, *res;
-
-	hita = ray_intersect(ray, o->csg.a);
-	hitb = ray_intersect(ray, o->csg.b);
+	int i;
+	struct hinterv *res;
 
-	if(!hita || !hitb) {
-		free_hit_list(hita);
-		free_hit_list(hitb);
+	if(!n->u.op.num_child || !(res = ray_intersect(ray, sc, OPERAND(sc, n->u.op.child)))) {
 		return 0;
 	}
-
-	res = interval_isect(hita, hitb);
-	free_hit_list(hita);
-	free_hit_list(hitb);
+	for(i=n->u.op.child + 1; i<n->u.op.bvh_start; i++) {
+		if(!reaches(ray, OPERAND(sc, i), res, FLT_MAX)) {
+			continue;
+		}
+		if(!(res = combine(OB_SUBTRACTION, res, ray_intersect(ray, sc, OPERAND(sc, i))))) {
+			return 0;
+		}
+	}
+	if(n->u.op.bvh >= 0) {
+		res = ray_csg_bvh(ray, sc, n, res);
+	}
 	return res;
 }
 
-struct hinterv *ray_csg_sub(csg_ray *ray, csg_object *o)
+/* applies the operation to the result so far and the hits of the next operand,
+ * freeing both
+ */
+static struct hinterv *combine(int op, struct hinterv *res, struct hinterv *hits)
 {
-	struct hinterv *hita, *hitb, *res;
+	struct hinterv *tmp;
 
-	if(!(hita = ray_intersect(ray, o->csg.a))) {
+	if(!res || !hits) {
+		if(op == OB_UNION) {
+			return res ? res : hits;
+		}
+		if(op == OB_SUBTRACTION) {
+			free_hit_list(hits);
+			return res;
+		}
+		free_hit_list(res);
+		free_hit_list(hits);
 		return 0;
 	}
 
-	hitb = ray_intersect(ray, o->csg.b);
-	if(!hitb) return hita;
+	switch(op) {
+	case OB_UNION:
+		tmp = interval_union(res, hits);
+		break;
+	case OB_INTERSECTION:
+		tmp = interval_isect(res, hits);
+		break;
+	default:
+		tmp = interval_sub(res, hits);
+	}
+	free_hit_list(res);
+	free_hit_list(hits);
+	return tmp;
+}
+
+/* Adds the operands in the hierarchy of o which the ray reaches to the result.
+ * Subtractions only visit the parts of the hierarchy overlapping what's left of
+ * the result, and stop when nothing is left.
+ */
+static struct hinterv *ray_csg_bvh(csg_ray *ray, const struct cscene *sc, const struct cnode *n,
+		struct hinterv *res)
+{
+	int i, idx = n->u.op.bvh, top = 0, stack[BVH_MAX_DEPTH];
+	float tmin = 0.0f, tmax = FLT_MAX;
+	const struct bvh_node *node;
+	struct hinterv *last;
+
+	for(;;) {
+		if(n->type == OB_SUBTRACTION) {
+			if(!res) {
+				return 0;
+			}
+			last = res;
+			while(last->next) last = last->next;
+			tmin = res->end[0].t > 0.0f ? res->end[0].t : 0.0f;
+			tmax = last->end[1].t;
+		}
+
+		node = sc->bvh + idx;
+		if(ray_bounds(ray, node->bmin, node->bmax, tmin, tmax)) {
+			if(!node->count) {
+				assert(top < BVH_MAX_DEPTH);
+				stack[top++] = node->second;
+				idx++;
+				continue;
+			}
+			if(node->second >= 0) {
+				res = ray_leaf_block(ray, sc, n, node, res);
+				goto next;
+			}
+			for(i=0; i<node->count; i++) {
+				if(!res && n->type == OB_SUBTRACTION) {
+					return 0;
+				}
+				res = combine(n->type, res, ray_intersect(ray, sc, OPERAND(sc, node->first + i)));
+			}
+		}
 
-	res = interval_sub(hita, hitb);
-	free_hit_list(hita);
-	free_hit_list(hitb);
+next:	if(!top) break;
+		idx = stack[--top];
+	}
 	return res;
 }
 
-
-void sample_object(csg_object *o, float *pos)
+/* Intersects the ray with all the primitives of a hierarchy leaf at once, and
+ * combines the hits of each with the result in operand order, the same as
+ * testing them one by one. Intervals are only made for the primitives hit, and
+ * like in ray_csg_bvh, only if they reach past the ray origin, and for
+ * subtractions only if they overlap what's left of the result.
+ */
+static struct hinterv *ray_leaf_block(csg_ray *ray, const struct cscene *sc, const struct cnode *n,
+		const struct bvh_node *leaf, struct hinterv *res)
 {
-	switch(o->ob.type) {
+	int i, cap[2][LEAF_BLOCK_SIZE];
+	unsigned int mask;
+	float t[2][LEAF_BLOCK_SIZE], tt[2], tmin = 0.0f, tmax = FLT_MAX;
+	int cc[2];
+	const struct leaf_block *blk = sc->blocks + leaf->second;
+	const struct cnode *sub;
+	struct hinterv *hits, *last;
+	csg_ray locray;
+
+	STAT_ADD(prim_tests, blk->count);
+
+	switch(blk->type) {
 	case OB_SPHERE:
-		sample_sphere(o, pos);
+		mask = block_spheres(blk, ray, t);
 		break;
 	case OB_CYLINDER:
-		sample_cylinder(o, pos);
-		break;
-	case OB_PLANE:
-		sample_plane(o, pos);
-		break;
-	case OB_BOX:
-		sample_box(o, pos);
-		break;
-	case OB_UNION:
-		sample_csg_un(o, pos);
-		break;
-	case OB_INTERSECTION:
-		sample_csg_isect(o, pos);
-		break;
-	case OB_SUBTRACTION:
-		sample_csg_sub(o, pos);
+		mask = block_cylinders(blk, ray, t, cap);
 		break;
-
 	default:
-		pos[0] = o->ob.xform[12];
-		pos[1] = o->ob.xform[13];
-		pos[2] = o->ob.xform[14];
+		mask = block_boxes(blk, ray, t);
+	}
+
+	for(i=0; i<blk->count; i++) {
+		if(n->type == OB_SUBTRACTION) {
+			if(!res) {
+				return 0;
+			}
+			last = res;
+			while(last->next) last = last->next;
+			tmin = res->end[0].t > 0.0f ? res->end[0].t : 0.0f;
+			tmax = last->end[1].t;
+		}
+		if(!(mask & (1 << i)) || t[1][i] < tmin || t[0][i] > tmax) {
+			continue;
+		}
+
+		sub = OPERAND(sc, leaf->first + i);
+		local_ray(&locray, ray, sub);
+		tt[0] = t[0][i];
+		tt[1] = t[1][i];
+
+		switch(blk->type) {
+		case OB_SPHERE:
+			hits = sphere_hits(ray, sc, sub, &locray, tt);
+			break;
+		case OB_CYLINDER:
+			cc[0] = cap[0][i];
+			cc[1] = cap[1][i];
+			hits = cylinder_hits(ray, sc, sub, &locray, tt, cc);
+			break;
+		default:
+			hits = box_hits(ray, sc, sub, &locray, tt[0], tt[1]);
+		}
+		res = combine(n->type, res, hits);
 	}
+	return res;
 }
 
-void sample_sphere(csg_object *o, float *pos)
+/* The block kernels are branchless versions of ray_sphere, ray_cylinder and
+ * ray_box over the slots of a leaf block, for the compiler to vectorize. They
+ * make the same comparisons in the same order, so they find exactly the same
+ * t values, and they return the mask of the slots hit.
+ */
+
+/* moves the ray to the local space of every slot: origin, then direction */
+static void block_local_rays(const struct leaf_block *blk, const csg_ray *ray,
+		float (*lr)[LEAF_BLOCK_SIZE])
 {
-	sphrand(o->sph.rad, pos);
-	mat4_xform3(pos, o->ob.xform, pos);
+	int i;
+	float x = ray->x, y = ray->y, z = ray->z;
+	float dx = ray->dx, dy = ray->dy, dz = ray->dz;
+	const float (*m)[LEAF_BLOCK_SIZE] = blk->inv;
+
+	for(i=0; i<LEAF_BLOCK_SIZE; i++) {
+		lr[0][i] = m[0][i] * x + m[1][i] * y + m[2][i] * z + m[3][i];
+		lr[1][i] = m[4][i] * x + m[5][i] * y + m[6][i] * z + m[7][i];
+		lr[2][i] = m[8][i] * x + m[9][i] * y + m[10][i] * z + m[11][i];
+		lr[3][i] = m[0][i] * dx + m[1][i] * dy + m[2][i] * dz;
+		lr[4][i] = m[4][i] * dx + m[5][i] * dy + m[6][i] * dz;
+		lr[5][i] = m[8][i] * dx + m[9][i] * dy + m[10][i] * dz;
+	}
 }
 
-void sample_cylinder(csg_object *o, float *pos)
+static unsigned int block_spheres(const struct leaf_block *blk, const csg_ray *ray,
+		float (*t)[LEAF_BLOCK_SIZE])
 {
-	cylrand(o->cyl.rad, o->cyl.height, pos);
-	mat4_xform3(pos, o->ob.xform, pos);
+	int i, hit[LEAF_BLOCK_SIZE];
+	unsigned int mask = 0;
+	float lr[6][LEAF_BLOCK_SIZE];
+	float rad, a, b, c, d, sqrt_d, t0, t1;
+
+	block_local_rays(blk, ray, lr);
+
+	for(i=0; i<LEAF_BLOCK_SIZE; i++) {
+		rad = blk->param[0][i];
+
+		a = lr[3][i] * lr[3][i] + lr[4][i] * lr[4][i] + lr[5][i] * lr[5][i];
+		b = 2.0f * (lr[3][i] * lr[0][i] + lr[4][i] * lr[1][i] + lr[5][i] * lr[2][i]);
+		c = (lr[0][i] * lr[0][i] + lr[1][i] * lr[1][i] + lr[2][i] * lr[2][i]) - rad * rad;
+
+		d = b * b - 4.0f * a * c;
+		sqrt_d = sqrtf(d);
+		t0 = (-b + sqrt_d) / (2.0f * a);
+		t1 = (-b - sqrt_d) / (2.0f * a);
+
+		hit[i] = (rad != 0.0f) & !(d < EPSILON) & !((t0 < EPSILON) & (t1 < EPSILON));
+		t[0][i] = t1 < t0 ? t1 : t0;
+		t[1][i] = t1 < t0 ? t0 : t1;
+	}
+
+	for(i=0; i<blk->count; i++) {
+		if(hit[i]) mask |= 1 << i;
+	}
+	return mask;
 }
 
-/* pffffft */
-void sample_plane(csg_object *o, float *pos)
+static unsigned int block_cylinders(const struct leaf_block *blk, const csg_ray *ray,
+		float (*t)[LEAF_BLOCK_SIZE], int (*cap)[LEAF_BLOCK_SIZE])
 {
-	pos[0] = o->ob.xform[12];
-	pos[1] = o->ob.xform[13];
-	pos[2] = o->ob.xform[14];
+	int i, hit[LEAF_BLOCK_SIZE], out0, out1, cap0, cap1, cap_hit, first, last;
+	unsigned int mask = 0;
+	float lr[6][LEAF_BLOCK_SIZE];
+	float rad, hh, a, b, c, d, sqrt_d, ta, tb, t0, t1, y0, y1;
+	float ny, ndotr, ndotv, cap_t, x, z;
+
+	block_local_rays(blk, ray, lr);
+
+	for(i=0; i<LEAF_BLOCK_SIZE; i++) {
+		rad = blk->param[0][i];
+		hh = blk->param[1][i] / 2.0f;
+
+		a = lr[3][i] * lr[3][i] + lr[5][i] * lr[5][i];
+		b = 2.0f * (lr[3][i] * lr[0][i] + lr[5][i] * lr[2][i]);
+		c = lr[0][i] * lr[0][i] + lr[2][i] * lr[2][i] - rad * rad;
+
+		d = b * b - 4.0f * a * c;
+		sqrt_d = sqrtf(d);
+		ta = (-b + sqrt_d) / (2.0f * a);
+		tb = (-b - sqrt_d) / (2.0f * a);
+
+		hit[i] = (rad != 0.0f) & (blk->param[1][i] != 0.0f) & !(d < EPSILON) &
+			!((ta < EPSILON) & (tb < EPSILON));
+		t0 = tb < ta ? tb : ta;
+		t1 = tb < ta ? ta : tb;
+
+		y0 = lr[1][i] + lr[4][i] * t0;
+		y1 = lr[1][i] + lr[4][i] * t1;
+		out0 = (y0 < -hh) | (y0 > hh);
+		out1 = (y1 < -hh) | (y1 > hh);
+		t0 = out0 ? t1 : t0;
+		t1 = out1 ? t0 : t1;
+
+		/* top cap, see ray_cylcap */
+		ny = hh > 0.0f ? 1.0f : -1.0f;
+		ndotr = ny * lr[4][i];
+		ndotv = ny * (hh - lr[1][i]);
+		cap_t = ndotv / ndotr;
+		x = lr[0][i] + lr[3][i] * cap_t;
+		z = lr[2][i] + lr[5][i] * cap_t;
+		cap_hit = !(fabsf(ndotr) < EPSILON) & (x * x + z * z <= rad * rad);
+
+		first = cap_hit & (cap_t < t0);
+		last = cap_hit & (cap_t > t1);
+		t0 = first ? cap_t : t0;
+		t1 = last ? cap_t : t1;
+		cap0 = first ? 1 : 0;
+		cap1 = last ? 1 : 0;
+		out0 &= !first;
+		out1 &= !last;
+
+		/* bottom cap */
+		ny = -hh > 0.0f ? 1.0f : -1.0f;
+		ndotr = ny * lr[4][i];
+		ndotv = ny * (-hh - lr[1][i]);
+		cap_t = ndotv / ndotr;
+		x = lr[0][i] + lr[3][i] * cap_t;
+		z = lr[2][i] + lr[5][i] * cap_t;
+		cap_hit = !(fabsf(ndotr) < EPSILON) & (x * x + z * z <= rad * rad);
+
+		first = cap_hit & (cap_t < t0);
+		last = cap_hit & (cap_t > t1);
+		t0 = first ? cap_t : t0;
+		t1 = last ? cap_t : t1;
+		cap0 = first ? -1 : cap0;
+		cap1 = last ? -1 : cap1;
+		out0 &= !first;
+		out1 &= !last;
+
+		hit[i] &= !(out0 & out1);
+		t[0][i] = t0;
+		t[1][i] = t1;
+		cap[0][i] = cap0;
+		cap[1][i] = cap1;
+	}
+
+	for(i=0; i<blk->count; i++) {
+		if(hit[i]) mask |= 1 << i;
+	}
+	return mask;
 }
 
-void sample_box(csg_object *o, float *pos)
+static unsigned int block_boxes(const struct leaf_block *blk, const csg_ray *ray,
+		float (*t)[LEAF_BLOCK_SIZE])
 {
-	pos[0] = (frand() - 0.5) * o->box.xsz;
-	pos[1] = (frand() - 0.5) * o->box.ysz;
-	pos[2] = (frand() - 0.5) * o->box.zsz;
+	int i, hit[LEAF_BLOCK_SIZE];
+	unsigned int mask = 0;
+	float lr[6][LEAF_BLOCK_SIZE];
+	float lo, hi, inv_dir, ta, tb, tmin[3], tmax[3], t0, t1;
+
+	block_local_rays(blk, ray, lr);
+
+	for(i=0; i<LEAF_BLOCK_SIZE; i++) {
+		/* see ray_box */
+		lo = -0.5f * blk->param[0][i];
+		hi = 0.5f * blk->param[0][i];
+		inv_dir = 1.0f / lr[3][i];
+		ta = (lo - lr[0][i]) * inv_dir;
+		tb = (hi - lr[0][i]) * inv_dir;
+		tmin[0] = inv_dir < 0 ? tb : ta;
+		tmax[0] = inv_dir < 0 ? ta : tb;
+
+		lo = -0.5f * blk->param[1][i];
+		hi = 0.5f * blk->param[1][i];
+		inv_dir = 1.0f / lr[4][i];
+		ta = (lo - lr[1][i]) * inv_dir;
+		tb = (hi - lr[1][i]) * inv_dir;
+		tmin[1] = inv_dir < 0 ? tb : ta;
+		tmax[1] = inv_dir < 0 ? ta : tb;
+
+		lo = -0.5f * blk->param[2][i];
+		hi = 0.5f * blk->param[2][i];
+		inv_dir = 1.0f / lr[5][i];
+		ta = (lo - lr[2][i]) * inv_dir;
+		tb = (hi - lr[2][i]) * inv_dir;
+		tmin[2] = inv_dir < 0 ? tb : ta;
+		tmax[2] = inv_dir < 0 ? ta : tb;
+
+		hit[i] = !((tmin[0] > tmax[1]) | (tmin[1] > tmax[0]));
+		t0 = tmin[1] > tmin[0] ? tmin[1] : tmin[0];
+		t1 = tmax[1] < tmax[0] ? tmax[1] : tmax[0];
+
+		hit[i] &= !((t0 > tmax[2]) | (tmin[2] > t1));
+		t[0][i] = tmin[2] > t0 ? tmin[2] : t0;
+		t[1][i] = tmax[2] < t1 ? tmax[2] : t1;
+	}
 
-	mat4_xform3(pos, o->ob.xform, pos);
+	for(i=0; i<blk->count; i++) {
+		if(hit[i]) mask |= 1 << i;
+	}
+	return mask;
 }
 
-void sample_csg_un(csg_object *o, float *pos)
+/* Intersect the shared definition with the ray in instance space. The ray
+ * parameter t is the same in both spaces, so the hit positions are found on
+ * the original ray, and normals are transformed by the inverse transpose.
+ */
+struct hinterv *ray_instance(csg_ray *ray, const struct cscene *sc, const struct cnode *n)
 {
-	/* TODO biased, maybe come up with a better plan */
-	if(rand() < RAND_MAX / 2) {
-		sample_object(o->csg.a, pos);
-	} else {
-		sample_object(o->csg.b, pos);
+	struct hinterv *hit;
+	csg_ray locray;
+
+	local_ray(&locray, ray, n);
+
+	if(!(hit = ray_intersect(&locray, sc, sc->nodes + n->u.op.child))) {
+		return 0;
 	}
+	instance_hits(ray, sc, n, hit);
+	return hit;
 }
 
-void sample_csg_isect(csg_object *o, float *pos)
+/* Moves the hits of a definition to the space of the instance n, and adds n
+ * to the instance path of the hits. Nested instances are added innermost
+ * first.
+ */
+static void instance_hits(csg_ray *ray, const struct cscene *sc, const struct cnode *n,
+		struct hinterv *hit)
 {
-	/* TODO */
-	pos[0] = o->ob.xform[12];
-	pos[1] = o->ob.xform[13];
-	pos[2] = o->ob.xform[14];
+	int i;
+	unsigned int idx = n - sc->nodes + 1;
+
+	while(hit) {
+		for(i=0; i<2; i++) {
+			csg_hit *h = hit->end + i;
+
+			h->x = ray->x + ray->dx * h->t;
+			h->y = ray->y + ray->dy * h->t;
+			h->z = ray->z + ray->dz * h->t;
+			world_normal(&h->nx, n);
+			h->inst_path = (h->inst_path ^ idx) * 16777619u;
+		}
+		hit = hit->next;
+	}
 }
 
-void sample_csg_sub(csg_object *o, float *pos)
+const csg_hit *first_hit(const struct hinterv *hv)
 {
-	/* TODO nope */
-	sample_object(o->csg.a, pos);
+	while(hv) {
+		if(hv->end[0].t > 1e-6) {
+			return hv->end;
+		}
+		if(hv->end[1].t > 1e-6) {
+			return hv->end + 1;
+		}
+		hv = hv->next;
+	}
+	return 0;
 }
 
-
-void xform_ray(csg_ray *ray, float *mat)
+/* The lazy evaluation finds the hits of a node only up to a limit, *tmax: past
+ * it, the list can have parts which the full evaluation would have cut away,
+ * or be missing parts, but before it, it's exactly the same, down to which
+ * object every boundary came from. Operands which can't reach the part of the
+ * ray before the limit are skipped.
+ *
+ * Only the first hit matters when looking for the nearest one, and in that
+ * case (nearest is set) operations lower the limit as far as they can: unions
+ * to their first hit, which anything further along can't move closer, and
+ * subtractions to the first hit of the part they cut from, trying again
+ * further along if the cutters remove it. Intersections and the operands of
+ * subtractions need all their hits up to the limit, and are evaluated with a
+ * fixed one.
+ */
+struct hinterv *ray_nearest(csg_ray *ray, const struct cscene *sc, const struct cnode *n, float tmax)
 {
-	float m3x3[16];
+	float known = tmax;
+	struct hinterv *res;
+	const csg_hit *hit;
 
-	mat4_copy(m3x3, mat);
-	mat4_upper3x3(m3x3);
+	res = lazy_intersect(ray, sc, n, &known, 1);
 
-	mat4_xform3(&ray->x, mat, &ray->x);
-	mat4_xform3(&ray->dx, m3x3, &ray->dx);
+	if(known < tmax && (!(hit = first_hit(res)) || hit->t > known)) {
+		/* the first hit is past what the shortcuts found out */
+		free_hit_list(res);
+		known = tmax;
+		res = lazy_intersect(ray, sc, n, &known, 0);
+	}
+	return res;
 }
 
-static void flip_hit(csg_hit *hit)
+static struct hinterv *lazy_intersect(csg_ray *ray, const struct cscene *sc, const struct cnode *n,
+		float *tmax, int nearest)
 {
-	hit->nx = -hit->nx;
-	hit->ny = -hit->ny;
-	hit->nz = -hit->nz;
+	struct hinterv *res;
+
+	switch(n->type) {
+	case OB_NULL:
+	case OB_SPHERE:
+	case OB_CYLINDER:
+	case OB_PLANE:
+	case OB_BOX:
+		return ray_intersect(ray, sc, n);
+	default:
+		break;
+	}
+
+	if(!ray_bounds(ray, n->bmin, n->bmax, 0.0f, *tmax)) {
+		return 0;
+	}
+
+	STAT_INC(csg_nodes);
+	if(++csg_tdepth > csg_tstats.max_csg_depth) {
+		csg_tstats.max_csg_depth = csg_tdepth;
+	}
+
+	switch(n->type) {
+	case OB_UNION:
+		res = lazy_un(ray, sc, n, tmax, nearest);
+		break;
+	case OB_INTERSECTION:
+		res = lazy_isect(ray, sc, n, tmax);
+		break;
+	case OB_SUBTRACTION:
+		res = lazy_sub(ray, sc, n, tmax, nearest);
+		break;
+	case OB_INSTANCE:
+		res = lazy_instance(ray, sc, n, tmax, nearest);
+		break;
+	default:
+		res = 0;
+	}
+
+	--csg_tdepth;
+	return res;
 }
 
-static struct hinterv *interval_union(struct hinterv *a, struct hinterv *b)
+static struct hinterv *lazy_un(csg_ray *ray, const struct cscene *sc, const struct cnode *n,
+		float *tmax, int nearest)
 {
-	struct hinterv *res, *res2;
-
-	if(a->end[0].t > b->end[1].t || a->end[1].t < b->end[0].t) {
-		/* disjoint */
-		res = alloc_hits(2);
-		res2 = res->next;
+	int i;
+	struct hinterv *res = 0;
 
-		if(a->end[0].t < b->end[0].t) {
-			*res = *a;
-			*res2 = *b;
-		} else {
-			*res = *b;
-			*res2 = *a;
+	for(i=n->u.op.child; i<n->u.op.bvh_start; i++) {
+		res = combine(OB_UNION, res, lazy_intersect(ray, sc, OPERAND(sc, i), tmax, nearest));
+		if(nearest) {
+			lower_to_hit(res, tmax);
 		}
-		res->next = res2;
-		res2->next = 0;
-		return res;
 	}
-
-	res = alloc_hits(1);
-	res->end[0] = a->end[0].t <= b->end[0].t ? a->end[0] : b->end[0];
-	res->end[1] = a->end[1].t >= b->end[1].t ? a->end[1] : b->end[1];
+	if(n->u.op.bvh >= 0) {
+		res = lazy_bvh(ray, sc, n, res, tmax, nearest);
+	}
 	return res;
 }
 
-static struct hinterv *interval_isect(struct hinterv *a, struct hinterv *b)
+static struct hinterv *lazy_isect(csg_ray *ray, const struct cscene *sc, const struct cnode *n,
+		float *tmax)
 {
+	int i, end = n->u.op.child + n->u.op.num_child;
 	struct hinterv *res;
 
-	if(a->end[0].t > b->end[1].t || a->end[1].t < b->end[0].t) {
-		/* disjoint */
+	if(!n->u.op.num_child || !(res = lazy_intersect(ray, sc, OPERAND(sc, n->u.op.child), tmax, 0))) {
 		return 0;
 	}
+	for(i=n->u.op.child + 1; i<end; i++) {
+		if(!reaches(ray, OPERAND(sc, i), res, *tmax)) {
+			free_hit_list(res);
+			return 0;
+		}
+		if(!(res = combine(OB_INTERSECTION, res, lazy_intersect(ray, sc, OPERAND(sc, i), tmax, 0)))) {
+			return 0;
+		}
+	}
+	return res;
+}
 
-	res = alloc_hits(1);
+/* Cutters past the window can only remove what's past it, so the hits before
+ * it are final. If the first hit survives the cutters up to it, nothing past
+ * it matters, otherwise they're all applied over the whole range. Primitives
+ * are intersected whole regardless of the window, so it's only worth trying
+ * if there are cutters with bounds to cull.
+ */
+static struct hinterv *lazy_sub(csg_ray *ray, const struct cscene *sc, const struct cnode *n,
+		float *tmax, int nearest)
+{
+	int i;
+	float win = *tmax;
+	struct hinterv *first, *res;
+	const csg_hit *hit;
 
-	if(a->end[0].t <= b->end[0].t && a->end[1].t >= b->end[1].t) {
-		/* B in A */
-		*res = *b;
-		res->next = 0;
-		return res;
+	if(!n->u.op.num_child || !(first = lazy_intersect(ray, sc, OPERAND(sc, n->u.op.child), tmax, 0))) {
+		return 0;
 	}
-	if(a->end[0].t > b->end[0].t && a->end[1].t < b->end[1].t) {
-		/* A in B */
-		*res = *a;
-		res->next = 0;
-		return res;
+	if(nearest && cull_cutters(sc, n)) {
+		lower_to_hit(first, &win);
 	}
 
-	/* partial overlap */
-	if(a->end[0].t < b->end[0].t) {
-		res->end[0] = b->end[0];
-		res->end[1] = a->end[1];
-	} else {
-		res->end[0] = a->end[0];
-		res->end[1] = b->end[1];
+	for(;;) {
+		/* the last pass can use up the first operand */
+		res = win < *tmax ? copy_hits(first) : first;
+
+		for(i=n->u.op.child + 1; i<n->u.op.bvh_start && res; i++) {
+			if(reaches(ray, OPERAND(sc, i), res, win)) {
+				res = combine(OB_SUBTRACTION, res, lazy_intersect(ray, sc, OPERAND(sc, i), &win, 0));
+			}
+		}
+		if(res && n->u.op.bvh >= 0) {
+			res = lazy_bvh(ray, sc, n, res, &win, 0);
+		}
+
+		if(win >= *tmax) {
+			break;
+		}
+		if((hit = first_hit(res)) && hit->t <= win) {
+			*tmax = win;
+			free_hit_list(first);
+			break;
+		}
+		win = *tmax;
+		free_hit_list(res);
 	}
 	return res;
 }
 
-static struct hinterv *interval_sub(struct hinterv *a, struct hinterv *b)
+/* ray_csg_bvh, up to the limit */
+static struct hinterv *lazy_bvh(csg_ray *ray, const struct cscene *sc, const struct cnode *n,
+		struct hinterv *res, float *tmax, int nearest)
 {
-	struct hinterv *res;
+	int i, idx = n->u.op.bvh, top = 0, stack[BVH_MAX_DEPTH];
+	float tmin = 0.0f, tlim = *tmax;
+	const struct bvh_node *node;
+	struct hinterv *last;
+
+	for(;;) {
+		if(n->type == OB_SUBTRACTION) {
+			if(!res) {
+				return 0;
+			}
+			last = res;
+			while(last->next) last = last->next;
+			tmin = res->end[0].t > 0.0f ? res->end[0].t : 0.0f;
+			tlim = last->end[1].t < *tmax ? last->end[1].t : *tmax;
+		} else {
+			tlim = *tmax;
+		}
 
-	if(a->end[0].t >= b->end[0].t && a->end[1].t <= b->end[1].t) {
-		/* A in B */
-		return 0;
-	}
+		node = sc->bvh + idx;
+		if(ray_bounds(ray, node->bmin, node->bmax, tmin, tlim)) {
+			if(!node->count) {
+				assert(top < BVH_MAX_DEPTH);
+				stack[top++] = node->second;
+				idx++;
+				continue;
+			}
+			if(node->second >= 0) {
+				res = ray_leaf_block(ray, sc, n, node, res);
+			} else {
+				for(i=0; i<node->count; i++) {
+					if(!res && n->type == OB_SUBTRACTION) {
+						return 0;
+					}
+					res = combine(n->type, res, lazy_intersect(ray, sc, OPERAND(sc, node->first + i),
+								tmax, nearest && n->type == OB_UNION));
+				}
+			}
+			if(nearest && n->type == OB_UNION) {
+				lower_to_hit(res, tmax);
+			}
+		}
 
-	if(a->end[0].t < b->end[0].t && a->end[1].t > b->end[1].t) {
-		/* B in A */
-		res = alloc_hits(2);
-		res->o = a->o;
-		res->end[0] = a->end[0];
-		res->end[1] = b->end[0];
-		res->next->o = a->o;
-		res->next->end[0] = b->end[1];
-		res->next->end[1] = a->end[1];
-		return res;
+		if(!top) break;
+		idx = stack[--top];
 	}
+	return res;
+}
 
-	res = alloc_hits(1);
+static struct hinterv *lazy_instance(csg_ray *ray, const struct cscene *sc, const struct cnode *n,
+		float *tmax, int nearest)
+{
+	struct hinterv *hit;
+	csg_ray locray;
 
-	if(a->end[0].t > b->end[1].t || a->end[1].t < b->end[0].t) {
-		/* disjoint */
-		*res = *a;
-		res->next = 0;
-		return res;
-	}
+	local_ray(&locray, ray, n);
 
-	/* partial overlap */
-	res->o = a->o;
-	if(a->end[0].t <= b->end[0].t) {
-		res->end[0] = a->end[0];
-		res->end[1] = b->end[0];
+	if(!(hit = lazy_intersect(&locray, sc, sc->nodes + n->u.op.child, tmax, nearest))) {
+		return 0;
+	}
+	instance_hits(ray, sc, n, hit);
+	return hit;
+}
+
+/* whether any cutter of subtraction n has bounds the window can cull */
+static int cull_cutters(const struct cscene *sc, const struct cnode *n)
+{
+	int i;
+
+	if(n->u.op.bvh >= 0) {
+		return 1;
+	}
+	for(i=n->u.op.child + 1; i<n->u.op.bvh_start; i++) {
+		switch(OPERAND(sc, i)->type) {
+		case OB_NULL:
+		case OB_SPHERE:
+		case OB_CYLINDER:
+		case OB_PLANE:
+		case OB_BOX:
+			break;
+		default:
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* nothing past the first hit of a union can change it */
+static void lower_to_hit(const struct hinterv *res, float *tmax)
+{
+	const csg_hit *hit = first_hit(res);
+
+	if(hit && hit->t < *tmax) {
+		*tmax = hit->t;
+	}
+}
+
+static struct hinterv *copy_hits(const struct hinterv *list)
+{
+	struct hinterv *res = 0, **tail = &res, *hit;
+
+	while(list) {
+		hit = alloc_hits(1);
+		*hit = *list;
+		hit->next = 0;
+		*tail = hit;
+		tail = &hit->next;
+		list = list->next;
+	}
+	return res;
+}
+
+void packet_set_ray(struct ray_packet *pk, int lane, const csg_ray *ray)
+{
+	pk->x = ray->x;
+	pk->y = ray->y;
+	pk->z = ray->z;
+	pk->dir[0][lane] = ray->dx;
+	pk->dir[1][lane] = ray->dy;
+	pk->dir[2][lane] = ray->dz;
+	pk->inv_dir[0][lane] = 1.0f / ray->dx;
+	pk->inv_dir[1][lane] = 1.0f / ray->dy;
+	pk->inv_dir[2][lane] = 1.0f / ray->dz;
+	pk->iter = ray->iter;
+	pk->energy = ray->energy;
+}
+
+void packet_get_ray(csg_ray *ray, const struct ray_packet *pk, int lane)
+{
+	ray->x = pk->x;
+	ray->y = pk->y;
+	ray->z = pk->z;
+	ray->dx = pk->dir[0][lane];
+	ray->dy = pk->dir[1][lane];
+	ray->dz = pk->dir[2][lane];
+	ray->iter = pk->iter;
+	ray->energy = pk->energy;
+}
+
+/* Every lane has the same operations applied as by ray_intersect, only culled
+ * by the same bounds tests. Rays drop out of the mask as they miss, and the
+ * traversal below a node only involves the rays which reached it.
+ */
+void packet_intersect(const struct ray_packet *pk, unsigned int mask, const struct cscene *sc,
+		const struct cnode *n, struct hinterv **res)
+{
+	int i;
+	csg_ray ray;
+
+	memset(res, 0, PACKET_SIZE * sizeof *res);
+
+	if(!(mask & (mask - 1))) {
+		/* at most one ray left, nothing to share */
+		for(i=0; i<PACKET_SIZE; i++) {
+			if(mask & (1 << i)) {
+				packet_get_ray(&ray, pk, i);
+				res[i] = ray_intersect(&ray, sc, n);
+			}
+		}
+		return;
+	}
+
+	switch(n->type) {
+	case OB_NULL:
+		return;
+
+	case OB_SPHERE:
+	case OB_CYLINDER:
+	case OB_PLANE:
+	case OB_BOX:
+		/* ray_intersect doesn't bother with the bounds of a single primitive,
+		 * but one test saves a whole packet of them. Only hits behind the ray
+		 * origin are lost, which never make it to the nearest hit.
+		 */
+		mask = packet_bounds(pk, mask, n->bmin, n->bmax, 0, 0);
+		for(i=0; i<PACKET_SIZE; i++) {
+			if(mask & (1 << i)) {
+				packet_get_ray(&ray, pk, i);
+				res[i] = ray_intersect(&ray, sc, n);
+			}
+		}
+		return;
+
+	default:
+		break;
+	}
+
+	if(!(mask = packet_bounds(pk, mask, n->bmin, n->bmax, 0, 0))) {
+		return;
+	}
+
+	for(i=0; i<PACKET_SIZE; i++) {
+		if(mask & (1 << i)) {
+			STAT_INC(csg_nodes);
+		}
+	}
+	if(++csg_tdepth > csg_tstats.max_csg_depth) {
+		csg_tstats.max_csg_depth = csg_tdepth;
+	}
+
+	switch(n->type) {
+	case OB_UNION:
+		packet_csg_un(pk, mask, sc, n, res);
+		break;
+	case OB_INTERSECTION:
+		packet_csg_isect(pk, mask, sc, n, res);
+		break;
+	case OB_SUBTRACTION:
+		packet_csg_sub(pk, mask, sc, n, res);
+		break;
+	case OB_INSTANCE:
+		packet_instance(pk, mask, sc, n, res);
+		break;
+	default:
+		break;
+	}
+
+	--csg_tdepth;
+}
+
+/* ray_bounds for every lane at once, with a range per lane, or [0, FLT_MAX) if
+ * tmin and tmax are null. Returns the rays of mask which can hit the box.
+ */
+static unsigned int packet_bounds(const struct ray_packet *pk, unsigned int mask,
+		const float *bmin, const float *bmax, const float *tmin, const float *tmax)
+{
+	int i, j;
+	unsigned int res = 0;
+	float t0, t1, lo, hi, orig;
+	float t0v[PACKET_SIZE], t1v[PACKET_SIZE];
+	const float *inv_dir;
+
+	for(i=0; i<PACKET_SIZE; i++) {
+		t0v[i] = tmin ? tmin[i] : 0.0f;
+		t1v[i] = tmax ? tmax[i] : FLT_MAX;
+	}
+
+	for(j=0; j<3; j++) {
+		if(bmin[j] == -FLT_MAX || bmax[j] == FLT_MAX) {
+			continue;
+		}
+		orig = (&pk->x)[j];
+		inv_dir = pk->inv_dir[j];
+
+		/* branchless, and with the comparisons of ray_bounds, so that NaNs
+		 * pass the same way
+		 */
+		for(i=0; i<PACKET_SIZE; i++) {
+			t0 = (bmin[j] - orig) * inv_dir[i];
+			t1 = (bmax[j] - orig) * inv_dir[i];
+			lo = t0 > t1 ? t1 : t0;
+			hi = t0 > t1 ? t0 : t1;
+			t0v[i] = lo > t0v[i] ? lo : t0v[i];
+			t1v[i] = hi < t1v[i] ? hi : t1v[i];
+		}
+	}
+
+	for(i=0; i<PACKET_SIZE; i++) {
+		if(!(t0v[i] > t1v[i])) {
+			res |= 1 << i;
+		}
+	}
+	return res & mask;
+}
+
+/* combines the hits of every ray in mask with its result so far, and returns
+ * the rays with anything left
+ */
+static unsigned int combine_lanes(int op, unsigned int mask, struct hinterv **res,
+		struct hinterv **hits)
+{
+	int i;
+	unsigned int left = 0;
+
+	for(i=0; i<PACKET_SIZE; i++) {
+		if(mask & (1 << i)) {
+			if((res[i] = combine(op, res[i], hits[i]))) {
+				left |= 1 << i;
+			}
+		}
+	}
+	return left;
+}
+
+static void packet_csg_un(const struct ray_packet *pk, unsigned int mask, const struct cscene *sc,
+		const struct cnode *n, struct hinterv **res)
+{
+	int i;
+	struct hinterv *hits[PACKET_SIZE];
+
+	for(i=n->u.op.child; i<n->u.op.bvh_start; i++) {
+		packet_intersect(pk, mask, sc, OPERAND(sc, i), hits);
+		combine_lanes(OB_UNION, mask, res, hits);
+	}
+	if(n->u.op.bvh >= 0) {
+		packet_csg_bvh(pk, mask, sc, n, res);
+	}
+}
+
+static void packet_csg_isect(const struct ray_packet *pk, unsigned int mask, const struct cscene *sc,
+		const struct cnode *n, struct hinterv **res)
+{
+	int i, j, end = n->u.op.child + n->u.op.num_child;
+	unsigned int hit;
+	struct hinterv *hits[PACKET_SIZE];
+
+	if(!n->u.op.num_child) {
+		return;
+	}
+	packet_intersect(pk, mask, sc, OPERAND(sc, n->u.op.child), res);
+	mask = live_lanes(mask, res);
+
+	for(i=n->u.op.child + 1; i<end && mask; i++) {
+		hit = packet_reaches(pk, mask, OPERAND(sc, i), res);
+		for(j=0; j<PACKET_SIZE; j++) {
+			if((mask & ~hit) & (1 << j)) {
+				free_hit_list(res[j]);
+				res[j] = 0;
+			}
+		}
+		if(!(mask = hit)) {
+			break;
+		}
+		packet_intersect(pk, mask, sc, OPERAND(sc, i), hits);
+		mask = combine_lanes(OB_INTERSECTION, mask, res, hits);
+	}
+}
+
+static void packet_csg_sub(const struct ray_packet *pk, unsigned int mask, const struct cscene *sc,
+		const struct cnode *n, struct hinterv **res)
+{
+	int i;
+	unsigned int hit;
+	struct hinterv *hits[PACKET_SIZE];
+
+	if(!n->u.op.num_child) {
+		return;
+	}
+	packet_intersect(pk, mask, sc, OPERAND(sc, n->u.op.child), res);
+	mask = live_lanes(mask, res);
+
+	for(i=n->u.op.child + 1; i<n->u.op.bvh_start && mask; i++) {
+		if((hit = packet_reaches(pk, mask, OPERAND(sc, i), res))) {
+			packet_intersect(pk, hit, sc, OPERAND(sc, i), hits);
+			mask = (mask & ~hit) | combine_lanes(OB_SUBTRACTION, hit, res, hits);
+		}
+	}
+	if(mask && n->u.op.bvh >= 0) {
+		packet_csg_bvh(pk, mask, sc, n, res);
+	}
+}
+
+/* ray_csg_bvh for a packet. Pushed hierarchy nodes carry the rays which
+ * reached their parent, and subtractions narrow the range of each ray to what's
+ * left of its result, dropping it when nothing is.
+ */
+static void packet_csg_bvh(const struct ray_packet *pk, unsigned int mask, const struct cscene *sc,
+		const struct cnode *n, struct hinterv **res)
+{
+	int i, idx = n->u.op.bvh, top = 0, stack[BVH_MAX_DEPTH];
+	unsigned int hit, mstack[BVH_MAX_DEPTH];
+	float tmin[PACKET_SIZE], tmax[PACKET_SIZE];
+	const struct bvh_node *node;
+	struct hinterv *hits[PACKET_SIZE], *last;
+	csg_ray ray;
+
+	for(i=0; i<PACKET_SIZE; i++) {
+		tmin[i] = 0.0f;
+		tmax[i] = FLT_MAX;
+	}
+
+	for(;;) {
+		if(n->type == OB_SUBTRACTION) {
+			mask = live_lanes(mask, res);
+			for(i=0; i<PACKET_SIZE; i++) {
+				if(mask & (1 << i)) {
+					last = res[i];
+					while(last->next) last = last->next;
+					tmin[i] = res[i]->end[0].t > 0.0f ? res[i]->end[0].t : 0.0f;
+					tmax[i] = last->end[1].t;
+				}
+			}
+		}
+
+		node = sc->bvh + idx;
+		if((hit = packet_bounds(pk, mask, node->bmin, node->bmax, tmin, tmax))) {
+			if(!node->count) {
+				assert(top < BVH_MAX_DEPTH);
+				stack[top] = node->second;
+				mstack[top++] = hit;
+				mask = hit;
+				idx++;
+				continue;
+			}
+			if(node->second >= 0) {
+				/* leaf blocks are for one ray at a time */
+				for(i=0; i<PACKET_SIZE; i++) {
+					if(hit & (1 << i)) {
+						packet_get_ray(&ray, pk, i);
+						res[i] = ray_leaf_block(&ray, sc, n, node, res[i]);
+					}
+				}
+				goto next;
+			}
+			for(i=0; i<node->count; i++) {
+				if(n->type == OB_SUBTRACTION && !(hit = live_lanes(hit, res))) {
+					break;
+				}
+				packet_intersect(pk, hit, sc, OPERAND(sc, node->first + i), hits);
+				combine_lanes(n->type, hit, res, hits);
+			}
+		}
+
+next:	if(!top) break;
+		--top;
+		idx = stack[top];
+		mask = mstack[top];
+	}
+}
+
+/* the definition is traversed with the packet moved to instance space, which
+ * keeps a common origin under any affine transformation
+ */
+static void packet_instance(const struct ray_packet *pk, unsigned int mask, const struct cscene *sc,
+		const struct cnode *n, struct hinterv **res)
+{
+	int i;
+	struct ray_packet locpk;
+	csg_ray ray, locray;
+
+	/* all lanes, so that the inactive ones don't compute garbage */
+	for(i=0; i<PACKET_SIZE; i++) {
+		packet_get_ray(&ray, pk, i);
+		local_ray(&locray, &ray, n);
+		packet_set_ray(&locpk, i, &locray);
+	}
+
+	packet_intersect(&locpk, mask, sc, sc->nodes + n->u.op.child, res);
+
+	for(i=0; i<PACKET_SIZE; i++) {
+		if(res[i]) {
+			packet_get_ray(&ray, pk, i);
+			instance_hits(&ray, sc, n, res[i]);
+		}
+	}
+}
+
+/* returns the rays of mask which have anything in their result */
+static unsigned int live_lanes(unsigned int mask, struct hinterv **res)
+{
+	int i;
+
+	for(i=0; i<PACKET_SIZE; i++) {
+		if(!res[i]) {
+			mask &= ~(1 << i);
+		}
+	}
+	return mask;
+}
+
+/* reaches for every ray of mask, which must all have something in res */
+static unsigned int packet_reaches(const struct ray_packet *pk, unsigned int mask,
+		const struct cnode *n, struct hinterv **res)
+{
+	int i;
+	float tmin[PACKET_SIZE], tmax[PACKET_SIZE];
+
+	for(i=0; i<PACKET_SIZE; i++) {
+		if(mask & (1 << i)) {
+			result_range(res[i], tmin + i, tmax + i);
+		} else {
+			tmin[i] = 0.0f;
+			tmax[i] = FLT_MAX;
+		}
+	}
+	return packet_bounds(pk, mask, n->bmin, n->bmax, tmin, tmax);
+}
+
+
+void sample_object(csg_object *o, float *pos)
+{
+	switch(o->ob.type) {
+	case OB_SPHERE:
+		sample_sphere(o, pos);
+		break;
+	case OB_CYLINDER:
+		sample_cylinder(o, pos);
+		break;
+	case OB_PLANE:
+		sample_plane(o, pos);
+		break;
+	case OB_BOX:
+		sample_box(o, pos);
+		break;
+	case OB_UNION:
+		sample_csg_un(o, pos);
+		break;
+	case OB_INTERSECTION:
+		sample_csg_isect(o, pos);
+		break;
+	case OB_SUBTRACTION:
+		sample_csg_sub(o, pos);
+		break;
+	case OB_INSTANCE:
+		sample_instance(o, pos);
+		break;
+
+	default:
+		pos[0] = o->ob.xform[12];
+		pos[1] = o->ob.xform[13];
+		pos[2] = o->ob.xform[14];
+	}
+}
+
+void sample_sphere(csg_object *o, float *pos)
+{
+	sphrand(o->sph.rad, pos);
+	mat4_xform3(pos, o->ob.xform, pos);
+}
+
+void sample_cylinder(csg_object *o, float *pos)
+{
+	cylrand(o->cyl.rad, o->cyl.height, pos);
+	mat4_xform3(pos, o->ob.xform, pos);
+}
+
+/* pffffft */
+void sample_plane(csg_object *o, float *pos)
+{
+	pos[0] = o->ob.xform[12];
+	pos[1] = o->ob.xform[13];
+	pos[2] = o->ob.xform[14];
+}
+
+void sample_box(csg_object *o, float *pos)
+{
+	pos[0] = (frand() - 0.5) * o->box.xsz;
+	pos[1] = (frand() - 0.5) * o->box.ysz;
+	pos[2] = (frand() - 0.5) * o->box.zsz;
+
+	mat4_xform3(pos, o->ob.xform, pos);
+}
+
+void sample_csg_un(csg_object *o, float *pos)
+{
+	/* TODO biased, maybe come up with a better plan */
+	int idx = (int)(rand() / ((double)RAND_MAX + 1.0) * o->csg.num_sub);
+
+	if(o->csg.num_sub) {
+		sample_object(o->csg.sub[idx], pos);
+	} else {
+		pos[0] = o->ob.xform[12];
+		pos[1] = o->ob.xform[13];
+		pos[2] = o->ob.xform[14];
+	}
+}
+
+void sample_csg_isect(csg_object *o, float *pos)
+{
+	/* TODO */
+	if(o->csg.num_sub) {
+		sample_object(o->csg.sub[0], pos);
+	} else {
+		pos[0] = o->ob.xform[12];
+		pos[1] = o->ob.xform[13];
+		pos[2] = o->ob.xform[14];
+	}
+}
+
+void sample_csg_sub(csg_object *o, float *pos)
+{
+	/* TODO nope */
+	if(o->csg.num_sub) {
+		sample_object(o->csg.sub[0], pos);
+	} else {
+		pos[0] = o->ob.xform[12];
+		pos[1] = o->ob.xform[13];
+		pos[2] = o->ob.xform[14];
+	}
+}
+
+void sample_instance(csg_object *o, float *pos)
+{
+	sample_object(o->inst.def, pos);
+	mat4_xform3(pos, o->ob.xform, pos);
+}
+
+
+void xform_ray(csg_ray *ray, float *mat)
+{
+	float m3x3[16];
+
+	mat4_copy(m3x3, mat);
+	mat4_upper3x3(m3x3);
+
+	mat4_xform3(&ray->x, mat, &ray->x);
+	mat4_xform3(&ray->dx, m3x3, &ray->dx);
+}
+
+/* Most objects are only translated, so the intersection functions take a
+ * shortcut for those, and for uniform scaling, instead of the full matrix.
+ */
+void calc_xform(csg_object *o)
+{
+	int i, j;
+	float s, *m = o->ob.inv3x4;
+	float *inv = o->ob.inv_xform;
+
+	for(i=0; i<3; i++) {
+		for(j=0; j<3; j++) {
+			m[i * 4 + j] = inv[j * 4 + i];
+		}
+		m[i * 4 + 3] = inv[12 + i];
+	}
+
+	s = m[0];
+	if(m[1] != 0.0f || m[2] != 0.0f || m[4] != 0.0f || m[6] != 0.0f || m[8] != 0.0f ||
+			m[9] != 0.0f || m[5] != s || m[10] != s || s <= 0.0f) {
+		o->ob.xform_class = rigid(m) ? XFORM_RIGID : XFORM_GENERAL;
+	} else if(s != 1.0f) {
+		o->ob.xform_class = XFORM_USCALE;
+	} else if(m[3] != 0.0f || m[7] != 0.0f || m[11] != 0.0f) {
+		o->ob.xform_class = XFORM_TRANSLATE;
+	} else {
+		o->ob.xform_class = XFORM_IDENTITY;
+	}
+}
+
+/* are the rows of the upper 3x3 part of the 3x4 matrix m orthonormal? */
+static int rigid(const float *m)
+{
+	int i, j;
+	float dot;
+
+	for(i=0; i<3; i++) {
+		for(j=i; j<3; j++) {
+			dot = m[i * 4] * m[j * 4] + m[i * 4 + 1] * m[j * 4 + 1] + m[i * 4 + 2] * m[j * 4 + 2];
+			if(fabs(dot - (i == j ? 1.0f : 0.0f)) > 1e-5f) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+static void local_ray(csg_ray *res, csg_ray *ray, const struct cnode *n)
+{
+	float s;
+	const float *m = n->inv;
+
+	*res = *ray;
+
+	switch(n->xform_class) {
+	case XFORM_IDENTITY:
+		break;
+
+	case XFORM_TRANSLATE:
+		res->x = ray->x + m[3];
+		res->y = ray->y + m[7];
+		res->z = ray->z + m[11];
+		break;
+
+	case XFORM_USCALE:
+		s = m[0];
+		res->x = ray->x * s + m[3];
+		res->y = ray->y * s + m[7];
+		res->z = ray->z * s + m[11];
+		res->dx = ray->dx * s;
+		res->dy = ray->dy * s;
+		res->dz = ray->dz * s;
+		break;
+
+	default:
+		res->x = m[0] * ray->x + m[1] * ray->y + m[2] * ray->z + m[3];
+		res->y = m[4] * ray->x + m[5] * ray->y + m[6] * ray->z + m[7];
+		res->z = m[8] * ray->x + m[9] * ray->y + m[10] * ray->z + m[11];
+		res->dx = m[0] * ray->dx + m[1] * ray->dy + m[2] * ray->dz;
+		res->dy = m[4] * ray->dx + m[5] * ray->dy + m[6] * ray->dz;
+		res->dz = m[8] * ray->dx + m[9] * ray->dy + m[10] * ray->dz;
+	}
+}
+
+/* transforms a unit normal from the local space of n to world space, in place,
+ * by the transpose of the inverse. Without rotation there's nothing to do, since
+ * uniform scaling would be undone by normalizing anyway, and rotations don't
+ * need normalizing.
+ */
+static void world_normal(float *norm, const struct cnode *n)
+{
+	float x, y, z, len;
+	const float *m = n->inv;
+
+	if(n->xform_class < XFORM_RIGID) {
+		return;
+	}
+
+	x = m[0] * norm[0] + m[4] * norm[1] + m[8] * norm[2];
+	y = m[1] * norm[0] + m[5] * norm[1] + m[9] * norm[2];
+	z = m[2] * norm[0] + m[6] * norm[1] + m[10] * norm[2];
+
+	if(n->xform_class == XFORM_GENERAL && (len = sqrt(x * x + y * y + z * z)) != 0.0f) {
+		float s = 1.0f / len;
+		x *= s;
+		y *= s;
+		z *= s;
+	}
+	norm[0] = x;
+	norm[1] = y;
+	norm[2] = z;
+}
+
+int bake_xform(csg_object *o)
+{
+	static const float ident[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+	int i, changed = 0;
+	csg_object *sub;
+
+	if(o->ob.type != OB_UNION && o->ob.type != OB_INTERSECTION && o->ob.type != OB_SUBTRACTION) {
+		return 0;
+	}
+
+	if(memcmp(o->ob.xform, ident, sizeof ident) != 0 || memcmp(o->ob.inv_xform, ident, sizeof ident) != 0) {
+		for(i=0; i<o->csg.num_sub; i++) {
+			sub = o->csg.sub[i];
+			/* operand space to ours to the world, and back the other way */
+			mat4_mul(sub->ob.xform, sub->ob.xform, o->ob.xform);
+			mat4_mul(sub->ob.inv_xform, o->ob.inv_xform, sub->ob.inv_xform);
+			calc_xform(sub);
+			sub->ob.flags &= ~OBF_BOUNDS;
+		}
+		mat4_identity(o->ob.xform);
+		mat4_identity(o->ob.inv_xform);
+		calc_xform(o);
+		changed = 1;
+	}
+
+	for(i=0; i<o->csg.num_sub; i++) {
+		if(bake_xform(o->csg.sub[i])) {
+			changed = 1;
+		}
+	}
+	if(changed) {
+		o->ob.flags &= ~OBF_BOUNDS;
+	}
+	return changed;
+}
+
+static void xform_bounds(csg_object *o, float *lmin, float *lmax)
+{
+	int i, j;
+	float v[3], mat[16];
+
+	for(i=0; i<3; i++) {
+		o->ob.bmin[i] = FLT_MAX;
+		o->ob.bmax[i] = -FLT_MAX;
+	}
+
+	for(i=0; i<3; i++) {
+		if(lmin[i] > lmax[i]) {
+			return;		/* empty stays empty */
+		}
+	}
+	for(i=0; i<3; i++) {
+		if(lmin[i] == -FLT_MAX || lmax[i] == FLT_MAX) {
+			/* transforming infinite bounds would just produce infinities */
+			for(j=0; j<3; j++) {
+				o->ob.bmin[j] = -FLT_MAX;
+				o->ob.bmax[j] = FLT_MAX;
+			}
+			return;
+		}
+	}
+
+	/* the intersection tests go through inv_xform, and xform isn't always its
+	 * exact inverse (see mat4_pre_rotate)
+	 */
+	mat4_copy(mat, o->ob.inv_xform);
+	mat4_inverse(mat);
+
+	for(i=0; i<8; i++) {
+		v[0] = i & 1 ? lmax[0] : lmin[0];
+		v[1] = i & 2 ? lmax[1] : lmin[1];
+		v[2] = i & 4 ? lmax[2] : lmin[2];
+		mat4_xform3(v, mat, v);
+
+		for(j=0; j<3; j++) {
+			if(v[j] < o->ob.bmin[j]) o->ob.bmin[j] = v[j];
+			if(v[j] > o->ob.bmax[j]) o->ob.bmax[j] = v[j];
+		}
+	}
+
+	for(i=0; i<3; i++) {
+		o->ob.bmin[i] -= BOUNDS_SLACK * (1.0f + fabs(o->ob.bmin[i]));
+		o->ob.bmax[i] += BOUNDS_SLACK * (1.0f + fabs(o->ob.bmax[i]));
+	}
+}
+
+void calc_bounds(csg_object *o)
+{
+	int i;
+	float lmin[3], lmax[3];
+
+	switch(o->ob.type) {
+	case OB_SPHERE:
+		lmin[0] = lmin[1] = lmin[2] = -o->sph.rad;
+		lmax[0] = lmax[1] = lmax[2] = o->sph.rad;
+		xform_bounds(o, lmin, lmax);
+		break;
+
+	case OB_CYLINDER:
+		lmin[0] = lmin[2] = -o->cyl.rad;
+		lmax[0] = lmax[2] = o->cyl.rad;
+		lmin[1] = -o->cyl.height / 2.0f;
+		lmax[1] = o->cyl.height / 2.0f;
+		xform_bounds(o, lmin, lmax);
+		break;
+
+	case OB_BOX:
+		lmax[0] = o->box.xsz / 2.0f;
+		lmax[1] = o->box.ysz / 2.0f;
+		lmax[2] = o->box.zsz / 2.0f;
+		lmin[0] = -lmax[0];
+		lmin[1] = -lmax[1];
+		lmin[2] = -lmax[2];
+		xform_bounds(o, lmin, lmax);
+		break;
+
+	case OB_PLANE:
+		for(i=0; i<3; i++) {
+			o->ob.bmin[i] = -FLT_MAX;
+			o->ob.bmax[i] = FLT_MAX;
+		}
+		break;
+
+	case OB_UNION:
+	case OB_INTERSECTION:
+	case OB_SUBTRACTION:
+		for(i=0; i<o->csg.num_sub; i++) {
+			calc_bounds(o->csg.sub[i]);
+		}
+		calc_csg_bounds(o);
+		return;
+
+	case OB_INSTANCE:
+		/* in definition space, which the instance transforms to world space */
+		if(!(o->inst.def->ob.flags & OBF_BOUNDS)) {
+			calc_bounds(o->inst.def);
+		}
+		xform_bounds(o, o->inst.def->ob.bmin, o->inst.def->ob.bmax);
+		break;
+
+	default:
+		/* null objects are just a point */
+		for(i=0; i<3; i++) {
+			o->ob.bmin[i] = o->ob.bmax[i] = o->ob.xform[12 + i];
+		}
+	}
+	o->ob.flags |= OBF_BOUNDS;
+}
+
+void calc_csg_bounds(csg_object *o)
+{
+	int i, j;
+	csg_object *sub;
+
+	for(i=0; i<3; i++) {
+		if(o->ob.type == OB_INTERSECTION && o->csg.num_sub) {
+			o->ob.bmin[i] = -FLT_MAX;
+			o->ob.bmax[i] = FLT_MAX;
+		} else {
+			/* empty */
+			o->ob.bmin[i] = FLT_MAX;
+			o->ob.bmax[i] = -FLT_MAX;
+		}
+	}
+
+	for(j=0; j<o->csg.num_sub; j++) {
+		sub = o->csg.sub[j];
+		for(i=0; i<3; i++) {
+			if(o->ob.type == OB_INTERSECTION) {
+				if(sub->ob.bmin[i] > o->ob.bmin[i]) o->ob.bmin[i] = sub->ob.bmin[i];
+				if(sub->ob.bmax[i] < o->ob.bmax[i]) o->ob.bmax[i] = sub->ob.bmax[i];
+			} else {
+				if(sub->ob.bmin[i] < o->ob.bmin[i]) o->ob.bmin[i] = sub->ob.bmin[i];
+				if(sub->ob.bmax[i] > o->ob.bmax[i]) o->ob.bmax[i] = sub->ob.bmax[i];
+			}
+		}
+		/* subtractions are bounded by what they cut into */
+		if(o->ob.type == OB_SUBTRACTION) break;
+	}
+
+	build_bvh(o);
+	calc_estimates(o);
+	o->ob.flags |= OBF_BOUNDS;
+}
+
+int bounds_empty(csg_object *o)
+{
+	return o->ob.bmin[0] > o->ob.bmax[0] || o->ob.bmin[1] > o->ob.bmax[1] ||
+		o->ob.bmin[2] > o->ob.bmax[2];
+}
+
+int bounds_infinite(csg_object *o)
+{
+	int i;
+	for(i=0; i<3; i++) {
+		if(o->ob.bmin[i] == -FLT_MAX || o->ob.bmax[i] == FLT_MAX) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Unions and subtractions get a hierarchy over their bounded operands, which
+ * are moved to the end. Everything else, including the object a subtraction
+ * cuts into, stays in front to be tested every time. Intersections need all
+ * their operands anyway, so they're just put in the best order to test them.
+ */
+static void build_bvh(csg_object *o)
+{
+	int i, first, count;
+	struct csgop *op = &o->csg;
+	csg_object *tmp;
+
+	free(op->bvh);
+	op->bvh = 0;
+	op->bvh_start = 0;
+
+	if(o->ob.type == OB_INTERSECTION) {
+		order_operands(o);
+		return;
+	}
+	first = o->ob.type == OB_SUBTRACTION ? 1 : 0;
+
+	count = 0;
+	for(i=first; i<op->num_sub; i++) {
+		if(!bounds_empty(op->sub[i]) && !bounds_infinite(op->sub[i])) {
+			count++;
+		}
+	}
+	if(count < BVH_MIN_OPERANDS) {
+		return;
+	}
+
+	for(i=first; i<op->num_sub; i++) {
+		if(bounds_empty(op->sub[i]) || bounds_infinite(op->sub[i])) {
+			tmp = op->sub[i];
+			op->sub[i] = op->sub[first];
+			op->sub[first++] = tmp;
+		}
+	}
+
+	if(!(op->bvh = malloc((2 * count - 1) * sizeof *op->bvh))) {
+		/* not fatal, the operands are tested one by one instead */
+		perror("failed to allocate CSG operand hierarchy");
+		return;
+	}
+	op->bvh_start = first;
+	op->num_bvh = build_bvh_node(op, 0, first, count);
+}
+
+/* Builds the hierarchy over count operands starting at first, splitting them
+ * at the median of their centers along the longest axis. The nodes are written
+ * from idx onwards, and the index after the last one is returned. Runs of
+ * primitives which fit in a leaf block are kept together in one leaf.
+ */
+static int build_bvh_node(struct csgop *op, int idx, int first, int count)
+{
+	int i, j, axis;
+	float c, cmin[3], cmax[3];
+	struct bvh_node *node = op->bvh + idx;
+	csg_object *sub;
+
+	for(i=0; i<3; i++) {
+		node->bmin[i] = cmin[i] = FLT_MAX;
+		node->bmax[i] = cmax[i] = -FLT_MAX;
+	}
+	for(j=0; j<count; j++) {
+		sub = op->sub[first + j];
+		for(i=0; i<3; i++) {
+			if(sub->ob.bmin[i] < node->bmin[i]) node->bmin[i] = sub->ob.bmin[i];
+			if(sub->ob.bmax[i] > node->bmax[i]) node->bmax[i] = sub->ob.bmax[i];
+			c = centroid(sub, i);
+			if(c < cmin[i]) cmin[i] = c;
+			if(c > cmax[i]) cmax[i] = c;
+		}
+	}
+
+	if(count <= BVH_LEAF_SIZE || leaf_block_type(op->sub + first, count) != -1) {
+		node->first = first;
+		node->count = count;
+		node->second = -1;
+		return idx + 1;
+	}
+
+	axis = 0;
+	for(i=1; i<3; i++) {
+		if(cmax[i] - cmin[i] > cmax[axis] - cmin[axis]) {
+			axis = i;
+		}
+	}
+	split_operands(op->sub + first, count, axis, count / 2);
+
+	node->first = first;
+	node->count = 0;
+	node->second = build_bvh_node(op, idx + 1, first, count / 2);
+	return build_bvh_node(op, node->second, first + count / 2, count - count / 2);
+}
+
+/* partial quicksort by centroid, leaving the operands before mid no greater
+ * than the operands from mid onwards
+ */
+static void split_operands(csg_object **sub, int count, int axis, int mid)
+{
+	int i, j, lo = 0, hi = count - 1;
+	float pivot;
+	csg_object *tmp;
+
+	while(lo < hi) {
+		pivot = centroid(sub[(lo + hi) / 2], axis);
+		i = lo;
+		j = hi;
+		while(i <= j) {
+			while(centroid(sub[i], axis) < pivot) i++;
+			while(centroid(sub[j], axis) > pivot) j--;
+			if(i <= j) {
+				tmp = sub[i];
+				sub[i++] = sub[j];
+				sub[j--] = tmp;
+			}
+		}
+
+		if(mid <= j) {
+			hi = j;
+		} else if(mid >= i) {
+			lo = i;
+		} else {
+			break;
+		}
+	}
+}
+
+/* An intersection is empty as soon as one operand is missed, so the ones most
+ * likely to be missed for the least cost go first: testing a before b is
+ * cheaper on average when cost(a) / miss(a) < cost(b) / miss(b). Equal
+ * operands keep their order.
+ */
+static void order_operands(csg_object *o)
+{
+	int i, j;
+	float cost, prob, key[ORDER_MAX_OPERANDS], tmp;
+	csg_object *sub;
+
+	if(o->csg.num_sub < 2 || o->csg.num_sub > ORDER_MAX_OPERANDS) {
+		return;
+	}
+
+	for(i=0; i<o->csg.num_sub; i++) {
+		estimate(o->csg.sub[i], &cost, &prob);
+		key[i] = cost / (1.0f - (prob < MAX_HIT_PROB ? prob : MAX_HIT_PROB));
+	}
+
+	for(i=1; i<o->csg.num_sub; i++) {
+		sub = o->csg.sub[i];
+		tmp = key[i];
+		for(j=i; j>0 && key[j - 1] > tmp; j--) {
+			o->csg.sub[j] = o->csg.sub[j - 1];
+			key[j] = key[j - 1];
+		}
+		o->csg.sub[j] = sub;
+		key[j] = tmp;
+	}
+}
+
+/* The expected cost and hit probability of a ray reaching the bounds of an
+ * operation, from those of its operands. An operand is reached with the
+ * chance of hitting its bounds, by their surface area, and a hierarchy is
+ * assumed to lead a ray to about log2 of its operands.
+ */
+static void calc_estimates(csg_object *o)
+{
+	int i, first, nbvh;
+	float cost, prob, reach, cost_ops = 0.0f, cost_bvh = 0.0f, miss = 1.0f;
+	struct csgop *op = &o->csg;
+
+	op->cost = 0.0f;
+	op->hit_prob = 0.0f;
+	if(!op->num_sub) {
+		return;
+	}
+
+	if(o->ob.type == OB_INTERSECTION) {
+		/* in testing order, stopping at the first miss */
+		reach = 1.0f;
+		for(i=0; i<op->num_sub; i++) {
+			estimate(op->sub[i], &cost, &prob);
+			op->cost += reach * cost;
+			reach *= prob;
+		}
+		op->hit_prob = reach;
+		return;
+	}
+
+	first = o->ob.type == OB_SUBTRACTION ? 1 : 0;
+	nbvh = op->bvh ? op->num_sub - op->bvh_start : 0;
+	for(i=first; i<op->num_sub; i++) {
+		estimate(op->sub[i], &cost, &prob);
+		reach = area_ratio(op->sub[i], o);
+		if(i >= op->num_sub - nbvh) {
+			cost_bvh += cost;
+		} else {
+			cost_ops += reach * cost;
+		}
+		miss *= 1.0f - reach * prob;
+	}
+	if(nbvh) {
+		cost_ops += cost_bvh / nbvh * (1.0f + log2f(nbvh));
+	}
+
+	if(o->ob.type == OB_UNION) {
+		op->cost = cost_ops;
+		op->hit_prob = 1.0f - miss;
 	} else {
-		res->end[0] = b->end[1];
-		flip_hit(res->end + 0);
-		res->end[1] = a->end[1];
+		/* the cutters are only tested where the first operand is hit */
+		estimate(op->sub[0], &cost, &prob);
+		op->cost = cost + prob * cost_ops;
+		op->hit_prob = prob;
+	}
+}
+
+/* Primitives cover a fixed part of their bounds: a sphere about pi / 6 of the
+ * surface area of its box, and a cylinder pi / 4.
+ */
+static void estimate(csg_object *o, float *cost, float *prob)
+{
+	*cost = 1.0f;
+
+	switch(o->ob.type) {
+	case OB_SPHERE:
+		*prob = 0.52f;
+		break;
+	case OB_CYLINDER:
+		*prob = 0.79f;
+		break;
+	case OB_BOX:
+	case OB_PLANE:
+		*prob = 1.0f;
+		break;
+	case OB_UNION:
+	case OB_INTERSECTION:
+	case OB_SUBTRACTION:
+		*cost = o->csg.cost;
+		*prob = o->csg.hit_prob;
+		break;
+	case OB_INSTANCE:
+		estimate(o->inst.def, cost, prob);
+		break;
+	default:
+		*cost = 0.0f;
+		*prob = 0.0f;
+	}
+}
+
+/* the chance of a ray which hits the bounds of outer hitting those of o */
+static float area_ratio(csg_object *o, csg_object *outer)
+{
+	int i;
+	float ext[2][3];
+
+	if(bounds_empty(o)) {
+		return 0.0f;
+	}
+	if(bounds_infinite(o) || bounds_infinite(outer)) {
+		return 1.0f;
+	}
+	for(i=0; i<3; i++) {
+		ext[0][i] = o->ob.bmax[i] - o->ob.bmin[i];
+		ext[1][i] = outer->ob.bmax[i] - outer->ob.bmin[i];
+	}
+	/* cutters can stick out of the subtraction bounds */
+	if(AREA(ext[0]) >= AREA(ext[1])) {
+		return 1.0f;
+	}
+	return AREA(ext[0]) / AREA(ext[1]);
+}
+
+static float centroid(csg_object *o, int axis)
+{
+	return (o->ob.bmin[axis] + o->ob.bmax[axis]) * 0.5f;
+}
+
+int leaf_block_type(csg_object **sub, int count)
+{
+	int i, type = sub[0]->ob.type;
+
+	if(count < 2 || count > LEAF_BLOCK_SIZE) {
+		return -1;
+	}
+	if(type != OB_SPHERE && type != OB_CYLINDER && type != OB_BOX) {
+		return -1;
+	}
+	for(i=1; i<count; i++) {
+		if(sub[i]->ob.type != type) {
+			return -1;
+		}
+	}
+	return type;
+}
+
+static void flip_hit(csg_hit *hit)
+{
+	hit->nx = -hit->nx;
+	hit->ny = -hit->ny;
+	hit->nz = -hit->nz;
+}
+
+/* append a new interval to the list ending at *tail */
+static struct hinterv *add_interv(struct hinterv ***tail, csg_object *o, csg_hit *start, csg_hit *end)
+{
+	struct hinterv *res = alloc_hits(1);
+	res->o = o;
+	res->end[0] = *start;
+	res->end[1] = *end;
+	**tail = res;
+	*tail = &res->next;
+	return res;
+}
+
+/* Interval lists are sorted and disjoint, and so are the results of the
+ * operations below, which walk both lists in a single merge pass.
+ */
+struct hinterv *interval_union(struct hinterv *a, struct hinterv *b)
+{
+	struct hinterv *res = 0, **tail = &res, *cur = 0, *next;
+
+	while(a || b) {
+		if(!b || (a && a->end[0].t <= b->end[0].t)) {
+			next = a;
+			a = a->next;
+		} else {
+			next = b;
+			b = b->next;
+		}
+
+		if(cur && next->end[0].t <= cur->end[1].t) {
+			/* overlapping, extend the current interval */
+			if(next->end[1].t > cur->end[1].t) {
+				cur->end[1] = next->end[1];
+			}
+		} else {
+			cur = add_interv(&tail, next->o, next->end, next->end + 1);
+		}
+	}
+	return res;
+}
+
+struct hinterv *interval_isect(struct hinterv *a, struct hinterv *b)
+{
+	struct hinterv *res = 0, **tail = &res;
+	csg_hit *start, *end;
+
+	while(a && b) {
+		start = a->end[0].t >= b->end[0].t ? a->end : b->end;
+		end = a->end[1].t <= b->end[1].t ? a->end + 1 : b->end + 1;
+
+		if(start->t < end->t) {
+			add_interv(&tail, a->o, start, end);
+		}
+
+		/* drop whichever ends first, it can't overlap anything else */
+		if(a->end[1].t <= b->end[1].t) {
+			a = a->next;
+		} else {
+			b = b->next;
+		}
+	}
+	return res;
+}
+
+struct hinterv *interval_sub(struct hinterv *a, struct hinterv *b)
+{
+	struct hinterv *res = 0, **tail = &res;
+	csg_hit start, bend;
+
+	while(a) {
+		start = a->end[0];
+
+		/* skip subtrahends ending before the remaining part of a */
+		while(b && b->end[1].t <= start.t) {
+			b = b->next;
+		}
+
+		while(b && b->end[0].t < a->end[1].t) {
+			if(b->end[0].t > start.t) {
+				bend = b->end[0];
+				flip_hit(&bend);
+				add_interv(&tail, a->o, &start, &bend);
+			}
+			start = b->end[1];
+			flip_hit(&start);
+
+			if(b->end[1].t >= a->end[1].t) {
+				break;	/* b covers the rest of a, and might overlap the next one */
+			}
+			b = b->next;
+		}
+
+		if(start.t < a->end[1].t) {
+			add_interv(&tail, a->o, &start, a->end + 1);
+		}
+		a = a->next;
 	}
 	return res;
 }
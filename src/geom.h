@@ -20,6 +20,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "csgray.h"
 #include "csgimpl.h"
+#include "cscene.h"
 
 struct hinterv {
 	csg_hit end[2];
@@ -33,15 +34,72 @@ struct hinterv *alloc_hits(int n);
 void free_hit(struct hinterv *hv);
 void free_hit_list(struct hinterv *hv);
 
-struct hinterv *ray_intersect(csg_ray *ray, csg_object *o);
+/* the intersection functions work on the compact nodes of a compiled scene,
+ * and report hits on the objects the nodes were built from
+ */
+struct hinterv *ray_intersect(csg_ray *ray, const struct cscene *sc, const struct cnode *n);
 
-struct hinterv *ray_sphere(csg_ray *ray, csg_object *o);
-struct hinterv *ray_cylinder(csg_ray *ray, csg_object *o);
-struct hinterv *ray_plane(csg_ray *ray, csg_object *o);
-struct hinterv *ray_box(csg_ray *ray, csg_object *o);
-struct hinterv *ray_csg_un(csg_ray *ray, csg_object *o);
-struct hinterv *ray_csg_isect(csg_ray *ray, csg_object *o);
-struct hinterv *ray_csg_sub(csg_ray *ray, csg_object *o);
+/* Intersects the ray with n like ray_intersect, for the nearest hit in front of
+ * the ray origin. The result has the same first hit past the origin as
+ * ray_intersect's, if it's nearer than tmax, but it's only evaluated as far as
+ * needed to find it: operations skip the operands which can't affect it, like
+ * cutters past the surface a ray hits first.
+ */
+struct hinterv *ray_nearest(csg_ray *ray, const struct cscene *sc, const struct cnode *n, float tmax);
+/* the first end of an interval in front of the ray origin, or null */
+const csg_hit *first_hit(const struct hinterv *hv);
+
+struct hinterv *ray_sphere(csg_ray *ray, const struct cscene *sc, const struct cnode *n);
+struct hinterv *ray_cylinder(csg_ray *ray, const struct cscene *sc, const struct cnode *n);
+struct hinterv *ray_plane(csg_ray *ray, const struct cscene *sc, const struct cnode *n);
+struct hinterv *ray_box(csg_ray *ray, const struct cscene *sc, const struct cnode *n);
+struct hinterv *ray_csg_un(csg_ray *ray, const struct cscene *sc, const struct cnode *n);
+struct hinterv *ray_csg_isect(csg_ray *ray, const struct cscene *sc, const struct cnode *n);
+struct hinterv *ray_csg_sub(csg_ray *ray, const struct cscene *sc, const struct cnode *n);
+struct hinterv *ray_instance(csg_ray *ray, const struct cscene *sc, const struct cnode *n);
+
+/* Coherent rays with a common origin, like the primary rays of a block of
+ * pixels, are traced together as a packet. The lane loops are written for the
+ * compiler to vectorize, so the packet size should match the SIMD width: 4 for
+ * SSE, 8 for AVX2, 16 for AVX-512.
+ */
+#ifndef PACKET_SIZE
+#define PACKET_SIZE	8
+#endif
+
+/* pixel block dimensions of a packet */
+#if PACKET_SIZE == 4
+#define PACKET_W	2
+#elif PACKET_SIZE == 8 || PACKET_SIZE == 16
+#define PACKET_W	4
+#else
+#error "PACKET_SIZE must be 4, 8 or 16"
+#endif
+#define PACKET_H	(PACKET_SIZE / PACKET_W)
+
+struct ray_packet {
+	float x, y, z;
+	float dir[3][PACKET_SIZE];
+	float inv_dir[3][PACKET_SIZE];
+
+	int iter;
+	float energy;
+};
+
+/* sets a lane of the packet to ray, which must start at the packet origin */
+void packet_set_ray(struct ray_packet *pk, int lane, const csg_ray *ray);
+void packet_get_ray(csg_ray *ray, const struct ray_packet *pk, int lane);
+
+/* Intersects the rays of the packet with a bit set in mask, writing the hits of
+ * each into res[lane]. The rays share the traversal while they agree, and once
+ * only one is left it continues on its own with ray_intersect.
+ */
+void packet_intersect(const struct ray_packet *pk, unsigned int mask, const struct cscene *sc,
+		const struct cnode *n, struct hinterv **res);
+
+struct hinterv *interval_union(struct hinterv *a, struct hinterv *b);
+struct hinterv *interval_isect(struct hinterv *a, struct hinterv *b);
+struct hinterv *interval_sub(struct hinterv *a, struct hinterv *b);
 
 void sample_object(csg_object *o, float *pos);
 
@@ -52,8 +110,37 @@ void sample_box(csg_object *o, float *pos);
 void sample_csg_un(csg_object *o, float *pos);
 void sample_csg_isect(csg_object *o, float *pos);
 void sample_csg_sub(csg_object *o, float *pos);
+void sample_instance(csg_object *o, float *pos);
 
 
 void xform_ray(csg_ray *ray, float *mat);
 
+/* classify the transformation of o, and precompute the packed matrices the
+ * intersection functions use. Called whenever the transformation changes.
+ */
+void calc_xform(csg_object *o);
+/* push the transformations of CSG operations down to their operands, and
+ * eventually the leaves, which are all that intersection transforms. Returns
+ * non-zero if anything changed.
+ */
+int bake_xform(csg_object *o);
+
+/* calculate the world space bounding box of o and all its sub-objects.
+ * Infinite objects get +/-FLT_MAX bounds, empty ones get bmin > bmax.
+ * Definitions which already have their bounds are not recalculated.
+ */
+void calc_bounds(csg_object *o);
+/* set the bounds of a CSG operation from the bounds of its operands, and
+ * rebuild the hierarchy over them
+ */
+void calc_csg_bounds(csg_object *o);
+
+/* returns the type of the count operands starting at sub, if they can make up a
+ * leaf block, or -1
+ */
+int leaf_block_type(csg_object **sub, int count);
+
+int bounds_empty(csg_object *o);
+int bounds_infinite(csg_object *o);
+
 #endif	/* GEOM_H_ */
@@ -0,0 +1,67 @@
+/*
+csgray - simple CSG raytracer
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include "image.h"
+
+#define PPM_HEADER	"P6\n%d %d\n255\n"
+
+int write_ppm(FILE *fp, float *pix, int xsz, int ysz, float inv_gamma)
+{
+	int i;
+
+	fprintf(fp, PPM_HEADER, xsz, ysz);
+
+	for(i=0; i<xsz * ysz; i++) {
+		unsigned int r = pow(*pix++, inv_gamma) * 255.0f;
+		unsigned int g = pow(*pix++, inv_gamma) * 255.0f;
+		unsigned int b = pow(*pix++, inv_gamma) * 255.0f;
+
+		if(r > 255) r = 255;
+		if(g > 255) g = 255;
+		if(b > 255) b = 255;
+
+		fputc(r, fp);
+		fputc(g, fp);
+		fputc(b, fp);
+	}
+	return ferror(fp) ? -1 : 0;
+}
+
+int save_ppm(const char *fname, float *pix, int xsz, int ysz, float inv_gamma)
+{
+	FILE *fp;
+
+	if(!(fp = fopen(fname, "wb"))) {
+		fprintf(stderr, "failed to open %s for writing: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	if(write_ppm(fp, pix, xsz, ysz, inv_gamma) == -1 || fclose(fp) == EOF) {
+		fprintf(stderr, "failed to write %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+long ppm_size(int xsz, int ysz)
+{
+	char hdr[64];
+	return sprintf(hdr, PPM_HEADER, xsz, ysz) + (long)xsz * ysz * 3;
+}
@@ -0,0 +1,31 @@
+/*
+csgray - simple CSG raytracer
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include <stdio.h>
+
+/* Images are written as binary PPM, gamma corrected by 1 / inv_gamma, and
+ * clamped to 255.
+ */
+int write_ppm(FILE *fp, float *pix, int xsz, int ysz, float inv_gamma);
+int save_ppm(const char *fname, float *pix, int xsz, int ysz, float inv_gamma);
+/* size in bytes of the PPM file write_ppm writes */
+long ppm_size(int xsz, int ysz);
+
+#endif	/* IMAGE_H_ */
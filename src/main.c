@@ -18,87 +18,277 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
-#include <errno.h>
 #include "csgray.h"
+#include "image.h"
+#include "server.h"
 
 #define DFL_WIDTH	800
 #define DFL_HEIGHT	600
 #define DFL_GAMMA	2.2f
 #define DFL_OUTFILE	"output.ppm"
+#define COMPILED_SUFFIX	".csgb"
 
-static int save_image(const char *fname, float *pix, int xsz, int ysz);
+static void print_stats(void);
+static int compile_scene(void);
+static int setup_views(void);
+static char *view_fname(int idx);
 static int parse_opt(int argc, char **argv);
 
 static int width = DFL_WIDTH, height = DFL_HEIGHT;
 static float inv_gamma = 1.0f / DFL_GAMMA;
-static const char *out_fname = DFL_OUTFILE;
+static const char *out_fname;
 static const char *in_fname;
+static int show_stats;
+static int compile;
+static int wavefront;
+static int server;
+static const char *sock_path;
+static char **view_opt;		/* -v arguments */
+static int num_view_opt;
+static int turntable;
+static float turn_deg = 360.0f;
+#ifdef CSG_TRACE
+static const char *trace_fname;
+#endif
 
 int main(int argc, char **argv)
 {
-	float *pixels;
+	int i, num_views, res = 1;
+	float *pixels = 0;
+	char *fname;
 
 	if(parse_opt(argc, argv) == -1) {
 		return 1;
 	}
 
+	if(server) {
+		return run_server(sock_path, inv_gamma) == -1 ? 1 : 0;
+	}
+
+#ifdef CSG_TRACE
+	if(trace_fname && csg_trace_open(trace_fname) == -1) {
+		return 1;
+	}
+#endif
+
 	if(csg_init() == -1) {
 		return 1;
 	}
+	csg_option(CSG_OPT_WAVEFRONT, wavefront);
 
 	if(csg_load(in_fname) == -1) {
-		return 1;
+		goto end;
+	}
+
+	if(compile) {
+		if(compile_scene() != -1) {
+			res = 0;
+		}
+		goto end;
 	}
 
+	if(setup_views() == -1) {
+		goto end;
+	}
+	/* the -v arguments are only needed to set up the views */
+	free(view_opt);
+	view_opt = 0;
+
 	if(!(pixels = malloc(width * height * 3 * sizeof *pixels))) {
 		perror("failed to allocate framebuffer");
-		return 1;
+		goto end;
+	}
+
+	/* every view is rendered from the same loaded scene, one after the other */
+	num_views = csg_num_views();
+	for(i=0; i<num_views || i == 0; i++) {
+		if(num_views) {
+			csg_use_view(i);
+		}
+		if(!(fname = view_fname(i))) {
+			goto end;
+		}
+
+		csg_render_image(pixels, width, height, 0);
+
+		CSG_TRACE_BEGIN("save_image", i);
+		save_ppm(fname, pixels, width, height, inv_gamma);
+		CSG_TRACE_END("save_image");
+
+		if(fname != out_fname) {
+			free(fname);
+		}
 	}
 
-	csg_render_image(pixels, width, height, 0);
-	save_image(out_fname, pixels, width, height);
+	if(show_stats) {
+		print_stats();
+	}
+	res = 0;
 
+end:
+	free(view_opt);
+	free(pixels);
 	csg_destroy();
-	return 0;
+#ifdef CSG_TRACE
+	csg_trace_close();
+#endif
+	return res;
 }
 
-static int save_image(const char *fname, float *pix, int xsz, int ysz)
+static int compile_scene(void)
 {
-	int i;
-	FILE *fp;
+	char *fname = 0, *suffix;
+	int res;
 
-	if(!(fp = fopen(fname, "wb"))) {
-		fprintf(stderr, "failed to open %s for writing: %s\n", fname, strerror(errno));
-		return -1;
+	if(!out_fname) {
+		/* default to the input filename with the compiled scene suffix */
+		if(!(fname = malloc(strlen(in_fname) + sizeof COMPILED_SUFFIX))) {
+			perror("failed to allocate output filename");
+			return -1;
+		}
+		strcpy(fname, in_fname);
+		if((suffix = strrchr(fname, '.')) && !strpbrk(suffix, "/\\")) {
+			*suffix = 0;
+		}
+		strcat(fname, COMPILED_SUFFIX);
+		out_fname = fname;
 	}
 
-	fprintf(fp, "P6\n%d %d\n255\n", xsz, ysz);
+	if((res = csg_save(out_fname)) != -1) {
+		printf("compiled %s -> %s\n", in_fname, out_fname);
+	}
+	free(fname);
+	return res;
+}
+
+/* views passed on the command line replace those of the scene, and a turntable
+ * replaces them all with an orbit around the first
+ */
+static int setup_views(void)
+{
+	int i, n;
+	float v[7], pos[3], targ[3], fov;
 
-	for(i=0; i<xsz * ysz; i++) {
-		unsigned int r = pow(*pix++, inv_gamma) * 255.0f;
-		unsigned int g = pow(*pix++, inv_gamma) * 255.0f;
-		unsigned int b = pow(*pix++, inv_gamma) * 255.0f;
+	if(num_view_opt) {
+		fov = csg_get_fov();
+		csg_clear_views();
+
+		for(i=0; i<num_view_opt; i++) {
+			n = sscanf(view_opt[i], "%f,%f,%f,%f,%f,%f,%f", v, v + 1, v + 2, v + 3, v + 4,
+					v + 5, v + 6);
+			if(n < 6) {
+				fprintf(stderr, "-v must be followed by X,Y,Z,TX,TY,TZ[,FOV]\n");
+				return -1;
+			}
+			if(csg_add_view(0, v[0], v[1], v[2], v[3], v[4], v[5], n > 6 ? v[6] : fov) == -1) {
+				return -1;
+			}
+		}
+		csg_use_view(0);
+	}
 
-		if(r > 255) r = 255;
-		if(g > 255) g = 255;
-		if(b > 255) b = 255;
+	if(turntable) {
+		csg_get_view_position(pos);
+		csg_get_view_target(targ);
+		fov = csg_get_fov();
 
-		fputc(r, fp);
-		fputc(g, fp);
-		fputc(b, fp);
+		csg_clear_views();
+		if(csg_add_orbit(0, pos[0], pos[1], pos[2], targ[0], targ[1], targ[2], fov,
+					turntable, turn_deg) == -1) {
+			return -1;
+		}
 	}
-	fclose(fp);
 	return 0;
 }
 
+/* Each view of a batch goes to its own file. A run of # in the output filename
+ * is replaced by the zero-padded view number, otherwise the view name or number
+ * is added before the suffix: output_front.ppm, output_0001.ppm.
+ * Returns out_fname itself for a single view without #.
+ */
+static char *view_fname(int idx)
+{
+	int len, width;
+	char *fname, *hash, *suffix, id[32];
+	const char *name;
+
+	if(!(hash = strchr(out_fname, '#')) && csg_num_views() <= 1) {
+		return (char*)out_fname;
+	}
+
+	if(!(name = csg_view_name(idx))) {
+		sprintf(id, "%04d", idx);
+		name = id;
+	}
+	len = strlen(out_fname) + strlen(name) + 32;
+
+	if(!(fname = malloc(len))) {
+		perror("failed to allocate output filename");
+		return 0;
+	}
+
+	if(hash) {
+		width = strspn(hash, "#");
+		sprintf(fname, "%.*s%0*d%s", (int)(hash - out_fname), out_fname, width, idx,
+				hash + width);
+	} else {
+		if(!(suffix = strrchr(out_fname, '.')) || strpbrk(suffix, "/\\")) {
+			suffix = (char*)out_fname + strlen(out_fname);
+		}
+		sprintf(fname, "%.*s_%s%s", (int)(suffix - out_fname), out_fname, name, suffix);
+	}
+	return fname;
+}
+
+static void print_stats(void)
+{
+	struct csg_stats st;
+	unsigned long long nrays;
+
+	csg_get_stats(&st);
+	nrays = st.primary_rays + st.shadow_rays + st.gi_rays;
+
+	printf("Render statistics:\n");
+	printf("  primary rays: %llu\n", st.primary_rays);
+	printf("  shadow rays: %llu\n", st.shadow_rays);
+	printf("  GI rays: %llu\n", st.gi_rays);
+	printf("  primitive tests: %llu (%.2f per ray)\n", st.prim_tests,
+			nrays ? (double)st.prim_tests / nrays : 0.0);
+	printf("  CSG nodes visited: %llu (%.2f per ray)\n", st.csg_nodes,
+			nrays ? (double)st.csg_nodes / nrays : 0.0);
+	printf("  intervals allocated: %llu\n", st.intervals);
+	printf("  max CSG depth: %d\n", st.max_csg_depth);
+	printf("  shader calls: %llu\n", st.shader_calls);
+	printf("  light samples: %llu\n", st.light_samples);
+}
+
 static void print_usage(const char *argv0)
 {
 	printf("Usage: %s [options] <csg file>\n", argv0);
+	printf("       %s --compile [-o <file>] <csg file>\n", argv0);
+	printf("       %s --server | --listen <socket>\n", argv0);
 	printf("Options:\n");
 	printf(" -s <WxH>   output image resolution (default: %dx%d)\n", DFL_WIDTH, DFL_HEIGHT);
 	printf(" -g <gamma> set output gamma (default: %g)\n", DFL_GAMMA);
 	printf(" -o <file>  output image file (default: %s)\n", DFL_OUTFILE);
+	printf("            with several views, a run of # in the name is replaced by the\n");
+	printf("            view number, or the view name or number is added to it\n");
+	printf(" -v <X,Y,Z,TX,TY,TZ[,FOV]>\n");
+	printf("            render from this view instead of the scene's. Repeat to\n");
+	printf("            render several views of the scene in one run\n");
+	printf(" --turntable <frames>[:<degrees>]\n");
+	printf("            render frames views orbiting the scene target (default: 360 deg)\n");
+	printf(" --stats    print render statistics\n");
+	printf(" --wavefront\n");
+	printf("            render with the wavefront integrator\n");
+	printf(" --compile  write a compiled binary scene file instead of rendering\n");
+	printf("            (default output file: the scene name with a %s suffix)\n", COMPILED_SUFFIX);
+	printf(" --server   serve render jobs from stdin (see README.md)\n");
+	printf(" --listen <socket>\n");
+	printf("            serve render jobs from a unix domain socket\n");
+#ifdef CSG_TRACE
+	printf(" -t <file>  write a chrome trace (JSON) of the render timeline\n");
+#endif
 	printf(" -h         print usage information and exit\n");
 }
 
@@ -129,6 +319,24 @@ static int parse_opt(int argc, char **argv)
 					out_fname = argv[++i];
 					break;
 
+				case 'v':
+					if(!argv[++i]) {
+						fprintf(stderr, "-v must be followed by X,Y,Z,TX,TY,TZ[,FOV]\n");
+						return -1;
+					}
+					if(!view_opt && !(view_opt = malloc(argc * sizeof *view_opt))) {
+						perror("failed to allocate view list");
+						return -1;
+					}
+					view_opt[num_view_opt++] = argv[i];
+					break;
+
+#ifdef CSG_TRACE
+				case 't':
+					trace_fname = argv[++i];
+					break;
+#endif
+
 				case 'h':
 					print_usage(argv[0]);
 					exit(0);
@@ -137,6 +345,27 @@ static int parse_opt(int argc, char **argv)
 					fprintf(stderr, "invalid option: %s\n", argv[i]);
 					return -1;
 				}
+			} else if(strcmp(argv[i], "--stats") == 0) {
+				show_stats = 1;
+			} else if(strcmp(argv[i], "--compile") == 0) {
+				compile = 1;
+			} else if(strcmp(argv[i], "--wavefront") == 0) {
+				wavefront = 1;
+			} else if(strcmp(argv[i], "--turntable") == 0) {
+				if(!argv[++i] || sscanf(argv[i], "%d:%f", &turntable, &turn_deg) < 1 ||
+						turntable < 1) {
+					fprintf(stderr, "--turntable must be followed by a number of frames\n");
+					return -1;
+				}
+			} else if(strcmp(argv[i], "--server") == 0) {
+				server = 1;
+			} else if(strcmp(argv[i], "--listen") == 0) {
+				if(!argv[++i]) {
+					fprintf(stderr, "--listen must be followed by a socket path\n");
+					return -1;
+				}
+				sock_path = argv[i];
+				server = 1;
 			} else {
 				fprintf(stderr, "invalid option: %s\n", argv[i]);
 				return -1;
@@ -150,10 +379,13 @@ static int parse_opt(int argc, char **argv)
 		}
 	}
 
-	if(!in_fname) {
+	if(!in_fname && !server) {
 		fprintf(stderr, "you need to pass a scene file to read\n");
 		return -1;
 	}
+	if(!out_fname && !compile) {
+		out_fname = DFL_OUTFILE;
+	}
 
 	return 0;
 }
@@ -0,0 +1,220 @@
+/*
+csgray - simple CSG raytracer
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stddef.h>
+#include "material.h"
+
+#define LUMINANCE(r, g, b)	((r) * 0.299f + (g) * 0.587f + (b) * 0.114f)
+#define SHININESS(r)	(pow((2.0 - r), 11.0))
+
+/* anonymous materials are looked up by their properties */
+#define HASH_SIZE		4096
+
+static unsigned int hash_material(const struct material *m);
+static void unlink_material(struct material *m);
+
+static struct material *mtlhash[HASH_SIZE];	/* anonymous materials */
+
+
+void mtl_defaults(struct material *m)
+{
+	memset(m, 0, sizeof *m);
+	m->r = m->g = m->b = 1.0f;
+	m->roughness = 1.0f;
+	m->opacity = 1.0f;
+	calc_material(m);
+}
+
+void calc_material(struct material *m)
+{
+	m->emissive = m->emr > 0.0f || m->emg > 0.0f || m->emb > 0.0f;
+	m->gloss = 1.0f - m->roughness;
+	m->shininess = SHININESS(m->roughness);
+
+	m->lum = LUMINANCE(m->r, m->g, m->b);
+	m->inv_lum = m->lum != 0.0f ? 1.0f / m->lum : 0.0f;
+	m->diff_tint[0] = m->r * m->inv_lum;
+	m->diff_tint[1] = m->g * m->inv_lum;
+	m->diff_tint[2] = m->b * m->inv_lum;
+
+	if(m->metallic) {
+		m->spec_weight = m->lum;
+		m->spec_tint[0] = m->r;
+		m->spec_tint[1] = m->g;
+		m->spec_tint[2] = m->b;
+		memcpy(m->spec_gi_tint, m->diff_tint, sizeof m->spec_gi_tint);
+	} else {
+		m->spec_weight = 1.0f;
+		m->spec_tint[0] = m->spec_tint[1] = m->spec_tint[2] = 1.0f;
+		m->spec_gi_tint[0] = m->spec_gi_tint[1] = m->spec_gi_tint[2] = 1.0f;
+	}
+}
+
+int same_material(const struct material *a, const struct material *b)
+{
+	return a == b || (a->r == b->r && a->g == b->g && a->b == b->b &&
+		a->emr == b->emr && a->emg == b->emg && a->emb == b->emb &&
+		a->roughness == b->roughness && a->opacity == b->opacity &&
+		a->metallic == b->metallic);
+}
+
+struct material *mtl_share(struct material *m)
+{
+	unsigned int h;
+	struct material *res;
+
+	if(m->flags & MTL_SHARED) {
+		mtl_ref(m);
+		return m;
+	}
+
+	h = hash_material(m);
+
+#pragma omp critical(mtl)
+	{
+		res = mtlhash[h];
+		while(res && !same_material(res, m)) {
+			res = res->hnext;
+		}
+		if(res) {
+			res->nref++;
+		} else if((res = mtl_private(m))) {
+			res->flags |= MTL_SHARED;
+			res->hnext = mtlhash[h];
+			mtlhash[h] = res;
+		}
+	}
+	return res;
+}
+
+struct material *mtl_private(const struct material *m)
+{
+	struct material *res;
+
+	if(!(res = malloc(sizeof *res))) {
+		perror("failed to allocate material");
+		return 0;
+	}
+	*res = *m;
+	res->name = 0;
+	res->flags = 0;
+	res->nref = 1;
+	res->next = res->hnext = 0;
+	return res;
+}
+
+struct material *mtl_create(struct material **list, const char *name, const struct material *m)
+{
+	struct material *res;
+
+	if(mtl_find(*list, name)) {
+		fprintf(stderr, "duplicate material: %s\n", name);
+		return 0;
+	}
+	if(!(res = mtl_private(m))) {
+		return 0;
+	}
+	if(!(res->name = malloc(strlen(name) + 1))) {
+		perror("failed to allocate material name");
+		free(res);
+		return 0;
+	}
+	strcpy(res->name, name);
+
+	res->flags |= MTL_SHARED;
+	res->next = *list;
+	*list = res;
+	return res;
+}
+
+struct material *mtl_find(struct material *list, const char *name)
+{
+	struct material *m = list;
+	while(m) {
+		if(strcmp(m->name, name) == 0) {
+			return m;
+		}
+		m = m->next;
+	}
+	return 0;
+}
+
+void mtl_ref(struct material *m)
+{
+#pragma omp critical(mtl)
+	m->nref++;
+}
+
+void mtl_release(struct material *m)
+{
+	int unused;
+
+	if(!m) return;
+
+#pragma omp critical(mtl)
+	{
+		if((unused = --m->nref <= 0 && !m->name) && (m->flags & MTL_SHARED)) {
+			unlink_material(m);
+		}
+	}
+	if(unused) {
+		free(m);
+	}
+}
+
+void mtl_free_list(struct material *list)
+{
+	struct material *m;
+
+	while(list) {
+		m = list;
+		list = list->next;
+		free(m->name);
+		free(m);
+	}
+}
+
+/* FNV-1a over the properties, from r to metallic */
+static unsigned int hash_material(const struct material *m)
+{
+	int i;
+	unsigned int h = 2166136261u;
+	const unsigned char *p = (const unsigned char*)&m->r;
+	int size = offsetof(struct material, metallic) + sizeof m->metallic - offsetof(struct material, r);
+
+	for(i=0; i<size; i++) {
+		h = (h ^ p[i]) * 16777619u;
+	}
+	return h % HASH_SIZE;
+}
+
+static void unlink_material(struct material *m)
+{
+	struct material **prev = mtlhash + hash_material(m);
+
+	while(*prev) {
+		if(*prev == m) {
+			*prev = m->hnext;
+			break;
+		}
+		prev = &(*prev)->hnext;
+	}
+}
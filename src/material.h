@@ -0,0 +1,57 @@
+/*
+csgray - simple CSG raytracer
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef MATERIAL_H_
+#define MATERIAL_H_
+
+#include "csgimpl.h"
+
+/* Named materials are defined by scene files, and kept in a list per rendering
+ * context. Anonymous materials are shared by all contexts through the material
+ * table, which holds one copy of each distinct material, and are freed when
+ * their last user releases them. The table and the reference counts are
+ * locked, so that contexts can build their scenes concurrently.
+ */
+
+/* sets the default properties: white, fully rough and opaque */
+void mtl_defaults(struct material *m);
+/* recalculates the shading constants, after changing the properties */
+void calc_material(struct material *m);
+/* do a and b have the same properties? */
+int same_material(const struct material *a, const struct material *b);
+
+/* Returns a reference to the shared material with the properties of m, which
+ * is m itself if it's already shared or named, adding a copy of m to the table
+ * if there isn't one yet. Returns null on failure.
+ */
+struct material *mtl_share(struct material *m);
+/* returns a private copy of m, which isn't in the table, or null on failure */
+struct material *mtl_private(const struct material *m);
+/* adds a copy of m to the list of named materials under name, returning a
+ * reference to it, or null if the name is taken or on failure
+ */
+struct material *mtl_create(struct material **list, const char *name, const struct material *m);
+struct material *mtl_find(struct material *list, const char *name);
+
+void mtl_ref(struct material *m);
+/* drops a reference, freeing private materials and unused anonymous ones */
+void mtl_release(struct material *m);
+
+/* frees every material in a list of named materials */
+void mtl_free_list(struct material *list);
+
+#endif	/* MATERIAL_H_ */
@@ -0,0 +1,528 @@
+/*
+csgray - simple CSG raytracer
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include "optimize.h"
+#include "material.h"
+#include "geom.h"
+
+struct objarr {
+	csg_object **items;
+	int count, max;
+};
+
+static csg_object *opt_union(csg_object *o);
+static csg_object *opt_sub(csg_object *o);
+static csg_object *opt_isect(csg_object *o);
+static csg_object *finish(csg_object *o, struct objarr *arr);
+static int collect(struct objarr *arr, csg_object *o, int type);
+static void collect_flat(struct objarr *arr, csg_object *o, int type);
+static void hoist_union(struct objarr *arr);
+static int hoist_isect(struct objarr *arr);
+static csg_object *take_rest(csg_object *o);
+static csg_object *new_csg(int type);
+static void add_operand(csg_object *op, csg_object *o);
+static void set_operands(csg_object *o, struct objarr *arr);
+static csg_object *collapse(csg_object *node, csg_object *res);
+static void free_node(csg_object *o);
+static void free_items(struct objarr *arr);
+static void push(struct objarr *arr, csg_object *o);
+static void remove_item(struct objarr *arr, int idx);
+static int overlap(csg_object *a, csg_object *b);
+static int same_object(csg_object *a, csg_object *b);
+
+
+csg_object *optimize_object(csg_object *o)
+{
+	switch(o->ob.type) {
+	case OB_UNION:
+		return opt_union(o);
+	case OB_SUBTRACTION:
+		return opt_sub(o);
+	case OB_INTERSECTION:
+		return opt_isect(o);
+	default:
+		break;
+	}
+
+	calc_bounds(o);
+	return o;
+}
+
+static csg_object *opt_union(csg_object *o)
+{
+	int i;
+	struct objarr arr = {0};
+
+	for(i=0; i<o->csg.num_sub; i++) {
+		collect(&arr, o->csg.sub[i], OB_UNION);
+	}
+	o->csg.num_sub = 0;
+
+	hoist_union(&arr);
+	return finish(o, &arr);
+}
+
+/* A - b1 - b2 - ... - bn becomes a single subtraction of all the bi */
+static csg_object *opt_sub(csg_object *o)
+{
+	int i;
+	struct objarr arr = {0};
+	csg_object *a, *next;
+
+	a = o;
+	while(a && a->ob.type == OB_SUBTRACTION) {
+		next = a->csg.num_sub ? a->csg.sub[0] : 0;
+		for(i=1; i<a->csg.num_sub; i++) {
+			collect(&arr, a->csg.sub[i], OB_UNION);
+		}
+		a->csg.num_sub = 0;
+		if(a != o) {
+			free_node(a);
+		}
+		a = next;
+	}
+
+	if(a && (a = optimize_object(a)) && a->ob.type == OB_SUBTRACTION) {
+		/* hoisting can turn the base into a subtraction */
+		for(i=1; i<a->csg.num_sub; i++) {
+			collect_flat(&arr, a->csg.sub[i], OB_UNION);
+		}
+		next = a->csg.sub[0];
+		free_node(a);
+		a = next;
+	}
+
+	if(!a) {
+		free_items(&arr);
+		return collapse(o, 0);
+	}
+
+	/* drop everything which can't cut into A */
+	for(i=0; i<arr.count; i++) {
+		if(!overlap(a, arr.items[i])) {
+			csg_free_object(arr.items[i]);
+			remove_item(&arr, i--);
+		}
+	}
+
+	if(!arr.count) {
+		free(arr.items);
+		return collapse(o, a);
+	}
+
+	push(&arr, a);
+	arr.items[arr.count - 1] = arr.items[0];
+	arr.items[0] = a;
+	set_operands(o, &arr);
+	return o;
+}
+
+static csg_object *opt_isect(csg_object *o)
+{
+	int i, j, empty = 0;
+	struct objarr arr = {0};
+	float bmin[3], bmax[3];
+	csg_object *sub;
+
+	for(i=0; i<o->csg.num_sub; i++) {
+		if(collect(&arr, o->csg.sub[i], OB_INTERSECTION) == -1) {
+			empty = 1;
+		}
+	}
+	o->csg.num_sub = 0;
+
+	if(!empty && hoist_isect(&arr) == -1) {
+		empty = 1;
+	}
+
+	/* disjoint operands can't have anything in common */
+	for(i=0; i<3; i++) {
+		bmin[i] = -FLT_MAX;
+		bmax[i] = FLT_MAX;
+	}
+	for(j=0; j<arr.count; j++) {
+		sub = arr.items[j];
+		for(i=0; i<3; i++) {
+			if(sub->ob.bmin[i] > bmin[i]) bmin[i] = sub->ob.bmin[i];
+			if(sub->ob.bmax[i] < bmax[i]) bmax[i] = sub->ob.bmax[i];
+			if(bmin[i] > bmax[i]) {
+				empty = 1;
+			}
+		}
+	}
+
+	if(empty) {
+		free_items(&arr);
+		return collapse(o, 0);
+	}
+	return finish(o, &arr);
+}
+
+/* makes the collected operands the operands of o */
+static csg_object *finish(csg_object *o, struct objarr *arr)
+{
+	csg_object *res;
+
+	if(arr->count < 2) {
+		res = arr->count ? arr->items[0] : 0;
+		free(arr->items);
+		return collapse(o, res);
+	}
+	set_operands(o, arr);
+	return o;
+}
+
+/* Gathers the optimized operands of o, flattening operations of the given
+ * type, and freeing their nodes. Returns -1 if any operand turned out empty.
+ */
+static int collect(struct objarr *arr, csg_object *o, int type)
+{
+	int i, res = 0;
+
+	if(o->ob.type == type) {
+		for(i=0; i<o->csg.num_sub; i++) {
+			if(collect(arr, o->csg.sub[i], type) == -1) {
+				res = -1;
+			}
+		}
+		free_node(o);
+		return res;
+	}
+
+	if(!(o = optimize_object(o))) {
+		return -1;
+	}
+	collect_flat(arr, o, type);
+	return 0;
+}
+
+/* same as collect, for trees which are already optimized */
+static void collect_flat(struct objarr *arr, csg_object *o, int type)
+{
+	int i;
+
+	if(o->ob.type == type) {
+		for(i=0; i<o->csg.num_sub; i++) {
+			collect_flat(arr, o->csg.sub[i], type);
+		}
+		free_node(o);
+		return;
+	}
+	push(arr, o);
+}
+
+/* (A & b) | (A & c) = A & (b | c)
+ * (A - b) | (A - c) = A - (b & c)
+ * where b and c stand for all the other operands of either side
+ */
+static void hoist_union(struct objarr *arr)
+{
+	int i, j;
+	csg_object *p, *q, *rest;
+
+	for(i=0; i<arr->count; i++) {
+		p = arr->items[i];
+		if(p->ob.type != OB_INTERSECTION && p->ob.type != OB_SUBTRACTION) {
+			continue;
+		}
+
+		rest = 0;
+		for(j=i+1; j<arr->count; j++) {
+			q = arr->items[j];
+			if(q->ob.type != p->ob.type || !same_object(p->csg.sub[0], q->csg.sub[0])) {
+				continue;
+			}
+
+			if(!rest) {
+				rest = new_csg(p->ob.type == OB_INTERSECTION ? OB_UNION : OB_INTERSECTION);
+				add_operand(rest, take_rest(p));
+			}
+			add_operand(rest, take_rest(q));
+			csg_free_object(q->csg.sub[0]);
+			free_node(q);
+			remove_item(arr, j--);
+		}
+
+		if(rest) {
+			add_operand(p, rest);
+			remove_item(arr, i--);
+			if((p = optimize_object(p))) {
+				collect_flat(arr, p, OB_UNION);
+			}
+		}
+	}
+}
+
+/* (A - b) & (A - c) = A - b - c
+ * Returns -1 if the result of hoisting turned out empty.
+ */
+static int hoist_isect(struct objarr *arr)
+{
+	int i, j, k, hoisted;
+	csg_object *p, *q;
+
+	for(i=0; i<arr->count; i++) {
+		p = arr->items[i];
+		if(p->ob.type != OB_SUBTRACTION) {
+			continue;
+		}
+
+		hoisted = 0;
+		for(j=i+1; j<arr->count; j++) {
+			q = arr->items[j];
+			if(q->ob.type != OB_SUBTRACTION || !same_object(p->csg.sub[0], q->csg.sub[0])) {
+				continue;
+			}
+
+			for(k=1; k<q->csg.num_sub; k++) {
+				add_operand(p, q->csg.sub[k]);
+			}
+			csg_free_object(q->csg.sub[0]);
+			free_node(q);
+			remove_item(arr, j--);
+			hoisted = 1;
+		}
+
+		if(hoisted) {
+			remove_item(arr, i--);
+			if(!(p = optimize_object(p))) {
+				return -1;
+			}
+			collect_flat(arr, p, OB_INTERSECTION);
+		}
+	}
+	return 0;
+}
+
+/* detaches the operands of o after the first, as a single object */
+static csg_object *take_rest(csg_object *o)
+{
+	int i;
+	csg_object *res;
+
+	if(o->csg.num_sub == 2) {
+		res = o->csg.sub[1];
+	} else {
+		res = new_csg(o->ob.type == OB_INTERSECTION ? OB_INTERSECTION : OB_UNION);
+		for(i=1; i<o->csg.num_sub; i++) {
+			add_operand(res, o->csg.sub[i]);
+		}
+	}
+	o->csg.num_sub = 1;
+	return res;
+}
+
+static csg_object *new_csg(int type)
+{
+	csg_object *o;
+
+	if(type == OB_UNION) {
+		o = csg_union(0, 0);
+	} else {
+		o = csg_intersection(0, 0);
+	}
+	if(!o) {
+		perror("failed to allocate CSG node");
+		abort();
+	}
+	return o;
+}
+
+static void add_operand(csg_object *op, csg_object *o)
+{
+	if(csg_add_operand(op, o) == -1) {
+		abort();
+	}
+}
+
+/* replaces the operands of o with the items of arr, which it takes over */
+static void set_operands(csg_object *o, struct objarr *arr)
+{
+	if(!(o->ob.flags & OBF_ARENA_SUB)) {
+		free(o->csg.sub);
+	}
+	o->ob.flags &= ~OBF_ARENA_SUB;
+
+	o->csg.sub = arr->items;
+	o->csg.num_sub = arr->count;
+	o->csg.max_sub = arr->max;
+	calc_csg_bounds(o);
+}
+
+/* replaces node with res, which might be null for empty results. Reuses node
+ * if res is the same operation, to keep its name.
+ */
+static csg_object *collapse(csg_object *node, csg_object *res)
+{
+	int i;
+
+	if(!res) {
+		free_node(node);
+		return 0;
+	}
+	if(res == node) {
+		return node;
+	}
+
+	if(res->ob.type == node->ob.type) {
+		if(!(node->ob.flags & OBF_ARENA_SUB)) {
+			free(node->csg.sub);
+		}
+		free(node->csg.bvh);
+		node->ob.flags = (node->ob.flags & ~OBF_ARENA_SUB) | (res->ob.flags & OBF_ARENA_SUB);
+
+		node->csg.sub = res->csg.sub;
+		node->csg.num_sub = res->csg.num_sub;
+		node->csg.max_sub = res->csg.max_sub;
+		node->csg.bvh = res->csg.bvh;
+		node->csg.num_bvh = res->csg.num_bvh;
+		node->csg.bvh_start = res->csg.bvh_start;
+		for(i=0; i<3; i++) {
+			node->ob.bmin[i] = res->ob.bmin[i];
+			node->ob.bmax[i] = res->ob.bmax[i];
+		}
+
+		res->csg.sub = 0;
+		res->csg.bvh = 0;
+		res->ob.flags &= ~OBF_ARENA_SUB;
+		free_node(res);
+		return node;
+	}
+
+	if(!res->ob.name) {
+		res->ob.name = node->ob.name;
+		res->ob.flags |= node->ob.flags & OBF_ARENA_NAME;
+		node->ob.name = 0;
+	}
+	free_node(node);
+	return res;
+}
+
+/* frees a single node, without its operands */
+static void free_node(csg_object *o)
+{
+	if(o->ob.type == OB_UNION || o->ob.type == OB_INTERSECTION || o->ob.type == OB_SUBTRACTION) {
+		o->csg.num_sub = 0;
+	}
+	csg_free_object(o);
+}
+
+static void free_items(struct objarr *arr)
+{
+	int i;
+	for(i=0; i<arr->count; i++) {
+		csg_free_object(arr->items[i]);
+	}
+	free(arr->items);
+}
+
+static void push(struct objarr *arr, csg_object *o)
+{
+	if(arr->count >= arr->max) {
+		int newsz = arr->max ? arr->max * 2 : 16;
+		csg_object **tmp;
+
+		if(!(tmp = realloc(arr->items, newsz * sizeof *arr->items))) {
+			perror("failed to resize CSG operand list");
+			abort();
+		}
+		arr->items = tmp;
+		arr->max = newsz;
+	}
+	arr->items[arr->count++] = o;
+}
+
+static void remove_item(struct objarr *arr, int idx)
+{
+	arr->items[idx] = arr->items[--arr->count];
+}
+
+static int overlap(csg_object *a, csg_object *b)
+{
+	int i;
+
+	if(bounds_empty(a) || bounds_empty(b)) {
+		return 0;
+	}
+	for(i=0; i<3; i++) {
+		if(a->ob.bmin[i] > b->ob.bmax[i] || b->ob.bmin[i] > a->ob.bmax[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* identical geometry and materials, so that either can stand for the other */
+static int same_object(csg_object *a, csg_object *b)
+{
+	int i;
+
+	if(a == b) {
+		return 1;
+	}
+	if(a->ob.type != b->ob.type) {
+		return 0;
+	}
+
+	switch(a->ob.type) {
+	case OB_UNION:
+	case OB_INTERSECTION:
+	case OB_SUBTRACTION:
+		/* operation transforms and materials are not used */
+		if(a->csg.num_sub != b->csg.num_sub) {
+			return 0;
+		}
+		for(i=0; i<a->csg.num_sub; i++) {
+			if(!same_object(a->csg.sub[i], b->csg.sub[i])) {
+				return 0;
+			}
+		}
+		return 1;
+
+	default:
+		break;
+	}
+
+	if(memcmp(a->ob.xform, b->ob.xform, sizeof a->ob.xform) != 0 ||
+			memcmp(a->ob.inv_xform, b->ob.inv_xform, sizeof a->ob.inv_xform) != 0) {
+		return 0;
+	}
+	if(!same_material(a->ob.mtl, b->ob.mtl)) {
+		return 0;
+	}
+
+	switch(a->ob.type) {
+	case OB_SPHERE:
+		return a->sph.rad == b->sph.rad;
+	case OB_CYLINDER:
+		return a->cyl.rad == b->cyl.rad && a->cyl.height == b->cyl.height;
+	case OB_PLANE:
+		return a->plane.nx == b->plane.nx && a->plane.ny == b->plane.ny &&
+			a->plane.nz == b->plane.nz && a->plane.d == b->plane.d;
+	case OB_BOX:
+		return a->box.xsz == b->box.xsz && a->box.ysz == b->box.ysz && a->box.zsz == b->box.zsz;
+	case OB_INSTANCE:
+		return a->inst.def == b->inst.def;
+	default:
+		break;
+	}
+	return 1;
+}
@@ -0,0 +1,37 @@
+/*
+csgray - simple CSG raytracer
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef OPTIMIZE_H_
+#define OPTIMIZE_H_
+
+#include "csgimpl.h"
+
+/* Restructures the CSG tree of o to make ray traversal cheaper, without
+ * changing the solid it describes, and calculates the bounds of all its nodes:
+ * - subtraction chains A - b1 - ... - bn become a single subtraction
+ * - nested unions and intersections are flattened into single operations,
+ *   which keep a spatial hierarchy over their operands (see calc_csg_bounds)
+ * - subtrahends and intersections which can't overlap by their bounds are
+ *   dropped
+ * - operands shared by both sides of a union or intersection are hoisted
+ *
+ * Returns the new root of the tree, which might not be o, or null if the whole
+ * object turned out to be empty, in which case it has been freed.
+ */
+csg_object *optimize_object(csg_object *o);
+
+#endif	/* OPTIMIZE_H_ */
@@ -0,0 +1,451 @@
+/*
+csgray - simple CSG raytracer
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/* Render server protocol: jobs are lines of text, and so are the replies.
+ *
+ *   render <scene file> [size=WxH] [samples=N] [gi=DEPTH] [fov=DEG]
+ *          [view=X,Y,Z,TX,TY,TZ] [timeout=SEC] [out=FILE]
+ *
+ * renders the scene from its own viewer, unless view and fov override it,
+ * with the global illumination shader if gi sets its max ray depth, or the
+ * default shader otherwise. The reply is "ok FILE" if the image was written to
+ * out, or "image SIZE" followed by SIZE bytes of binary PPM. With a timeout,
+ * the render stops SEC seconds in, and the image has the samples finished by
+ * then, or the job fails if that's not even the first one.
+ *
+ *   quit
+ *
+ * stops the server, after replying "ok". Failed requests get "error MESSAGE".
+ *
+ * Scenes stay loaded in a rendering context of their own between jobs, with
+ * their acceleration structures built, and are reloaded when their file
+ * changes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#include "csgray.h"
+#include "image.h"
+#include "server.h"
+#include "timer.h"
+
+#define MAX_LINE	4096
+/* scenes kept loaded, the least recently used are dropped */
+#define MAX_SCENES	8
+
+#define DFL_WIDTH	320
+#define DFL_HEIGHT	240
+
+struct scene {
+	char *fname;
+	time_t mtime;
+	off_t size;
+	csg_context *ctx;
+
+	/* the scene's own camera, restored for each job */
+	float vpos[3], vtarg[3];
+	float fov;
+
+	struct scene *next;
+};
+
+struct job {
+	const char *scene;
+	int width, height;
+	int samples;
+	int gi_depth;		/* -1 for the default shader */
+	int has_view;
+	float view[6];		/* position and target */
+	float fov;			/* 0 for the scene's own */
+	float timeout;		/* seconds, 0 for none */
+	const char *out;
+};
+
+static int serve_socket(const char *sock_path);
+static int serve(FILE *in, FILE *out);
+static int parse_job(struct job *job, FILE *out);
+static int run_job(struct job *job, FILE *out);
+static struct scene *get_scene(const char *fname);
+static struct scene *load_scene(const char *fname, struct stat *st);
+static void free_scene(struct scene *scn);
+static void reply_error(FILE *out, const char *fmt, ...);
+static int past_deadline(void *cls);
+
+static float out_inv_gamma;
+static int quit;
+
+static struct scene *cache;		/* most recently used first */
+static float *framebuf;
+static long framebuf_size;
+
+
+int run_server(const char *sock_path, float inv_gamma)
+{
+	int res;
+	struct scene *scn;
+
+	out_inv_gamma = inv_gamma;
+
+	if(sock_path) {
+		res = serve_socket(sock_path);
+	} else {
+		res = serve(stdin, stdout);
+	}
+
+	while(cache) {
+		scn = cache;
+		cache = cache->next;
+		free_scene(scn);
+	}
+	free(framebuf);
+	return res;
+}
+
+static int serve_socket(const char *sock_path)
+{
+#ifdef _WIN32
+	fprintf(stderr, "unix domain sockets aren't supported on this platform\n");
+	return -1;
+#else
+	int s, c;
+	FILE *in, *out;
+	struct sockaddr_un addr;
+
+	if(strlen(sock_path) >= sizeof addr.sun_path) {
+		fprintf(stderr, "socket path too long: %s\n", sock_path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sock_path);
+
+	if((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		perror("failed to create socket");
+		return -1;
+	}
+	unlink(sock_path);
+	if(bind(s, (struct sockaddr*)&addr, sizeof addr) == -1 || listen(s, 16) == -1) {
+		fprintf(stderr, "failed to listen on %s: %s\n", sock_path, strerror(errno));
+		close(s);
+		return -1;
+	}
+	/* clients hanging up are handled by the failed writes */
+	signal(SIGPIPE, SIG_IGN);
+
+	while(!quit) {
+		if((c = accept(s, 0, 0)) == -1) {
+			if(errno == EINTR) continue;
+			perror("accept failed");
+			break;
+		}
+		if(!(in = fdopen(c, "rb"))) {
+			close(c);
+			continue;
+		}
+		if((c = dup(c)) == -1 || !(out = fdopen(c, "wb"))) {
+			if(c != -1) close(c);
+			fclose(in);
+			continue;
+		}
+		serve(in, out);
+		fclose(in);
+		fclose(out);
+	}
+
+	close(s);
+	unlink(sock_path);
+	return quit ? 0 : -1;
+#endif
+}
+
+/* serves the jobs read from in, until the end of the input, quit, or a failure
+ * to reply
+ */
+static int serve(FILE *in, FILE *out)
+{
+	char line[MAX_LINE], *cmd;
+	struct job job;
+
+	while(!quit && fgets(line, sizeof line, in)) {
+		if(!(cmd = strtok(line, " \t\r\n")) || *cmd == '#') {
+			continue;
+		}
+
+		if(strcmp(cmd, "render") == 0) {
+			if(parse_job(&job, out) != -1) {
+				run_job(&job, out);
+			}
+		} else if(strcmp(cmd, "quit") == 0) {
+			fprintf(out, "ok\n");
+			quit = 1;
+		} else {
+			reply_error(out, "unknown command: %s", cmd);
+		}
+
+		if(fflush(out) == EOF || ferror(out)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* parses the rest of the render line, tokenized by strtok */
+static int parse_job(struct job *job, FILE *out)
+{
+	char *arg, *val;
+	float *v;
+
+	memset(job, 0, sizeof *job);
+	job->width = DFL_WIDTH;
+	job->height = DFL_HEIGHT;
+	job->samples = 1;
+	job->gi_depth = -1;
+
+	if(!(job->scene = strtok(0, " \t\r\n"))) {
+		reply_error(out, "render needs a scene file");
+		return -1;
+	}
+
+	while((arg = strtok(0, " \t\r\n"))) {
+		if(!(val = strchr(arg, '='))) {
+			reply_error(out, "invalid argument: %s", arg);
+			return -1;
+		}
+		*val++ = 0;
+
+		if(strcmp(arg, "size") == 0) {
+			if(sscanf(val, "%dx%d", &job->width, &job->height) != 2 ||
+					job->width <= 0 || job->height <= 0) {
+				reply_error(out, "size must be WIDTHxHEIGHT");
+				return -1;
+			}
+		} else if(strcmp(arg, "samples") == 0) {
+			if((job->samples = atoi(val)) <= 0) {
+				reply_error(out, "samples must be positive");
+				return -1;
+			}
+		} else if(strcmp(arg, "gi") == 0) {
+			if(sscanf(val, "%d", &job->gi_depth) != 1 || job->gi_depth < 0) {
+				reply_error(out, "gi must be a max ray depth");
+				return -1;
+			}
+		} else if(strcmp(arg, "fov") == 0) {
+			if((job->fov = atof(val)) <= 0.0f) {
+				reply_error(out, "fov must be positive");
+				return -1;
+			}
+		} else if(strcmp(arg, "view") == 0) {
+			v = job->view;
+			if(sscanf(val, "%f,%f,%f,%f,%f,%f", v, v + 1, v + 2, v + 3, v + 4, v + 5) != 6) {
+				reply_error(out, "view must be X,Y,Z,TX,TY,TZ");
+				return -1;
+			}
+			job->has_view = 1;
+		} else if(strcmp(arg, "timeout") == 0) {
+			if((job->timeout = atof(val)) <= 0.0f) {
+				reply_error(out, "timeout must be positive");
+				return -1;
+			}
+		} else if(strcmp(arg, "out") == 0) {
+			job->out = val;
+		} else {
+			reply_error(out, "unknown argument: %s", arg);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int run_job(struct job *job, FILE *out)
+{
+	int i;
+	struct scene *scn;
+	long size = (long)job->width * job->height * 3;
+	double deadline;
+
+	if(!(scn = get_scene(job->scene))) {
+		reply_error(out, "failed to load %s", job->scene);
+		return -1;
+	}
+
+	if(size > framebuf_size) {
+		free(framebuf);
+		if(!(framebuf = malloc(size * sizeof *framebuf))) {
+			framebuf_size = 0;
+			reply_error(out, "failed to allocate a %dx%d framebuffer", job->width, job->height);
+			return -1;
+		}
+		framebuf_size = size;
+	}
+
+	csg_make_current(scn->ctx);
+
+	if(job->has_view) {
+		float *v = job->view;
+		csg_view(v[0], v[1], v[2], v[3], v[4], v[5]);
+	} else {
+		csg_view(scn->vpos[0], scn->vpos[1], scn->vpos[2], scn->vtarg[0], scn->vtarg[1], scn->vtarg[2]);
+	}
+	csg_fov(job->fov > 0.0f ? job->fov : scn->fov);
+
+	if(job->gi_depth >= 0) {
+		csg_shader(CSG_GI_SHADER, 0);
+		csg_option(CSG_OPT_MAX_ITER, job->gi_depth);
+	} else {
+		csg_shader(CSG_DEFAULT_SHADER, 0);
+	}
+
+	if(job->timeout > 0.0f) {
+		deadline = get_time_nsec() + job->timeout * 1e9;
+		csg_abort_func(past_deadline, &deadline);
+	}
+
+	/* the rows an aborted sample finished are still a valid average */
+	for(i=0; i<job->samples; i++) {
+		if(csg_render_image(framebuf, job->width, job->height, i) == -1) {
+			break;
+		}
+	}
+
+	csg_abort_func(0, 0);
+	csg_make_current(0);
+
+	if(i == 0) {
+		reply_error(out, "timed out before the first sample");
+		return -1;
+	}
+
+	if(job->out) {
+		if(save_ppm(job->out, framebuf, job->width, job->height, out_inv_gamma) == -1) {
+			reply_error(out, "failed to write %s", job->out);
+			return -1;
+		}
+		fprintf(out, "ok %s\n", job->out);
+	} else {
+		fprintf(out, "image %ld\n", ppm_size(job->width, job->height));
+		write_ppm(out, framebuf, job->width, job->height, out_inv_gamma);
+	}
+	return 0;
+}
+
+/* Returns the scene loaded from fname, from the cache unless the file changed
+ * since it was loaded, and moves it to the front of the cache.
+ */
+static struct scene *get_scene(const char *fname)
+{
+	int i;
+	struct stat st;
+	struct scene *scn, **prev = &cache;
+
+	if(stat(fname, &st) == -1) {
+		fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+		return 0;
+	}
+
+	while((scn = *prev)) {
+		if(strcmp(scn->fname, fname) == 0) {
+			*prev = scn->next;
+			if(scn->mtime != st.st_mtime || scn->size != st.st_size) {
+				free_scene(scn);
+				scn = 0;
+			}
+			break;
+		}
+		prev = &scn->next;
+	}
+
+	if(!scn && !(scn = load_scene(fname, &st))) {
+		return 0;
+	}
+	scn->next = cache;
+	cache = scn;
+
+	prev = &cache;
+	for(i=0; *prev && i<MAX_SCENES; i++) {
+		prev = &(*prev)->next;
+	}
+	while(*prev) {
+		struct scene *lru = *prev;
+		*prev = lru->next;
+		free_scene(lru);
+	}
+	return scn;
+}
+
+static struct scene *load_scene(const char *fname, struct stat *st)
+{
+	struct scene *scn;
+
+	if(!(scn = calloc(1, sizeof *scn)) || !(scn->fname = malloc(strlen(fname) + 1))) {
+		perror("failed to allocate scene");
+		free(scn);
+		return 0;
+	}
+	strcpy(scn->fname, fname);
+	scn->mtime = st->st_mtime;
+	scn->size = st->st_size;
+
+	if(!(scn->ctx = csg_create_context())) {
+		goto err;
+	}
+	csg_make_current(scn->ctx);
+	if(csg_load(fname) == -1) {
+		csg_make_current(0);
+		goto err;
+	}
+	csg_get_view_position(scn->vpos);
+	csg_get_view_target(scn->vtarg);
+	scn->fov = csg_get_fov();
+	csg_make_current(0);
+	return scn;
+
+err:
+	free_scene(scn);
+	return 0;
+}
+
+static void free_scene(struct scene *scn)
+{
+	csg_free_context(scn->ctx);
+	free(scn->fname);
+	free(scn);
+}
+
+static void reply_error(FILE *out, const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(out, "error ");
+	va_start(ap, fmt);
+	vfprintf(out, fmt, ap);
+	va_end(ap);
+	fputc('\n', out);
+}
+
+static int past_deadline(void *cls)
+{
+	return get_time_nsec() >= *(double*)cls;
+}
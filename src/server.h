@@ -0,0 +1,27 @@
+/*
+csgray - simple CSG raytracer
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef SERVER_H_
+#define SERVER_H_
+
+/* Serves render jobs until it's told to quit, from stdin with the replies on
+ * stdout, or from the clients of the unix domain socket sock_path, one at a
+ * time, if it's not null. See server.c for the protocol.
+ */
+int run_server(const char *sock_path, float inv_gamma);
+
+#endif	/* SERVER_H_ */
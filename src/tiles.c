@@ -0,0 +1,216 @@
+/*
+csgray - simple CSG raytracer
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include "tiles.h"
+#include "matrix.h"
+
+/* corners nearer to the camera plane than this can't be projected */
+#define NEAR_Z	1e-4f
+
+struct proj {
+	float inv[16];			/* world to camera */
+	float xscale, yscale;	/* camera plane to pixels */
+	float xmargin, ymargin;	/* pixels */
+	int width, height;
+};
+
+static int project_bounds(const struct proj *pj, const struct cnode *n, int *rect);
+
+
+/* Tiles are counted first and then filled in, so that the lists of all of them
+ * fit in one array, in the order of the root list.
+ */
+int build_screen_tiles(struct screen_tiles *st, const struct cscene *sc, float *cam_xform,
+		float fov, int width, int height)
+{
+	int i, tx, ty, ntiles, total, *rects, *r;
+	float aspect = (float)width / (float)height;
+	struct proj pj;
+
+	st->valid = 0;
+
+	mat4_copy(pj.inv, cam_xform);
+	mat4_inverse(pj.inv);
+	/* csg_render_pixel maps the image to [-aspect, aspect] x [-1, 1] at a
+	 * distance of 1 / tan(fov / 2) from the camera
+	 */
+	pj.xscale = 0.5f * width / (aspect * tan(fov * 0.5f));
+	pj.yscale = 0.5f * height / tan(fov * 0.5f);
+	/* antialiasing jitters the rays by up to half a pixel width of the
+	 * [-1, 1] range, on top of rounding
+	 */
+	pj.xmargin = 1.0f + 0.25f / aspect;
+	pj.ymargin = 1.25f;
+	pj.width = width;
+	pj.height = height;
+
+	st->xtiles = (width + TILE_SIZE - 1) / TILE_SIZE;
+	st->ytiles = (height + TILE_SIZE - 1) / TILE_SIZE;
+	ntiles = st->xtiles * st->ytiles;
+
+	if(!(rects = malloc(sc->num_roots * 4 * sizeof *rects + 1))) {
+		perror("failed to allocate screen tile bounds");
+		return -1;
+	}
+	free(st->start);
+	if(!(st->start = calloc(ntiles + 1, sizeof *st->start))) {
+		perror("failed to allocate screen tiles");
+		free(rects);
+		return -1;
+	}
+
+	total = 0;
+	r = rects;
+	for(i=0; i<sc->num_roots; i++) {
+		if(project_bounds(&pj, sc->nodes + sc->roots[i], r) != -1) {
+			for(ty=r[2]; ty<=r[3]; ty++) {
+				for(tx=r[0]; tx<=r[1]; tx++) {
+					st->start[ty * st->xtiles + tx + 1]++;
+				}
+			}
+			total += (r[1] - r[0] + 1) * (r[3] - r[2] + 1);
+		}
+		r += 4;
+	}
+
+	if(total > st->max_nodes) {
+		free(st->nodes);
+		if(!(st->nodes = malloc(total * sizeof *st->nodes))) {
+			perror("failed to allocate screen tile lists");
+			st->max_nodes = 0;
+			free(rects);
+			return -1;
+		}
+		st->max_nodes = total;
+	}
+
+	for(i=0; i<ntiles; i++) {
+		st->start[i + 1] += st->start[i];
+	}
+
+	/* advances the start of every tile to its end, which is where the next
+	 * one starts, so they're moved back up afterwards
+	 */
+	r = rects;
+	for(i=0; i<sc->num_roots; i++) {
+		if(r[0] <= r[1]) {
+			for(ty=r[2]; ty<=r[3]; ty++) {
+				for(tx=r[0]; tx<=r[1]; tx++) {
+					st->nodes[st->start[ty * st->xtiles + tx]++] = sc->roots[i];
+				}
+			}
+		}
+		r += 4;
+	}
+	for(i=ntiles; i>0; i--) {
+		st->start[i] = st->start[i - 1];
+	}
+	st->start[0] = 0;
+
+	free(rects);
+
+	st->width = width;
+	st->height = height;
+	st->valid = 1;
+	return 0;
+}
+
+void free_screen_tiles(struct screen_tiles *st)
+{
+	free(st->start);
+	free(st->nodes);
+	memset(st, 0, sizeof *st);
+}
+
+/* Calculates the range of tiles the bounds of n project onto, as the first and
+ * last tile column and row. Returns -1, with an empty range, if it's outside
+ * the image or behind the camera.
+ */
+static int project_bounds(const struct proj *pj, const struct cnode *n, int *rect)
+{
+	int i, front = 0, behind = 0;
+	float p[3], pc[3], x, y, inv_z;
+	float xmin = FLT_MAX, ymin = FLT_MAX, xmax = -FLT_MAX, ymax = -FLT_MAX;
+
+	for(i=0; i<3; i++) {
+		if(n->bmin[i] > n->bmax[i] || n->bmin[i] <= -FLT_MAX || n->bmax[i] >= FLT_MAX) {
+			goto everywhere;
+		}
+	}
+
+	for(i=0; i<8; i++) {
+		p[0] = i & 1 ? n->bmax[0] : n->bmin[0];
+		p[1] = i & 2 ? n->bmax[1] : n->bmin[1];
+		p[2] = i & 4 ? n->bmax[2] : n->bmin[2];
+		mat4_xform3(pc, (float*)pj->inv, p);
+
+		/* the camera looks down -Z */
+		if(pc[2] >= 0.0f) {
+			behind++;
+			continue;
+		}
+		if(pc[2] > -NEAR_Z) {
+			goto everywhere;
+		}
+		front++;
+
+		inv_z = -1.0f / pc[2];
+		x = 0.5f * pj->width + pc[0] * inv_z * pj->xscale;
+		y = 0.5f * pj->height - pc[1] * inv_z * pj->yscale;
+		if(x < xmin) xmin = x;
+		if(x > xmax) xmax = x;
+		if(y < ymin) ymin = y;
+		if(y > ymax) ymax = y;
+	}
+
+	if(!front) {
+		goto nowhere;
+	}
+	if(behind) {
+		goto everywhere;
+	}
+
+	xmin -= pj->xmargin;
+	xmax += pj->xmargin;
+	ymin -= pj->ymargin;
+	ymax += pj->ymargin;
+	if(xmax < 0.0f || ymax < 0.0f || xmin >= pj->width || ymin >= pj->height) {
+		goto nowhere;
+	}
+
+	rect[0] = xmin < 0.0f ? 0 : (int)xmin / TILE_SIZE;
+	rect[1] = (xmax >= pj->width ? pj->width - 1 : (int)xmax) / TILE_SIZE;
+	rect[2] = ymin < 0.0f ? 0 : (int)ymin / TILE_SIZE;
+	rect[3] = (ymax >= pj->height ? pj->height - 1 : (int)ymax) / TILE_SIZE;
+	return 0;
+
+everywhere:
+	rect[0] = rect[2] = 0;
+	rect[1] = (pj->width - 1) / TILE_SIZE;
+	rect[3] = (pj->height - 1) / TILE_SIZE;
+	return 0;
+
+nowhere:
+	rect[0] = rect[2] = 1;
+	rect[1] = rect[3] = 0;
+	return -1;
+}
@@ -0,0 +1,56 @@
+/*
+csgray - simple CSG raytracer
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef TILES_H_
+#define TILES_H_
+
+#include "cscene.h"
+
+/* tile width and height in pixels, a multiple of the packet dimensions */
+#define TILE_SIZE	16
+
+/* The image is split into square tiles, each with the list of top-level
+ * objects whose bounds project onto it, so that primary rays only test the
+ * objects which can appear in their tile. Objects entirely behind the camera
+ * appear in no tile, and those crossing the camera plane, or unbounded, in
+ * every one.
+ */
+struct screen_tiles {
+	int valid;
+	int width, height;		/* image size the tiles were built for */
+	int xtiles, ytiles;
+	int *start;				/* first entry of each tile in nodes, and one past the last */
+	int *nodes;				/* root node indices, in the order of the root list */
+	int max_nodes;
+};
+
+/* Builds the tiles of a width x height image of the compiled scene, seen
+ * through the camera transformation cam_xform (camera to world) and the
+ * vertical field of view fov (radians). Returns -1 on failure, leaving the
+ * tiles invalid.
+ */
+int build_screen_tiles(struct screen_tiles *st, const struct cscene *sc, float *cam_xform,
+		float fov, int width, int height);
+void free_screen_tiles(struct screen_tiles *st);
+
+/* the first candidate node of the tile of pixel x, y, and how many there are */
+#define TILE_INDEX(st, x, y)	((y) / TILE_SIZE * (st)->xtiles + (x) / TILE_SIZE)
+#define TILE_NODES(st, x, y)	((st)->nodes + (st)->start[TILE_INDEX(st, x, y)])
+#define TILE_COUNT(st, x, y)	\
+	((st)->start[TILE_INDEX(st, x, y) + 1] - (st)->start[TILE_INDEX(st, x, y)])
+
+#endif	/* TILES_H_ */
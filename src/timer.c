@@ -0,0 +1,23 @@
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include "timer.h"
+
+double get_time_nsec(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER cnt;
+
+	if(!freq.QuadPart) {
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&cnt);
+	return (double)cnt.QuadPart * 1e9 / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+#endif
+}
@@ -0,0 +1,7 @@
+#ifndef TIMER_H_
+#define TIMER_H_
+
+/* monotonic time in nanoseconds, from an arbitrary starting point */
+double get_time_nsec(void);
+
+#endif	/* TIMER_H_ */
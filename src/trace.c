@@ -0,0 +1,139 @@
+/*
+csgray - simple CSG raytracer
+Copyright (C) 2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "csgray.h"
+
+#ifdef CSG_TRACE
+#include "timer.h"
+
+struct trace_event {
+	const char *name;
+	char phase;		/* 'B' or 'E' */
+	int tid;
+	int arg;
+	double usec;
+};
+
+static FILE *trace_fp;
+static double trace_start;
+static struct trace_event *events;
+static int num_events, max_events;
+static int num_threads;
+
+/* small sequential thread ids, assigned on first use */
+static int trace_tid = -1;
+#pragma omp threadprivate(trace_tid)
+
+static void add_event(const char *name, char phase, int arg);
+
+int csg_trace_open(const char *fname)
+{
+	if(trace_fp) {
+		csg_trace_close();
+	}
+
+	if(!(trace_fp = fopen(fname, "wb"))) {
+		fprintf(stderr, "failed to open trace file %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	trace_start = get_time_nsec();
+	num_events = 0;
+	return 0;
+}
+
+void csg_trace_close(void)
+{
+	int i;
+	struct trace_event *ev = events;
+
+	if(!trace_fp) return;
+
+	fprintf(trace_fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	fprintf(trace_fp, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"csgray\"}}");
+	for(i=0; i<num_threads; i++) {
+		fprintf(trace_fp, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+				"\"args\": {\"name\": \"thread %d\"}}", i, i);
+	}
+
+	for(i=0; i<num_events; i++) {
+		fprintf(trace_fp, ",\n{\"name\": \"%s\", \"ph\": \"%c\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f",
+				ev->name, ev->phase, ev->tid, ev->usec);
+		if(ev->arg >= 0) {
+			fprintf(trace_fp, ", \"args\": {\"arg\": %d}", ev->arg);
+		}
+		fputc('}', trace_fp);
+		ev++;
+	}
+	fprintf(trace_fp, "\n]}\n");
+
+	fclose(trace_fp);
+	trace_fp = 0;
+
+	free(events);
+	events = 0;
+	num_events = max_events = 0;
+}
+
+void csg_trace_begin(const char *name, int arg)
+{
+	if(trace_fp) {
+		add_event(name, 'B', arg);
+	}
+}
+
+void csg_trace_end(const char *name)
+{
+	if(trace_fp) {
+		add_event(name, 'E', -1);
+	}
+}
+
+static void add_event(const char *name, char phase, int arg)
+{
+	struct trace_event *ev;
+	double usec = (get_time_nsec() - trace_start) * 1e-3;
+
+#pragma omp critical(trace)
+	{
+		if(trace_tid < 0) {
+			trace_tid = num_threads++;
+		}
+
+		if(num_events >= max_events) {
+			int newsz = max_events ? max_events * 2 : 1024;
+			if(!(ev = realloc(events, newsz * sizeof *events))) {
+				perror("failed to grow trace event buffer");
+				abort();
+			}
+			events = ev;
+			max_events = newsz;
+		}
+
+		ev = events + num_events++;
+		ev->name = name;
+		ev->phase = phase;
+		ev->tid = trace_tid;
+		ev->arg = arg;
+		ev->usec = usec;
+	}
+}
+
+#endif	/* CSG_TRACE */
@@ -17,13 +17,16 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <limits.h>
 #include <GL/freeglut.h>
 #include <resman.h>
 #include <pthread.h>
 #include "csgray.h"
 #include "mainloop.h"
 #include "matrix.h"
+#include "timer.h"
 #include "ui.h"
 
 #ifndef GL_FRAMEBUFFER_SRGB
@@ -33,6 +36,71 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define GL_RGB16F 0x881B
 #endif
 
+/* Frames are rendered by the render thread, a pass of one sample per pixel at
+ * a time, and display only shows the last pass it finished. The UI describes
+ * what to render in a job, and every change bumps its generation, which
+ * aborts the pass in flight and starts over, keeping what samples it can, see
+ * struct history.
+ */
+struct render_job {
+	int gen;
+	int scene_gen;			/* counts the scenes loaded */
+	int width, height;
+	float pos[3], targ[3];
+	csg_shader_func_type sdr;
+	int heat_metric, heat_scale;
+	int dbg_x, dbg_y;		/* debug pixel to select, or -1 */
+	int max_samples;
+	int reproject;
+};
+
+/* A pass renders one sample per pixel at the full resolution of its job, or
+ * a preview at a fraction of it, which starts a job while the camera moves and
+ * is refined up to the full resolution before accumulating samples.
+ */
+struct pass {
+	int width, height;
+	int div;				/* resolution divisor, 1 for the full resolution */
+	int sample;				/* fewest samples of any pixel, 0 for previews */
+	int first;				/* the first preview of its job, see abort_pass */
+	int heat_scale;			/* the effective CSG_OPT_HEATMAP_SCALE */
+	struct csg_stats stats;
+	unsigned int msec;
+};
+
+/* The samples accumulated at the full resolution of the last job, with how
+ * many each pixel has, and what the ray through its center hit. A new job with
+ * the same settings seen from another view takes them over by reprojection.
+ * Only the render thread uses it.
+ */
+struct history {
+	int valid;
+	struct render_job job;			/* the job it was rendered for */
+	float *accum;
+	int *count;
+	struct csg_pixel_hit *hits;
+	/* the next ones while reprojecting, swapped with the above */
+	float *next_accum;
+	int *next_count;
+	struct csg_pixel_hit *next_hits;
+
+	float *samples;					/* the pass being rendered */
+	unsigned char *mask;			/* pixels which need more samples */
+	unsigned char *rows;			/* rows finished by an aborted pass */
+	int max_pix, max_rows;
+};
+
+/* the coarsest preview, and how long a preview pass may take */
+#define MAX_PREVIEW_DIV	8
+#define PREVIEW_MSEC	30
+
+/* a pixel reprojected into the new view keeps its samples only if it hits the
+ * same primitive, with normals within this angle, at a depth within this
+ * fraction of the old one
+ */
+#define REPROJ_MIN_COS		0.9f
+#define REPROJ_DEPTH_TOL	0.02f
+
 static int init(void);
 static void cleanup(void);
 static void display(void);
@@ -42,6 +110,18 @@ static void skeydown(int key, int x, int y);
 static void mouse(int bn, int st, int x, int y);
 static void motion(int x, int y);
 static void redraw(void);
+static void draw_stats(struct csg_stats *st, unsigned int msec);
+static void *render_func(void *arg);
+static void apply_job(struct render_job *jb);
+static int abort_pass(void *cls);
+static int preview_div(struct render_job *jb, double nsec_per_pixel);
+static void alloc_history(int npix, int height);
+static int start_history(struct render_job *jb);
+static int same_settings(struct render_job *a, struct render_job *b);
+static void reproject(struct render_job *jb);
+static int update_mask(struct render_job *jb);
+static int blend_pass(struct render_job *jb, int *min_samples);
+static void publish(float *pixels, struct render_job *jb, struct pass *pass);
 
 static int load_func(const char *fname, int id, void *cls);
 static int done_func(int id, void *cls);
@@ -51,7 +131,7 @@ int win_width = 800, win_height = 600;
 static int tex_width, tex_height;
 static int fb_srgb = 1;
 
-static float *framebuf, *srgb_framebuf;
+static float *srgb_framebuf;
 
 static const char *fname = "scene.csg";
 
@@ -64,16 +144,35 @@ static int bnstate[8];
 
 static struct resman *resman;
 
-static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
-static int ready;
-static int use_dbg_sdr;
+static csg_shader_func_type dbg_sdr;	/* overrides def_sdr if non-null */
 
-static int render_pending = 1;
 static int max_samples = 1;
-static int sample;
+static int heat_metric, heat_scale;
+static int reproj = 1;
+
+static int show_stats;
+
+static pthread_t render_thread;
+/* guards job, ready, quit, and the front buffer */
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+/* held while the scene is rendered or replaced, taken before job_lock */
+static pthread_mutex_t scene_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct render_job job = {0, 0, 0, 0, {0}, {0}, 0, 0, 0, -1, -1, 1, 1};
+static int ready, quit, scene_gen;
+static int first_pass;		/* set by the render thread while it renders one */
+static struct history hist;
+
+/* the last finished pass, not uploaded yet if front_new is set */
+static struct pass front;
+static float *frontbuf;
+static int front_size, front_new;
 
 static csg_shader_func_type def_sdr = CSG_DEFAULT_SHADER;
 
+static const char *heat_metric_name[] = {"primitive tests", "CSG nodes", "intervals", "nanoseconds"};
+
 
 int main(int argc, char **argv)
 {
@@ -131,73 +230,78 @@ static int init(void)
 		return -1;
 	}
 	/*resman_wait_all(resman);*/
+
+	if(pthread_create(&render_thread, 0, render_func, 0) != 0) {
+		fprintf(stderr, "failed to start the render thread\n");
+		return -1;
+	}
 	return 0;
 }
 
 static void cleanup(void)
 {
+	pthread_mutex_lock(&job_lock);
+	quit = 1;
+	pthread_cond_signal(&job_cond);
+	pthread_mutex_unlock(&job_lock);
+	pthread_join(render_thread, 0);
+
 	resman_free(resman);
 }
 
 static void display(void)
 {
 	int i;
-	float theta, phi;
+	struct pass pass;
 
 	resman_poll(resman);
 
-	pthread_mutex_lock(&ready_lock);
+	pthread_mutex_lock(&job_lock);
 	if(!ready) {
-		pthread_mutex_unlock(&ready_lock);
+		pthread_mutex_unlock(&job_lock);
 		glClearColor(0.4, 0.1, 0.1, 1);
 		glClear(GL_COLOR_BUFFER_BIT);
 		glutSwapBuffers();
 		return;
 	}
-	pthread_mutex_unlock(&ready_lock);
 
-	if(tex_width != win_width || tex_height != win_height) {
-		long npixels;
-		tex_width = win_width;
-		tex_height = win_height;
-		printf("resizing texture: %dx%d\n", tex_width, tex_height);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, tex_width, tex_height, 0, GL_RGB, GL_FLOAT, 0);
+	if(front_new) {
+		/* previews are stretched over the window, in blocks of div pixels */
+		if(tex_width != front.width || tex_height != front.height) {
+			tex_width = front.width;
+			tex_height = front.height;
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, tex_width, tex_height, 0, GL_RGB, GL_FLOAT, 0);
 
-		npixels = win_width * win_height;
-		if(!(framebuf = realloc(framebuf, npixels * (fb_srgb ? 3 : 6) * sizeof *framebuf))) {
-			fprintf(stderr, "failed to allocate framebuffer\n");
-			abort();
+			if(!fb_srgb && !(srgb_framebuf = realloc(srgb_framebuf, tex_width * tex_height * 3 * sizeof *srgb_framebuf))) {
+				fprintf(stderr, "failed to allocate framebuffer\n");
+				abort();
+			}
 		}
-		srgb_framebuf = fb_srgb ? 0 : framebuf + npixels * 3;
-		sample = 0;
-	}
-
-	if(render_pending) {
-		theta = M_PI * cam_theta / 180.0f;
-		phi = M_PI * cam_phi / 180.0f;
-		cam_orbit_pos[0] = -sin(theta) * cos(phi) * cam_dist + cam_pos[0];
-		cam_orbit_pos[1] = sin(phi) * cam_dist + cam_pos[1];
-		cam_orbit_pos[2] = cos(theta) * cos(phi) * cam_dist + cam_pos[2];
-
-		csg_view(cam_orbit_pos[0], cam_orbit_pos[1], cam_orbit_pos[2], cam_pos[0], cam_pos[1], cam_pos[2]);
-
-		csg_render_image(framebuf, win_width, win_height, sample);
 
 		if(!fb_srgb) {
 			float inv_gamma = 1.0f / 2.2f;
-			int count = win_width * win_height * 3;
+			int count = tex_width * tex_height * 3;
 #pragma omp parallel for
 			for(i=0; i<count; i++) {
-				float *src = framebuf + i;
+				float *src = frontbuf + i;
 				float *dst = srgb_framebuf + i;
 				*dst = pow(*src, inv_gamma);
 			}
 			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, tex_width, tex_height, GL_RGB, GL_FLOAT, srgb_framebuf);
 		} else {
-			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, tex_width, tex_height, GL_RGB, GL_FLOAT, framebuf);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, tex_width, tex_height, GL_RGB, GL_FLOAT, frontbuf);
 		}
-		render_pending = 0;
-		++sample;
+		front_new = 0;
+	}
+	pass = front;
+	pthread_mutex_unlock(&job_lock);
+
+	if(!tex_width) {
+		/* the first pass isn't done yet */
+		glClearColor(0, 0, 0, 1);
+		glClear(GL_COLOR_BUFFER_BIT);
+		glutSwapBuffers();
+		return;
 	}
 
 	glBegin(GL_QUADS);
@@ -212,23 +316,49 @@ static void display(void)
 	glVertex2f(-1, 1);
 	glEnd();
 
-	if(sample < max_samples) {
-		post_redisplay();
-		render_pending = 1;
-
+	if(pass.div > 1) {
+		glColor3f(1, 1, 0);
+		glprintf(10, 10, "preview 1/%d", pass.div);
+	} else if(pass.sample < max_samples) {
 		glColor3f(1, 1, 0);
-		glprintf(10, 10, "sample %d/%d", sample, max_samples);
+		glprintf(10, 10, "sample %d/%d", pass.sample, max_samples);
+	}
+
+	if(dbg_sdr == CSG_HEATMAP_SHADER) {
+		glColor3f(1, 1, 1);
+		glprintf(10, 30, "heatmap: %s, white at %d", heat_metric_name[heat_metric], pass.heat_scale);
+	}
+	if(show_stats) {
+		draw_stats(&pass.stats, pass.msec);
 	}
 
 	glutSwapBuffers();
 }
 
+static void draw_stats(struct csg_stats *st, unsigned int msec)
+{
+	int y = win_height - 24;
+	unsigned long long nrays = st->primary_rays + st->shadow_rays + st->gi_rays;
+
+	glColor3f(0.3, 1, 0.3);
+	glprintf(10, y, "frame: %u ms", msec);
+	glprintf(10, y -= 20, "rays: %llu primary, %llu shadow, %llu GI", st->primary_rays,
+			st->shadow_rays, st->gi_rays);
+	glprintf(10, y -= 20, "primitive tests: %llu (%.1f/ray)", st->prim_tests,
+			nrays ? (double)st->prim_tests / nrays : 0.0);
+	glprintf(10, y -= 20, "CSG nodes: %llu (%.1f/ray), max depth %d", st->csg_nodes,
+			nrays ? (double)st->csg_nodes / nrays : 0.0, st->max_csg_depth);
+	glprintf(10, y -= 20, "intervals: %llu", st->intervals);
+	glprintf(10, y -= 20, "shader calls: %llu, light samples: %llu", st->shader_calls,
+			st->light_samples);
+}
+
 static void reshape(int x, int y)
 {
 	glViewport(0, 0, x, y);
 	win_width = x;
 	win_height = y;
-	render_pending = 1;
+	redraw();
 }
 
 static void keydown(unsigned char key, int x, int y)
@@ -244,15 +374,53 @@ static void keydown(unsigned char key, int x, int y)
 
 	case 'g':
 		def_sdr = def_sdr == CSG_DEFAULT_SHADER ? CSG_GI_SHADER : CSG_DEFAULT_SHADER;
-		if(!use_dbg_sdr) {
-			csg_shader(def_sdr, 0);
-		}
 		redraw();
 		break;
 
+	case 'h':
+		dbg_sdr = dbg_sdr == CSG_HEATMAP_SHADER ? 0 : CSG_HEATMAP_SHADER;
+		redraw();
+		break;
+
+	case 'm':
+		heat_metric = (heat_metric + 1) % CSG_NUM_HEAT_METRICS;
+		heat_scale = 0;
+		if(dbg_sdr == CSG_HEATMAP_SHADER) {
+			redraw();
+		}
+		break;
+
+	case ',':
+	case '.':
+		{
+			/* 0 is the default of the metric, which the last pass reports */
+			int scale = heat_scale;
+			if(!scale) {
+				pthread_mutex_lock(&job_lock);
+				scale = front.heat_scale;
+				pthread_mutex_unlock(&job_lock);
+			}
+			scale = key == '.' ? scale * 2 : scale / 2;
+			heat_scale = scale > 1 ? scale : 1;
+		}
+		if(dbg_sdr == CSG_HEATMAP_SHADER) {
+			redraw();
+		}
+		break;
+
+	case 's':
+		show_stats = !show_stats;
+		post_redisplay();
+		break;
+
 	case 'd':
-		use_dbg_sdr = !use_dbg_sdr;
-		csg_shader(use_dbg_sdr ? CSG_DEBUG_SHADER : def_sdr, 0);
+		dbg_sdr = dbg_sdr == CSG_DEBUG_SHADER ? 0 : CSG_DEBUG_SHADER;
+		redraw();
+		break;
+
+	case 'r':
+		reproj = !reproj;
+		printf("reprojection: %s\n", reproj ? "on" : "off");
 		redraw();
 		break;
 
@@ -294,7 +462,7 @@ static void keydown(unsigned char key, int x, int y)
 }
 
 static int pick_debug_pixel;
-extern int csg_dbg_pixel_x, csg_dbg_pixel_y;
+static int dbg_pixel_x = -1, dbg_pixel_y = -1;
 
 static void skeydown(int key, int x, int y)
 {
@@ -314,8 +482,8 @@ static void mouse(int bn, int st, int x, int y)
 	prev_y = y;
 
 	if(pick_debug_pixel && !press) {
-		csg_dbg_pixel_x = x;
-		csg_dbg_pixel_y = y;
+		dbg_pixel_x = x;
+		dbg_pixel_y = y;
 		pick_debug_pixel = 0;
 		glutSetCursor(GLUT_CURSOR_LEFT_ARROW);
 		redraw();
@@ -374,26 +542,435 @@ static void motion(int x, int y)
 	}
 }
 
+/* hands the current view and settings to the render thread, which starts over */
 static void redraw(void)
 {
-	sample = 0;
-	render_pending = 1;
+	float theta = M_PI * cam_theta / 180.0f;
+	float phi = M_PI * cam_phi / 180.0f;
+
+	cam_orbit_pos[0] = -sin(theta) * cos(phi) * cam_dist + cam_pos[0];
+	cam_orbit_pos[1] = sin(phi) * cam_dist + cam_pos[1];
+	cam_orbit_pos[2] = cos(theta) * cos(phi) * cam_dist + cam_pos[2];
+
+	pthread_mutex_lock(&job_lock);
+	job.gen++;
+	job.width = win_width;
+	job.height = win_height;
+	job.pos[0] = cam_orbit_pos[0];
+	job.pos[1] = cam_orbit_pos[1];
+	job.pos[2] = cam_orbit_pos[2];
+	job.targ[0] = cam_pos[0];
+	job.targ[1] = cam_pos[1];
+	job.targ[2] = cam_pos[2];
+	job.sdr = dbg_sdr ? dbg_sdr : def_sdr;
+	job.heat_metric = heat_metric;
+	job.heat_scale = heat_scale;
+	job.dbg_x = dbg_pixel_x;
+	job.dbg_y = dbg_pixel_y;
+	job.max_samples = max_samples;
+	job.reproject = reproj;
+	job.scene_gen = scene_gen;
+	pthread_cond_signal(&job_cond);
+	pthread_mutex_unlock(&job_lock);
+
+	dbg_pixel_x = dbg_pixel_y = -1;
 	post_redisplay();
 }
 
+/* Renders passes of the current job until every pixel has all its samples,
+ * and then waits for the next one. The scene is only touched with scene_lock
+ * held, so that load_func can replace it between passes, and abort_pass cuts
+ * the pass short when that's about to happen.
+ */
+static void *render_func(void *arg)
+{
+	int gen = -1, new_job = 0, sample = 0, todo = 0, div = 1, preview_start = 1, npix = 0, res;
+	double start, render_start = 0.0, nsec_per_pixel = 0.0;
+	struct render_job cur;
+	struct pass pass;
+
+	for(;;) {
+		pthread_mutex_lock(&job_lock);
+		while(!quit && (!ready || (job.gen == gen && div == 1 && !todo))) {
+			pthread_cond_wait(&job_cond, &job_lock);
+		}
+		if(quit) {
+			pthread_mutex_unlock(&job_lock);
+			break;
+		}
+		pthread_mutex_unlock(&job_lock);
+
+		pthread_mutex_lock(&scene_lock);
+
+		pthread_mutex_lock(&job_lock);
+		if(!ready) {
+			/* the scene is being reloaded */
+			pthread_mutex_unlock(&job_lock);
+			pthread_mutex_unlock(&scene_lock);
+			continue;
+		}
+		if(job.gen != gen) {
+			cur = job;
+			gen = job.gen;
+			new_job = 1;
+		}
+		pthread_mutex_unlock(&job_lock);
+
+		if(new_job) {
+			alloc_history(cur.width * cur.height, cur.height);
+			apply_job(&cur);
+			pass.heat_scale = csg_get_option(CSG_OPT_HEATMAP_SCALE);
+			div = preview_start = preview_div(&cur, nsec_per_pixel);
+			sample = 0;
+			todo = 1;
+			new_job = 0;
+		}
+
+		pass.width = (cur.width + div - 1) / div;
+		pass.height = (cur.height + div - 1) / div;
+		pass.div = div;
+		pass.first = !sample && div == preview_start && div > 1;
+		first_pass = pass.first;
+
+		csg_reset_stats();
+		start = get_time_nsec();
+		if(div > 1) {
+			csg_pixel_mask(0);
+			npix = pass.width * pass.height;
+			render_start = start;
+			res = csg_render_image(hist.samples, pass.width, pass.height, 0);
+		} else {
+			/* in full resolution pixels, so it's only traced once it's there */
+			if(!sample && cur.dbg_x >= 0) {
+				csg_debug_pixel(cur.dbg_x, cur.dbg_y);
+			}
+			if(!sample && start_history(&cur) == -1) {
+				res = -1;
+			} else {
+				npix = update_mask(&cur);
+				csg_pixel_mask(hist.mask);
+				render_start = get_time_nsec();
+				res = csg_render_image(hist.samples, pass.width, pass.height, sample);
+			}
+		}
+		csg_get_stats(&pass.stats);
+
+		pthread_mutex_unlock(&scene_lock);
+
+		if(res == -1) {
+			if(div == 1) {
+				/* keep the rows it finished */
+				blend_pass(&cur, &pass.sample);
+			}
+			if(!abort_pass(&cur)) {
+				/* nothing changed, so it failed, and would fail again */
+				fprintf(stderr, "failed to render the frame\n");
+				div = 1;
+				todo = 0;
+			}
+			continue;
+		}
+
+		pass.msec = (get_time_nsec() - start) / 1000000.0;
+		/* passes over a few reprojection holes say little about the rest */
+		if(npix > pass.width * pass.height / 4) {
+			nsec_per_pixel = (get_time_nsec() - render_start) / npix;
+		}
+		if(div > 1) {
+			pass.sample = 0;
+			div /= 2;
+			publish(hist.samples, &cur, &pass);
+		} else {
+			todo = blend_pass(&cur, &pass.sample);
+			sample++;
+			publish(hist.accum, &cur, &pass);
+		}
+	}
+
+	free(hist.accum);
+	free(hist.count);
+	free(hist.hits);
+	free(hist.next_accum);
+	free(hist.next_count);
+	free(hist.next_hits);
+	free(hist.samples);
+	free(hist.mask);
+	free(hist.rows);
+	return 0;
+}
+
+/* sets up the scene for the first pass of a job, with scene_lock held */
+static void apply_job(struct render_job *jb)
+{
+	csg_view(jb->pos[0], jb->pos[1], jb->pos[2], jb->targ[0], jb->targ[1], jb->targ[2]);
+	csg_shader(jb->sdr, 0);
+	csg_option(CSG_OPT_HEATMAP, jb->heat_metric);
+	csg_option(CSG_OPT_HEATMAP_SCALE, jb->heat_scale);
+	/* passes are averaged into the history by blend_pass */
+	csg_option(CSG_OPT_ACCUMULATE, 0);
+	csg_abort_func(abort_pass, jb);
+}
+
+/* Picks the resolution of the first pass of a job: the finest one which the
+ * last pass suggests takes at most PREVIEW_MSEC, so that the picture keeps up
+ * with the camera. Without a pass to go by, it starts with the coarsest.
+ */
+static int preview_div(struct render_job *jb, double nsec_per_pixel)
+{
+	int div = 1;
+	double npix = (double)jb->width * jb->height;
+
+	if(nsec_per_pixel <= 0.0) {
+		return MAX_PREVIEW_DIV;
+	}
+	while(div < MAX_PREVIEW_DIV && npix / (div * div) * nsec_per_pixel > PREVIEW_MSEC * 1000000.0) {
+		div *= 2;
+	}
+	return div;
+}
+
+/* Called by the render threads between rows: stops once the job changed, the
+ * scene is about to be reloaded, or the program is quitting. The first preview
+ * of a job is quick, and finished and shown even if the job changed meanwhile,
+ * because the camera can move faster than that, and nothing would be shown.
+ * Full resolution passes can take much longer, so they're always cut short.
+ */
+static int abort_pass(void *cls)
+{
+	struct render_job *jb = cls;
+	int res;
+
+	pthread_mutex_lock(&job_lock);
+	res = quit || !ready || (jb->gen != job.gen && !first_pass);
+	pthread_mutex_unlock(&job_lock);
+	return res;
+}
+
+static void alloc_history(int npix, int height)
+{
+	if(npix > hist.max_pix) {
+		free(hist.accum);
+		free(hist.count);
+		free(hist.hits);
+		free(hist.next_accum);
+		free(hist.next_count);
+		free(hist.next_hits);
+		free(hist.samples);
+		free(hist.mask);
+
+		hist.accum = malloc(npix * 3 * sizeof *hist.accum);
+		hist.count = malloc(npix * sizeof *hist.count);
+		hist.hits = malloc(npix * sizeof *hist.hits);
+		hist.next_accum = malloc(npix * 3 * sizeof *hist.next_accum);
+		hist.next_count = malloc(npix * sizeof *hist.next_count);
+		hist.next_hits = malloc(npix * sizeof *hist.next_hits);
+		hist.samples = malloc(npix * 3 * sizeof *hist.samples);
+		hist.mask = malloc(npix);
+
+		if(!hist.accum || !hist.count || !hist.hits || !hist.next_accum || !hist.next_count ||
+				!hist.next_hits || !hist.samples || !hist.mask) {
+			fprintf(stderr, "failed to allocate framebuffer\n");
+			abort();
+		}
+		hist.max_pix = npix;
+		hist.valid = 0;
+	}
+
+	if(height > hist.max_rows) {
+		free(hist.rows);
+		if(!(hist.rows = malloc(height))) {
+			fprintf(stderr, "failed to allocate framebuffer\n");
+			abort();
+		}
+		hist.max_rows = height;
+	}
+}
+
+/* Finds out what the pixels of the job see, and starts its history, with the
+ * samples of the last one reprojected if it can. Returns -1 if it's aborted.
+ */
+static int start_history(struct render_job *jb)
+{
+	void *tmp;
+
+	if(csg_render_hits(hist.next_hits, jb->width, jb->height) == -1) {
+		return -1;
+	}
+
+	if(jb->reproject && hist.valid && same_settings(&hist.job, jb)) {
+		reproject(jb);
+	} else {
+		memset(hist.next_count, 0, jb->width * jb->height * sizeof *hist.next_count);
+	}
+
+	tmp = hist.accum; hist.accum = hist.next_accum; hist.next_accum = tmp;
+	tmp = hist.count; hist.count = hist.next_count; hist.next_count = tmp;
+	tmp = hist.hits; hist.hits = hist.next_hits; hist.next_hits = tmp;
+	hist.job = *jb;
+	hist.valid = 1;
+	return 0;
+}
+
+/* whether the jobs render the same image, apart from the view */
+static int same_settings(struct render_job *a, struct render_job *b)
+{
+	return a->scene_gen == b->scene_gen && a->width == b->width && a->height == b->height &&
+		a->sdr == b->sdr && a->heat_metric == b->heat_metric && a->heat_scale == b->heat_scale &&
+		b->dbg_x < 0;
+}
+
+/* Each pixel of the new view takes the samples of the pixel which saw the same
+ * point in the view of the history, if that one hit the same primitive at the
+ * same depth, facing the same way. The rest, which the camera move uncovered,
+ * start over. Misses are never kept: they're cheap to render again, and the
+ * background depends on the ray direction.
+ */
+static void reproject(struct render_job *jb)
+{
+	int i, npix = jb->width * jb->height;
+	float *prev_pos = hist.job.pos;
+
+	/* csg_project needs the old view current */
+	csg_view(prev_pos[0], prev_pos[1], prev_pos[2], hist.job.targ[0], hist.job.targ[1], hist.job.targ[2]);
+
+#pragma omp parallel for
+	for(i=0; i<npix; i++) {
+		struct csg_pixel_hit *ph = hist.next_hits + i, *prev;
+		float pix[2], dx, dy, dz;
+		int x, y, src;
+
+		hist.next_count[i] = 0;
+		if(ph->id == -1 || csg_project(pix, ph->pos, jb->width, jb->height) == -1) {
+			continue;
+		}
+		x = (int)floor(pix[0] + 0.5f);
+		y = (int)floor(pix[1] + 0.5f);
+		if(x < 0 || y < 0 || x >= jb->width || y >= jb->height) {
+			continue;
+		}
+		src = y * jb->width + x;
+		prev = hist.hits + src;
+
+		if(prev->id != ph->id || prev->root != ph->root || prev->inst_path != ph->inst_path) {
+			continue;
+		}
+		if(prev->norm[0] * ph->norm[0] + prev->norm[1] * ph->norm[1] +
+				prev->norm[2] * ph->norm[2] < REPROJ_MIN_COS) {
+			continue;
+		}
+		dx = ph->pos[0] - prev_pos[0];
+		dy = ph->pos[1] - prev_pos[1];
+		dz = ph->pos[2] - prev_pos[2];
+		if(fabs(sqrt(dx * dx + dy * dy + dz * dz) - prev->depth) > prev->depth * REPROJ_DEPTH_TOL) {
+			continue;
+		}
+
+		hist.next_accum[i * 3] = hist.accum[src * 3];
+		hist.next_accum[i * 3 + 1] = hist.accum[src * 3 + 1];
+		hist.next_accum[i * 3 + 2] = hist.accum[src * 3 + 2];
+		hist.next_count[i] = hist.count[src];
+	}
+
+	csg_view(jb->pos[0], jb->pos[1], jb->pos[2], jb->targ[0], jb->targ[1], jb->targ[2]);
+}
+
+/* selects the pixels which need more samples, and returns how many there are */
+static int update_mask(struct render_job *jb)
+{
+	int i, npix = jb->width * jb->height, count = 0;
+
+#pragma omp parallel for reduction(+:count)
+	for(i=0; i<npix; i++) {
+		hist.mask[i] = hist.count[i] < jb->max_samples;
+		count += hist.mask[i];
+	}
+	return count;
+}
+
+/* Averages the pass into the history, in the rows it finished, and returns how
+ * many pixels still need more samples, and the fewest any pixel has in
+ * min_samples.
+ */
+static int blend_pass(struct render_job *jb, int *min_samples)
+{
+	int i, j, todo = 0, min = INT_MAX;
+
+	/* none if the pass was aborted before csg_render_image */
+	memset(hist.rows, 0, jb->height);
+	csg_rows_done(hist.rows);
+
+#pragma omp parallel for private(j) reduction(+:todo) reduction(min:min)
+	for(i=0; i<jb->height; i++) {
+		int p = i * jb->width;
+
+		for(j=0; j<jb->width; j++) {
+			if(hist.rows[i] && hist.mask[p]) {
+				float *dst = hist.accum + p * 3;
+				float *src = hist.samples + p * 3;
+				int n = hist.count[p]++;
+				float w = 1.0f / (float)(n + 1);
+				float wprev = w * (float)n;
+				dst[0] = dst[0] * wprev + src[0] * w;
+				dst[1] = dst[1] * wprev + src[1] * w;
+				dst[2] = dst[2] * wprev + src[2] * w;
+			}
+			if(hist.count[p] < min) min = hist.count[p];
+			if(hist.count[p] < jb->max_samples) todo++;
+			p++;
+		}
+	}
+
+	*min_samples = min;
+	return todo;
+}
+
+/* copies a finished pass to the front buffer, unless the job changed since,
+ * and it's not the first preview
+ */
+static void publish(float *pixels, struct render_job *jb, struct pass *pass)
+{
+	int npix = pass->width * pass->height;
+
+	pthread_mutex_lock(&job_lock);
+	if(jb->gen != job.gen && !pass->first) {
+		pthread_mutex_unlock(&job_lock);
+		return;
+	}
+
+	if(npix > front_size) {
+		free(frontbuf);
+		if(!(frontbuf = malloc(npix * 3 * sizeof *frontbuf))) {
+			fprintf(stderr, "failed to allocate framebuffer\n");
+			abort();
+		}
+		front_size = npix;
+	}
+	memcpy(frontbuf, pixels, npix * 3 * sizeof *frontbuf);
+	front = *pass;
+	front_new = 1;
+	pthread_mutex_unlock(&job_lock);
+
+	wakeup_main_loop();
+}
+
 static int load_func(const char *fname, int id, void *cls)
 {
-	pthread_mutex_lock(&ready_lock);
+	int res;
+
+	pthread_mutex_lock(&job_lock);
 	ready = 0;
-	pthread_mutex_unlock(&ready_lock);
+	scene_gen++;
+	pthread_mutex_unlock(&job_lock);
 
 	printf("loading %s\n", fname);
 
+	/* waits for the pass in flight to abort */
+	pthread_mutex_lock(&scene_lock);
 	csg_destroy();
 	csg_init();
-	csg_shader(use_dbg_sdr ? CSG_DEBUG_SHADER : def_sdr, 0);
-
-	return csg_load(fname);
+	res = csg_load(fname);
+	pthread_mutex_unlock(&scene_lock);
+	return res;
 }
 
 static int done_func(int id, void *cls)
@@ -405,8 +982,10 @@ static int done_func(int id, void *cls)
 		float dir[3], pos[3];
 		float rad;
 
+		pthread_mutex_lock(&scene_lock);
 		csg_get_view_position(dir);
 		csg_get_view_target(pos);
+		pthread_mutex_unlock(&scene_lock);
 
 		dir[0] -= pos[0];
 		dir[1] -= pos[1];
@@ -429,7 +1008,9 @@ static int done_func(int id, void *cls)
 		once = 1;
 	}
 
+	pthread_mutex_lock(&job_lock);
 	ready = 1;
+	pthread_mutex_unlock(&job_lock);
 
 	redraw();
 	return 0;
@@ -22,5 +22,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 void main_loop(struct resman *rman);
 void post_redisplay(void);
+/* makes the main loop redisplay, like post_redisplay, but from any thread */
+void wakeup_main_loop(void);
 
 #endif	/* MAINLOOP_H_ */
@@ -15,8 +15,10 @@ GNU General Public License for more details.
 You should have received a copy of the GNU General Public License
 along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
+#include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/select.h>
 #include <GL/freeglut.h>
 #include <GL/glx.h>
@@ -24,12 +26,23 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "mainloop.h"
 
 static int redraw_pending;
+/* written to by wakeup_main_loop, to break out of select */
+static int wake_fd[2] = {-1, -1};
 
 void main_loop(struct resman *rman)
 {
+	char buf[64];
 	Display *dpy = glXGetCurrentDisplay();
 	int xfd = ConnectionNumber(dpy);
 
+	if(pipe(wake_fd) == -1) {
+		perror("failed to create wakeup pipe");
+		wake_fd[0] = wake_fd[1] = -1;
+	} else {
+		fcntl(wake_fd[0], F_SETFL, fcntl(wake_fd[0], F_GETFL) | O_NONBLOCK);
+		fcntl(wake_fd[1], F_SETFL, fcntl(wake_fd[1], F_GETFL) | O_NONBLOCK);
+	}
+
 	for(;;) {
 		if(!redraw_pending) {
 			int num_rman_fds, res;
@@ -45,9 +58,17 @@ void main_loop(struct resman *rman)
 				FD_SET(rman_fds[i], &rdset);
 				if(rman_fds[i] > maxfd) maxfd = rman_fds[i];
 			}
+			if(wake_fd[0] != -1) {
+				FD_SET(wake_fd[0], &rdset);
+				if(wake_fd[0] > maxfd) maxfd = wake_fd[0];
+			}
 
 			while((res = select(maxfd + 1, &rdset, 0, 0, 0)) == -1 && errno == EINTR);
 
+			if(res > 0 && wake_fd[0] != -1 && FD_ISSET(wake_fd[0], &rdset)) {
+				while(read(wake_fd[0], buf, sizeof buf) > 0);
+			}
+
 			if((res > 0 && !FD_ISSET(xfd, &rdset)) || res > 1) {
 				glutPostRedisplay();
 			}
@@ -63,3 +84,13 @@ void post_redisplay(void)
 	redraw_pending = 1;
 	glutPostRedisplay();
 }
+
+void wakeup_main_loop(void)
+{
+	char c = 0;
+
+	if(wake_fd[1] != -1) {
+		/* a full pipe will wake it up anyway */
+		while(write(wake_fd[1], &c, 1) == -1 && errno == EINTR);
+	}
+}
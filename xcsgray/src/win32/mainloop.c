@@ -21,16 +21,38 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "mainloop.h"
 
 static int redraw_pending;
+/* signalled by wakeup_main_loop */
+static HANDLE wake_ev;
 
 void main_loop(struct resman *rman)
 {
+	int i;
+	HANDLE wait_handles[MAXIMUM_WAIT_OBJECTS];
+
+	if(!(wake_ev = CreateEvent(0, FALSE, FALSE, 0))) {
+		fprintf(stderr, "failed to create wakeup event: %u\n", (unsigned int)GetLastError());
+	}
+
 	for(;;) {
 		if(!redraw_pending) {
 			int num_handles;
 			unsigned int idx;
 			void **handles = resman_get_wait_handles(rman, &num_handles);
 
-			idx = MsgWaitForMultipleObjects(num_handles, handles, 0, INFINITE, QS_ALLEVENTS);
+			/* MsgWaitForMultipleObjects takes at most MAXIMUM_WAIT_OBJECTS - 1
+			 * handles, and the wakeup event needs one of them
+			 */
+			if(num_handles > MAXIMUM_WAIT_OBJECTS - 2) {
+				num_handles = MAXIMUM_WAIT_OBJECTS - 2;
+			}
+			for(i=0; i<num_handles; i++) {
+				wait_handles[i] = handles[i];
+			}
+			if(wake_ev) {
+				wait_handles[num_handles++] = wake_ev;
+			}
+
+			idx = MsgWaitForMultipleObjects(num_handles, wait_handles, 0, INFINITE, QS_ALLEVENTS);
 			if(idx == WAIT_FAILED) {
 				unsigned int err = GetLastError();
 				fprintf(stderr, "failed to wait for events: %u\n", err);
@@ -51,3 +73,10 @@ void post_redisplay(void)
 	redraw_pending = 1;
 	glutPostRedisplay();
 }
+
+void wakeup_main_loop(void)
+{
+	if(wake_ev) {
+		SetEvent(wake_ev);
+	}
+}